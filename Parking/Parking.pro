@@ -12,26 +12,35 @@ TARGET = Parking
 TEMPLATE = app
 
 
-SOURCES += bspline.cpp \
+SOURCES += benchmark.cpp \
+	   bspline.cpp \
 	   chunck3ds_reader.cpp  \
 	   dxf_reader.cpp  \
 	   geometry.cpp  \
 	   iges_reader.cpp \
 	   main.cpp  \
+	   mapped_file.cpp  \
 	   mgl.cpp  \
+	   parallel.cpp  \
 	   parking.cpp \
-	   stl_reader.cpp
+	   stl_reader.cpp \
+	   weld.cpp
 
-HEADERS  += bspline.h \
+HEADERS  += benchmark.h \
+	    bspline.h \
 	    chunck3ds_reader.h  \
 	    coord_system.h \
 	    dxf_reader.h  \
 	    geometry.h  \
 	    iges_reader.h \
+	    mapped_file.h  \
 	    mgl.h  \
 	    myvector.h  \
+	    numparse.h  \
+	    parallel.h  \
 	    parking.h	\
 	    stl_reader.h  \
-	    vector3d.h
+	    vector3d.h \
+	    weld.h
 
 FORMS    += parking.ui
@@ -0,0 +1,1047 @@
+#include "benchmark.h"
+
+#include "geometry.h"
+#include "stl_reader.h"
+#include "dxf_reader.h"
+#include "chunck3ds_reader.h"
+#include "iges_reader.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <qdebug.h>
+#include <QElapsedTimer>
+
+
+static void report(const char *what,long long bytes,long long count,const char *unit,long long msec)
+{
+	double sec=msec/1000.;
+	if (sec<=0) sec=1e-3;
+	qDebug("%-28s %8lld msec %10.1f MB/s %14.0f %s/s",what,msec,bytes/(1024.*1024.)/sec,count/sec,unit);
+}
+
+
+/*Step of a thread benchmark on a fresh geometry, ctx as given to benchThreads*/
+typedef void (*BenchFunc)(Geometry *geom,void *ctx);
+
+/*
+ Times run for 1 to maxThreads loader threads, each time on a fresh
+ geometry that prepare (if given) sets up first; count is reported per second
+*/
+static void benchThreads(const char *what,BenchFunc prepare,BenchFunc run,void *ctx,long long bytes,long long count,const char *unit,int maxThreads)
+{
+	QElapsedTimer t;
+	int threads;
+	for (threads=1; threads<=maxThreads; threads++) {
+		char label[64];
+		sprintf(label,"%s, %d threads",what,threads);
+		Geometry geom;
+		geom.loadThreads=threads;
+		if (prepare) prepare(&geom,ctx);
+		t.start();
+		run(&geom,ctx);
+		report(label,bytes,count,unit,t.elapsed());
+	}
+}
+
+/*The readers as benchmark steps, ctx is the file name*/
+static void readSTLStep(Geometry *geom,void *ctx)
+{
+	readSTL(geom,(const char *)ctx);
+}
+
+static void readSTLUnweldedStep(Geometry *geom,void *ctx)
+{
+	geom->weldOnLoad=0;
+	readSTL(geom,(const char *)ctx);
+}
+
+static void readDXFStep(Geometry *geom,void *ctx)
+{
+	readDXF(geom,(const char *)ctx);
+}
+
+static void readIGESStep(Geometry *geom,void *ctx)
+{
+	readIGES(geom,(const char *)ctx);
+}
+
+
+/*Binary STL of a flat lattice, two triangles per quad*/
+static long long writeSyntheticSTL(const char *name,unsigned int ntria)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	char header[80];
+	memset(header,0,sizeof(header));
+	strcpy(header,"Parking synthetic benchmark");
+	fwrite(header,sizeof(char),80,fp);
+	fwrite(&ntria,sizeof(unsigned int),1,fp);
+
+	unsigned int n=(unsigned int)ceil(sqrt(ntria/2.+1));
+	const int chunk=4096;
+	unsigned char *buffer=(unsigned char *)malloc(chunk*50);
+	unsigned int k;
+	int len=0;
+	for (k=0; k<ntria; k++) {
+		unsigned int q=k/2;
+		float x=(float)(q%n);
+		float y=(float)(q/n);
+		float data[4][3]={{0,0,1},{x,y,0},{x+1,y,0},{x+1,y+1,0}};
+		if (k&1) {
+			data[2][0]=x+1; data[2][1]=y+1;
+			data[3][0]=x; data[3][1]=y+1;
+		}
+		unsigned char *rec=&buffer[50*len];
+		memcpy(rec,data,sizeof(data));
+		rec[48]=0; rec[49]=0;
+		len++;
+		if (len==chunk) {
+			fwrite(buffer,50,len,fp);
+			len=0;
+		}
+	}
+	if (len) fwrite(buffer,50,len,fp);
+	free(buffer);
+	fclose(fp);
+
+	return 84+50LL*ntria;
+}
+
+
+/*Same lattice as writeSyntheticSTL, written as ASCII STL*/
+static long long writeSyntheticAsciiSTL(const char *name,unsigned int ntria)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	fprintf(fp,"solid synthetic\n");
+	unsigned int n=(unsigned int)ceil(sqrt(ntria/2.+1));
+	unsigned int k;
+	for (k=0; k<ntria; k++) {
+		unsigned int q=k/2;
+		float x=(float)(q%n)*0.125f;
+		float y=(float)(q/n)*0.125f;
+		float d=0.125f;
+		fprintf(fp,"  facet normal %e %e %e\n    outer loop\n",0.,0.,1.);
+		if (k&1) {
+			fprintf(fp,"      vertex %e %e %e\n",x,y,0.);
+			fprintf(fp,"      vertex %e %e %e\n",x+d,y+d,0.);
+			fprintf(fp,"      vertex %e %e %e\n",x,y+d,0.);
+		} else {
+			fprintf(fp,"      vertex %e %e %e\n",x,y,0.);
+			fprintf(fp,"      vertex %e %e %e\n",x+d,y,0.);
+			fprintf(fp,"      vertex %e %e %e\n",x+d,y+d,0.);
+		}
+		fprintf(fp,"    endloop\n  endfacet\n");
+	}
+	fprintf(fp,"endsolid synthetic\n");
+
+	long long bytes=ftell(fp);
+	fclose(fp);
+	return bytes;
+}
+
+
+static void benchSTL(unsigned int ntria)
+{
+	const char *name="parking_bench.stl";
+	long long bytes=writeSyntheticSTL(name,ntria);
+	if (!bytes) return;
+
+	QElapsedTimer t;
+	{
+		Geometry geom;
+		t.start();
+		readSTLStream(&geom,name);
+		report("STL fread reader",bytes,ntria,"triangles",t.elapsed());
+	}
+	{
+		Geometry geom;
+		geom.weldOnLoad=0;
+		t.start();
+		readSTL(&geom,name);
+		report("STL mapped reader",bytes,ntria,"triangles",t.elapsed());
+	}
+
+	/*Normals recalculated as loadSTL does by default, or taken from the file*/
+	int trust;
+	for (trust=0; trust<2; trust++) {
+		Geometry geom;
+		geom.weldOnLoad=0;
+		geom.trustFileNormals=trust;
+		t.start();
+		readSTL(&geom,name);
+		if (!trust) geom.calcTrianglesNormals();
+		report(trust ? "STL read, file normals" : "STL read + normals",bytes,ntria,"triangles",t.elapsed());
+	}
+
+	remove(name);
+}
+
+
+static void benchSTLThreads(unsigned int ntria,int maxThreads)
+{
+	const char *name="parking_bench.stl";
+	long long bytes=writeSyntheticSTL(name,ntria);
+	if (!bytes) return;
+
+	benchThreads("STL mapped",0,readSTLUnweldedStep,(void *)name,bytes,ntria,"triangles",maxThreads);
+	benchThreads("STL mapped welded",0,readSTLStep,(void *)name,bytes,ntria,"triangles",maxThreads);
+
+	remove(name);
+}
+
+
+static void benchSTLWeld(unsigned int ntria)
+{
+	const char *name="parking_bench.stl";
+	long long bytes=writeSyntheticSTL(name,ntria);
+	if (!bytes) return;
+
+	QElapsedTimer t;
+	{
+		Geometry geom;
+		geom.weldOnLoad=0;
+		t.start();
+		readSTL(&geom,name);
+		unsigned int peak=geom.grids.length();
+		geom.compressGrids();
+		report("STL read + compressGrids",bytes,ntria,"triangles",t.elapsed());
+		qDebug("    peak grids %u (%.1f MB), welded to %u",peak,peak*sizeof(Grid)/(1024.*1024.),geom.grids.length());
+	}
+	{
+		Geometry geom;
+		t.start();
+		readSTL(&geom,name);
+		report("STL read with weld",bytes,ntria,"triangles",t.elapsed());
+		qDebug("    peak grids %u (%.1f MB)",geom.grids.length(),geom.grids.length()*sizeof(Grid)/(1024.*1024.));
+	}
+
+	remove(name);
+}
+
+
+/*
+ Triangle soup of a side x side lattice, six grids per quad as a reader
+ without welding leaves it. Every third copy is moved by a fifth of the
+ weld tolerance, so near duplicates that sort apart are mixed in
+*/
+static void fillWeldSoup(Geometry &geom,unsigned int side)
+{
+	float jitter=0.2f*geom.weldTolerance*side*sqrt(2.);
+	unsigned int i,j;
+	int k,n=0;
+	geom.grids.reserve(6*side*side);
+	geom.triangles.reserve(2*side*side);
+	for (j=0; j<side; j++) {
+		for (i=0; i<side; i++) {
+			const int corner[6][2]={{0,0},{1,0},{1,1},{0,0},{1,1},{0,1}};
+			int g[6];
+			for (k=0; k<6; k++) {
+				float x=i+corner[k][0];
+				if (n++%3==2) x+=(n&8) ? jitter : -jitter;
+				g[k]=geom.addGrid(x,j+corner[k][1],0.01f*((i+corner[k][0])%7));
+			}
+			geom.addTriangle(g[0],g[1],g[2],NULL);
+			geom.addTriangle(g[3],g[4],g[5],NULL);
+		}
+	}
+}
+
+
+static void fillWeldSoupStep(Geometry *geom,void *ctx)
+{
+	fillWeldSoup(*geom,*(unsigned int *)ctx);
+}
+
+static void compressGridsStep(Geometry *geom,void *ctx)
+{
+	geom->compressGrids();
+}
+
+static void benchWeld(unsigned int vertices,int maxThreads)
+{
+	unsigned int side=(unsigned int)sqrt(vertices/6.);
+	unsigned int n=6*side*side;
+	QElapsedTimer t;
+	{
+		Geometry geom;
+		fillWeldSoup(geom,side);
+		t.start();
+		geom.compressGridsSorted();
+		report("compressGrids, qsort",n*sizeof(Grid),n,"grids",t.elapsed());
+		qDebug("    %u grids welded to %u",n,geom.grids.length());
+	}
+	benchThreads("compressGrids hash",fillWeldSoupStep,compressGridsStep,&side,n*sizeof(Grid),n,"grids",maxThreads);
+}
+
+
+static void benchAsciiSTL(unsigned int ntria)
+{
+	const char *name="parking_bench_ascii.stl";
+	long long bytes=writeSyntheticAsciiSTL(name,ntria);
+	if (!bytes) return;
+
+	QElapsedTimer t;
+	Geometry geom;
+	t.start();
+	readSTL(&geom,name);
+	report("ASCII STL mapped reader",bytes,ntria,"triangles",t.elapsed());
+
+	remove(name);
+}
+
+
+/*ASCII DXF with n LINE entities laid out like a site plan grid*/
+static long long writeSyntheticDXF(const char *name,unsigned int n)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	fprintf(fp,"  0\nSECTION\n  2\nENTITIES\n");
+	unsigned int side=(unsigned int)ceil(sqrt((double)n));
+	unsigned int k;
+	for (k=0; k<n; k++) {
+		double x=(k%side)*2.5;
+		double y=(k/side)*5.0;
+		fprintf(fp,"  0\nLINE\n  8\nPARKING\n 10\n%.4f\n 20\n%.4f\n 30\n0.0\n 11\n%.4f\n 21\n%.4f\n 31\n0.0\n",
+			x,y,x+2.5,y+5.0);
+	}
+	fprintf(fp,"  0\nENDSEC\n  0\nEOF\n");
+
+	long long bytes=ftell(fp);
+	fclose(fp);
+	return bytes;
+}
+
+
+/*Group writers for the binary DXF form (two byte group codes, R13 and later)*/
+static void writeBinaryCode(FILE *fp,short code)
+{
+	fwrite(&code,sizeof(short),1,fp);
+}
+
+static void writeBinaryString(FILE *fp,short code,const char *value)
+{
+	writeBinaryCode(fp,code);
+	fwrite(value,sizeof(char),strlen(value)+1,fp);
+}
+
+static void writeBinaryDouble(FILE *fp,short code,double value)
+{
+	writeBinaryCode(fp,code);
+	fwrite(&value,sizeof(double),1,fp);
+}
+
+
+/*Same drawing as writeSyntheticDXF, written as binary DXF*/
+static long long writeSyntheticBinaryDXF(const char *name,unsigned int n)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	fwrite("AutoCAD Binary DXF\r\n\x1a",sizeof(char),22,fp);
+	writeBinaryString(fp,0,"SECTION");
+	writeBinaryString(fp,2,"ENTITIES");
+	unsigned int side=(unsigned int)ceil(sqrt((double)n));
+	unsigned int k;
+	for (k=0; k<n; k++) {
+		double x=(k%side)*2.5;
+		double y=(k/side)*5.0;
+		writeBinaryString(fp,0,"LINE");
+		writeBinaryString(fp,8,"PARKING");
+		writeBinaryDouble(fp,10,x);
+		writeBinaryDouble(fp,20,y);
+		writeBinaryDouble(fp,30,0);
+		writeBinaryDouble(fp,11,x+2.5);
+		writeBinaryDouble(fp,21,y+5.0);
+		writeBinaryDouble(fp,31,0);
+	}
+	writeBinaryString(fp,0,"ENDSEC");
+	writeBinaryString(fp,0,"EOF");
+
+	long long bytes=ftell(fp);
+	fclose(fp);
+	return bytes;
+}
+
+
+static void benchDXF(unsigned int n)
+{
+	const char *name="parking_bench.dxf";
+	QElapsedTimer t;
+
+	long long bytes=writeSyntheticDXF(name,n);
+	if (bytes) {
+		Geometry geom;
+		t.start();
+		readDXF(&geom,name);
+		report("DXF reader",bytes,n,"entities",t.elapsed());
+	}
+
+	bytes=writeSyntheticBinaryDXF(name,n);
+	if (bytes) {
+		Geometry geom;
+		t.start();
+		readDXF(&geom,name);
+		report("Binary DXF reader",bytes,n,"entities",t.elapsed());
+	}
+
+	remove(name);
+}
+
+
+static void benchDXFThreads(unsigned int n,int maxThreads)
+{
+	const char *name="parking_bench.dxf";
+	long long bytes=writeSyntheticDXF(name,n);
+	if (!bytes) return;
+
+	benchThreads("DXF reader",0,readDXFStep,(void *)name,bytes,n,"entities",maxThreads);
+
+	remove(name);
+}
+
+
+/*Terrain of n x n quads, as 3DFACE entities or as one polyface mesh*/
+static long long writeSyntheticMeshDXF(const char *name,unsigned int n,int polyface)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	fprintf(fp,"  0\nSECTION\n  2\nENTITIES\n");
+	unsigned int i,j;
+	if (polyface) {
+		fprintf(fp,"  0\nPOLYLINE\n 66\n1\n 70\n64\n 71\n%u\n 72\n%u\n",(n+1)*(n+1),n*n);
+		for (i=0; i<=n; i++) {
+			for (j=0; j<=n; j++) {
+				fprintf(fp,"  0\nVERTEX\n 10\n%.4f\n 20\n%.4f\n 30\n%.4f\n 70\n192\n",i*0.5,j*0.5,sin(i*0.1)*cos(j*0.1));
+			}
+		}
+		for (i=0; i<n; i++) {
+			for (j=0; j<n; j++) {
+				unsigned int a=i*(n+1)+j+1;
+				fprintf(fp,"  0\nVERTEX\n 10\n0\n 20\n0\n 30\n0\n 70\n128\n 71\n%u\n 72\n%u\n 73\n%u\n 74\n%u\n",a,a+n+1,a+n+2,a+1);
+			}
+		}
+		fprintf(fp,"  0\nSEQEND\n");
+	} else {
+		for (i=0; i<n; i++) {
+			for (j=0; j<n; j++) {
+				double x[4]={i*0.5,(i+1)*0.5,(i+1)*0.5,i*0.5};
+				double y[4]={j*0.5,j*0.5,(j+1)*0.5,(j+1)*0.5};
+				int di[4]={0,1,1,0},dj[4]={0,0,1,1};
+				fprintf(fp,"  0\n3DFACE\n");
+				int k;
+				for (k=0; k<4; k++) {
+					fprintf(fp," 1%d\n%.4f\n 2%d\n%.4f\n 3%d\n%.4f\n",k,x[k],k,y[k],k,sin((i+di[k])*0.1)*cos((j+dj[k])*0.1));
+				}
+			}
+		}
+	}
+	fprintf(fp,"  0\nENDSEC\n  0\nEOF\n");
+
+	long long bytes=ftell(fp);
+	fclose(fp);
+	return bytes;
+}
+
+
+static void benchDXFMesh(unsigned int n)
+{
+	const char *name="parking_bench_mesh.dxf";
+	int polyface;
+	for (polyface=0; polyface<2; polyface++) {
+		long long bytes=writeSyntheticMeshDXF(name,n,polyface);
+		if (!bytes) return;
+
+		QElapsedTimer t;
+		Geometry geom;
+		t.start();
+		readDXF(&geom,name);
+		unsigned int peak=geom.grids.length();
+		if (!geom.gridsWelded) geom.compressGrids();
+		report(polyface ? "DXF polyface mesh" : "DXF 3DFACE mesh",bytes,n*n,"quads",t.elapsed());
+		qDebug("    peak grids %u (%.1f MB), welded to %u",peak,peak*sizeof(Grid)/(1024.*1024.),geom.grids.length());
+	}
+
+	remove(name);
+}
+
+
+static void write3DSChunk(FILE *fp,unsigned short id,unsigned int len)
+{
+	fwrite(&id,sizeof(unsigned short),1,fp);
+	fwrite(&len,sizeof(unsigned int),1,fp);
+}
+
+
+/*Materials of the synthetic 3DS scene, named mat0..mat7*/
+static const unsigned int BENCH_3DS_MATERIALS=8;
+
+/*
+ 3DS scene of objects, each a corrugated lattice of side x side quads with a
+ smoothing group per quad column (4 groups). The quads of a row cycle through
+ the materials, so every object needs its faces sorted
+*/
+static long long writeSynthetic3DS(const char *name,unsigned int objects,unsigned int side)
+{
+	FILE *fp=fopen(name,"wb");
+	if (!fp) return 0;
+
+	unsigned int nv=(side+1)*(side+1);
+	unsigned int nf=2*side*side;
+	unsigned int vlen=6+2+12*nv;
+	unsigned int slen=6+4*nf;
+	unsigned int matlen=6+(6+5)+(6+6+3);
+	unsigned int fmlen=BENCH_3DS_MATERIALS*(6+5+2)+2*nf;
+	unsigned int flen=6+2+8*nf+fmlen+slen;
+	unsigned int mlen=6+vlen+flen;
+	unsigned int olen=6+11+mlen;
+	unsigned int elen=6+BENCH_3DS_MATERIALS*matlen+objects*olen;
+
+	write3DSChunk(fp,0x4d4d,6+elen);
+	write3DSChunk(fp,0x3d3d,elen);
+
+	unsigned int m;
+	char matName[8];
+	for (m=0; m<BENCH_3DS_MATERIALS; m++) {
+		unsigned char rgb[3]={(unsigned char)(m*32),(unsigned char)(255-m*32),128};
+		sprintf(matName,"mat%u",m);
+		write3DSChunk(fp,0xafff,matlen);
+		write3DSChunk(fp,0xa000,6+5);
+		fwrite(matName,1,5,fp);
+		write3DSChunk(fp,0xa020,6+6+3);
+		write3DSChunk(fp,0x11,6+3);
+		fwrite(rgb,1,3,fp);
+	}
+
+	float *v=(float *)malloc(12*nv);
+	unsigned short *f=(unsigned short *)malloc(8*nf);
+	unsigned int *g=(unsigned int *)malloc(4*nf);
+	unsigned short *mf=(unsigned short *)malloc(2*nf);
+	unsigned int o,i,j;
+	for (o=0; o<objects; o++) {
+		char objName[16];
+		sprintf(objName,"obj%07u",o%10000000);
+		write3DSChunk(fp,0x4000,olen);
+		fwrite(objName,1,11,fp);
+		write3DSChunk(fp,0x4100,mlen);
+
+		for (i=0; i<=side; i++) {
+			for (j=0; j<=side; j++) {
+				float *x=&v[3*(i*(side+1)+j)];
+				x[0]=(float)i+o*(side+1);
+				x[1]=(float)j;
+				x[2]=(float)(i&1);
+			}
+		}
+		write3DSChunk(fp,0x4110,vlen);
+		unsigned short n=nv;
+		fwrite(&n,sizeof(unsigned short),1,fp);
+		fwrite(v,12,nv,fp);
+
+		unsigned short *q=f;
+		for (i=0; i<side; i++) {
+			for (j=0; j<side; j++) {
+				unsigned short a=i*(side+1)+j;
+				q[0]=a; q[1]=a+side+1; q[2]=a+side+2; q[3]=6;
+				q[4]=a; q[5]=a+side+2; q[6]=a+1; q[7]=3;
+				q+=8;
+				g[2*(i*side+j)]=g[2*(i*side+j)+1]=1<<(i&3);
+			}
+		}
+		write3DSChunk(fp,0x4120,flen);
+		n=nf;
+		fwrite(&n,sizeof(unsigned short),1,fp);
+		fwrite(f,8,nf,fp);
+		for (m=0; m<BENCH_3DS_MATERIALS; m++) {
+			unsigned short count=0;
+			for (i=0; i<nf; i++) {
+				if ((i/2+o)%BENCH_3DS_MATERIALS==m) mf[count++]=i;
+			}
+			sprintf(matName,"mat%u",m);
+			write3DSChunk(fp,0x4130,6+5+2+2*count);
+			fwrite(matName,1,5,fp);
+			fwrite(&count,sizeof(unsigned short),1,fp);
+			fwrite(mf,2,count,fp);
+		}
+		write3DSChunk(fp,0x4150,slen);
+		fwrite(g,4,nf,fp);
+	}
+	free(v);
+	free(f);
+	free(g);
+	free(mf);
+
+	long long bytes=ftell(fp);
+	fclose(fp);
+	return bytes;
+}
+
+
+static void bench3DS(unsigned int objects)
+{
+	const char *name="parking_bench.3ds";
+	const unsigned int side=100;
+	long long bytes=writeSynthetic3DS(name,objects,side);
+	if (!bytes) return;
+
+	QElapsedTimer t;
+	Geometry geom;
+	t.start();
+	readChunck3DS(&geom,name);
+	report("3DS mapped reader",bytes,geom.triangles.length(),"triangles",t.elapsed());
+
+	/*Opening through the index, then one object on demand with its normals*/
+	Chunck3DSIndex index;
+	t.restart();
+	index.open(name);
+	report("3DS chunk index",bytes,index.objects.length(),"objects",t.elapsed());
+
+	Geometry one;
+	t.restart();
+	int o=index.loadObject(&one,index.objects.length()/2);
+	if (o!=-1) one.calcObjectNormals(o);
+	report("3DS one object on demand",bytes,one.triangles.length(),"triangles",t.elapsed());
+
+	geom.calcTrianglesNormals();
+	t.restart();
+	geom.calcTrianglesGroupNormals();
+	report("3DS smoothing group normals",bytes,geom.triangles.length(),"triangles",t.elapsed());
+
+	geom.hasSmoothNormals=0;
+	t.restart();
+	geom.calcTrianglesSmoothNormals();
+	report("3DS adjacency smooth normals",bytes,geom.triangles.length(),"triangles",t.elapsed());
+
+	remove(name);
+}
+
+
+/*
+ Writes IGES entities: the parameter data goes to a temporary file in 64
+ column records, the directory entries to another one; finish puts the
+ sections together
+*/
+class IGESBenchWriter {
+	FILE *directory;
+	FILE *parameter;
+	char line[65];
+	int lineLen;
+	int type;
+	int firstRecord;
+
+	void flush() {
+		fprintf(parameter,"%-64s%8d%c%7d\n",line,2*entities+1,'P',records+1);
+		records++;
+		lineLen=0;
+		line[0]=0;
+	}
+
+	void add(const char *token) {
+		int len=strlen(token);
+		if (lineLen+len+1>64) flush();
+		lineLen+=sprintf(line+lineLen,"%s,",token);
+	}
+
+public:
+	int entities;
+	int records;
+
+	IGESBenchWriter() {
+		directory=tmpfile();
+		parameter=tmpfile();
+		lineLen=0;
+		line[0]=0;
+		entities=0;
+		records=0;
+	}
+
+	~IGESBenchWriter() {
+		if (directory) fclose(directory);
+		if (parameter) fclose(parameter);
+	}
+
+	int ok() const {return directory && parameter;}
+
+	void begin(int entityType) {
+		type=entityType;
+		firstRecord=records+1;
+		addInt(entityType);
+	}
+
+	void addInt(int v) {
+		char token[16];
+		sprintf(token,"%d",v);
+		add(token);
+	}
+
+	/*Reals in Fortran style, as most CAD systems write them*/
+	void addReal(double v) {
+		char token[32];
+		sprintf(token,"%.9E",v);
+		char *e=strchr(token,'E');
+		if (e) *e='D';
+		add(token);
+	}
+
+	/*Hollerith string, shorter than a record*/
+	void addString(const char *v) {
+		char token[64];
+		sprintf(token,"%dH%.56s",(int)strlen(v),v);
+		add(token);
+	}
+
+	/*Ends the entity, returns its directory entry number*/
+	int end(int transform,int form) {
+		line[lineLen-1]=';';
+		flush();
+		int de=2*entities+1;
+		fprintf(directory,"%8d%8d%8d%8d%8d%8d%8d%8d%8s%c%7d\n",type,firstRecord,0,0,0,0,transform,0,"00000000",'D',de);
+		fprintf(directory,"%8d%8d%8d%8d%8d%8s%8s%8s%8d%c%7d\n",type,0,0,records-firstRecord+1,form,"","","",0,'D',de+1);
+		entities++;
+		return de;
+	}
+
+	long long finish(const char *name) {
+		FILE *fp=fopen(name,"wb");
+		if (!fp) return 0;
+		fprintf(fp,"%-72s%c%7d\n","Parking synthetic benchmark",'S',1);
+		fprintf(fp,"%-72s%c%7d\n","1H,,1H;,9Hbenchmark,8Hbench.igs,7HParking,7HParking,32,38,6,308,15;",'G',1);
+
+		FILE *parts[2]={directory,parameter};
+		char buffer[65536];
+		int k;
+		for (k=0; k<2; k++) {
+			rewind(parts[k]);
+			size_t n;
+			while ((n=fread(buffer,1,sizeof(buffer),parts[k]))>0) fwrite(buffer,1,n,fp);
+		}
+		char counts[80];
+		sprintf(counts,"S%7dG%7dD%7dP%7d",1,1,2*entities,records);
+		fprintf(fp,"%-72s%c%7d\n",counts,'T',1);
+
+		long long bytes=ftell(fp);
+		fclose(fp);
+		return bytes;
+	}
+};
+
+
+/*Clamped uniform knots of a cubic with K+1 control points*/
+static void addIGESKnots(IGESBenchWriter &W,int K)
+{
+	int j;
+	for (j=0; j<K+5; j++) {
+		double t=(j-3)/(double)(K-2);
+		if (t<0) t=0;
+		if (t>1) t=1;
+		W.addReal(t);
+	}
+}
+
+
+/*
+ Airframe-like IGES model: a chain of placement transforms and n bicubic
+ B-spline surface patches of 16 x 16 control points, each trimmed by four
+ B-spline curves and outlined by lines
+*/
+static long long writeSyntheticIGES(const char *name,unsigned int n)
+{
+	IGESBenchWriter W;
+	if (!W.ok()) return 0;
+
+	const int transforms=8;
+	int placement[transforms];
+	int k,i,j;
+	for (k=0; k<transforms; k++) {
+		double a=0.3*k;
+		W.begin(124);
+		W.addReal(cos(a)); W.addReal(-sin(a)); W.addReal(0); W.addReal(10*k);
+		W.addReal(sin(a)); W.addReal(cos(a)); W.addReal(0); W.addReal(0);
+		W.addReal(0); W.addReal(0); W.addReal(1); W.addReal(k);
+		placement[k]=W.end(k ? placement[k-1] : 0,0);
+	}
+
+	const int K=15;
+	unsigned int s;
+	for (s=0; s<n; s++) {
+		int transform=placement[s%transforms];
+		double x0=(s%100)*10.,y0=(s/100)*10.;
+
+		W.begin(128);
+		W.addInt(K); W.addInt(K); W.addInt(3); W.addInt(3);
+		W.addInt(0); W.addInt(0); W.addInt(0); W.addInt(0); W.addInt(0);
+		addIGESKnots(W,K);
+		addIGESKnots(W,K);
+		for (k=0; k<(K+1)*(K+1); k++) W.addReal(1);
+		for (j=0; j<=K; j++) {
+			for (i=0; i<=K; i++) {
+				W.addReal(x0+i*10./K);
+				W.addReal(y0+j*10./K);
+				W.addReal(sin(0.3*i+s)*cos(0.2*j));
+			}
+		}
+		W.addReal(0); W.addReal(1); W.addReal(0); W.addReal(1);
+		W.end(transform,0);
+
+		for (k=0; k<4; k++) {
+			W.begin(126);
+			W.addInt(K); W.addInt(3);
+			W.addInt(0); W.addInt(0); W.addInt(1); W.addInt(0);
+			addIGESKnots(W,K);
+			for (i=0; i<=K; i++) W.addReal(1);
+			for (i=0; i<=K; i++) {
+				double u=i/(double)K;
+				W.addReal(x0+((k&1) ? u*10 : (k&2)*5.));
+				W.addReal(y0+((k&1) ? (k&2)*5. : u*10));
+				W.addReal(0);
+			}
+			W.addReal(0); W.addReal(1);
+			W.addReal(0); W.addReal(0); W.addReal(1);
+			W.end(transform,0);
+
+			W.begin(110);
+			W.addReal(x0); W.addReal(y0+k); W.addReal(0);
+			W.addReal(x0+10); W.addReal(y0+k); W.addReal(0);
+			W.end(transform,0);
+		}
+	}
+
+	return W.finish(name);
+}
+
+
+/*
+ Fastener-like assembly: one subfigure definition of eight bicubic patches
+ and their outlines, placed by n singular subfigure instances
+*/
+static long long writeSubfigureIGES(const char *name,unsigned int n)
+{
+	IGESBenchWriter W;
+	if (!W.ok()) return 0;
+
+	const int K=7;
+	const int patches=8;
+	int members[2*patches];
+	int k,i,j;
+	for (k=0; k<patches; k++) {
+		double a0=k*2*pi/patches,a1=(k+1)*2*pi/patches;
+		W.begin(128);
+		W.addInt(K); W.addInt(K); W.addInt(3); W.addInt(3);
+		W.addInt(0); W.addInt(0); W.addInt(0); W.addInt(0); W.addInt(0);
+		addIGESKnots(W,K);
+		addIGESKnots(W,K);
+		for (i=0; i<(K+1)*(K+1); i++) W.addReal(1);
+		for (j=0; j<=K; j++) {
+			for (i=0; i<=K; i++) {
+				double a=a0+(a1-a0)*i/K;
+				W.addReal(cos(a));
+				W.addReal(sin(a));
+				W.addReal(4.*j/K);
+			}
+		}
+		W.addReal(0); W.addReal(1); W.addReal(0); W.addReal(1);
+		members[2*k]=W.end(0,0);
+
+		W.begin(110);
+		W.addReal(cos(a0)); W.addReal(sin(a0)); W.addReal(0);
+		W.addReal(cos(a1)); W.addReal(sin(a1)); W.addReal(0);
+		members[2*k+1]=W.end(0,0);
+	}
+
+	W.begin(308);
+	W.addInt(0);
+	W.addString("BOLT");
+	W.addInt(2*patches);
+	for (k=0; k<2*patches; k++) W.addInt(members[k]);
+	int definition=W.end(0,0);
+
+	unsigned int s;
+	for (s=0; s<n; s++) {
+		W.begin(408);
+		W.addInt(definition);
+		W.addReal((s%1000)*3.);
+		W.addReal((s/1000)*3.);
+		W.addReal(0);
+		W.addReal(1);
+		W.end(0,0);
+	}
+
+	return W.finish(name);
+}
+
+
+/*Vertices of a block: its grids and the points of its curves and surfaces*/
+static long long blockVertices(Geometry *B)
+{
+	long long v=B->grids.length();
+	int i;
+	for (i=0; i<B->bsplines.length(); i++) v+=B->bsplines.at(i).total_coords;
+	for (i=0; i<B->bsplinesurfs.length(); i++) v+=B->bsplinesurfs.at(i).total_coords;
+	return v;
+}
+
+static void benchIGESSubfigures(unsigned int n)
+{
+	const char *name="parking_bench.igs";
+	long long bytes=writeSubfigureIGES(name,n);
+	if (!bytes) return;
+
+	QElapsedTimer t;
+	Geometry geom;
+	t.start();
+	readIGES(&geom,name);
+	geom.compressGrids();
+	geom.prepareBlocks();
+	long long msec=t.elapsed();
+	remove(name);
+
+	/*Vertices held once by the blocks, and as many times as placed if expanded*/
+	long long vertices=0,placed=0;
+	unsigned int k;
+	for (k=0; k<geom.blocks.length(); k++) vertices+=blockVertices(geom.blocks.at(k));
+	for (k=0; k<geom.instances.length(); k++) placed+=blockVertices(geom.blocks.at(geom.instances.at(k).block));
+
+	report("IGES subfigure instances",bytes,geom.instances.length(),"instances",msec);
+	report("IGES subfigure blocks",bytes,vertices,"vertices",msec);
+	report("IGES blocks if expanded",bytes,placed,"vertices",msec);
+}
+
+
+static void benchIGESThreads(unsigned int n,int maxThreads)
+{
+	const char *name="parking_bench.igs";
+	long long bytes=writeSyntheticIGES(name,n);
+	if (!bytes) return;
+
+	benchThreads("IGES reader",0,readIGESStep,(void *)name,bytes,n,"surfaces",maxThreads);
+
+	remove(name);
+}
+
+
+/*Tessellates every curve and surface, by fixed parameter steps or adaptively, returns the vertex count*/
+static long long tessellateIGES(Geometry &geom,int adaptive,float chord,float angle)
+{
+	long long vertices=0;
+	int i;
+	for (i=0; i<geom.bsplines.length(); i++) {
+		BSpline &BS=geom.bsplines.at(i);
+		if (adaptive) BS.tessellate(chord,angle);
+		else BS.recalcCoords(0.05);
+		vertices+=BS.total_coords;
+	}
+	for (i=0; i<geom.bsplinesurfs.length(); i++) {
+		BSplineSurf &BSS=geom.bsplinesurfs.at(i);
+		if (adaptive) BSS.tessellate(chord,angle);
+		else BSS.recalcCoords(0.2,0.2);
+		vertices+=BSS.total_coords;
+	}
+	return vertices;
+}
+
+/*Same shapes with the parameters scaled by f*/
+static void scaleIGESKnots(Geometry &geom,float f)
+{
+	int i,j;
+	for (i=0; i<geom.bsplines.length(); i++) {
+		BSpline &BS=geom.bsplines.at(i);
+		for (j=0; j<BS.K+BS.M+2; j++) BS.T[j]*=f;
+		BS.V[0]*=f; BS.V[1]*=f;
+	}
+	for (i=0; i<geom.bsplinesurfs.length(); i++) {
+		BSplineSurf &BSS=geom.bsplinesurfs.at(i);
+		for (j=0; j<BSS.K1+BSS.M1+2; j++) BSS.S[j]*=f;
+		for (j=0; j<BSS.K2+BSS.M2+2; j++) BSS.T[j]*=f;
+		BSS.U[0]*=f; BSS.U[1]*=f;
+		BSS.V[0]*=f; BSS.V[1]*=f;
+	}
+}
+
+/*
+ Fixed parameter steps against chord (0.01 model units) and angle (20
+ degrees) driven tessellation, then the fixed steps again with the knots in
+ [0,10] instead of [0,1]: the same shapes, ten times the samples per direction
+*/
+static void benchIGESTessellation(unsigned int n)
+{
+	const char *name="parking_bench.igs";
+	long long bytes=writeSyntheticIGES(name,n);
+	if (!bytes) return;
+	const float chord=0.01;
+	const float angle=20*pi/180.;
+	QElapsedTimer t;
+
+	/*Load to first frame, then until the background thread is done*/
+	Geometry lazy;
+	lazy.tessellationChord=chord;
+	t.start();
+	readIGES(&lazy,name);
+	lazy.tessellated(0);
+	long long loaded=t.elapsed();
+	lazy.waitTessellation();
+	qDebug("%-28s %8lld msec, tessellated after %lld msec","IGES load, lazy tessellation",loaded,(long long)t.elapsed());
+
+	Geometry geom;
+	readIGES(&geom,name);
+	remove(name);
+
+	const char *what[3]={"IGES fixed parameter steps","IGES chord/angle adaptive","IGES fixed steps, knots x10"};
+	int k;
+	for (k=0; k<3; k++) {
+		if (k==2) scaleIGESKnots(geom,10);
+		t.start();
+		long long vertices=tessellateIGES(geom,k==1,chord,angle);
+		qDebug("%-28s %8lld msec %12lld vertices",what[k],(long long)t.elapsed(),vertices);
+	}
+}
+
+
+int runBenchmark(int argc,char *argv[])
+{
+	if (argc<1) {
+		qDebug("Usage: Parking -bench stl|stl-threads|stl-weld|stl-ascii|dxf|dxf-threads|dxf-mesh|3ds|iges-threads|iges-tess|iges-subfig|weld [size] [max threads]");
+		return 1;
+	}
+
+	long long size=0;
+	if (argc>1) size=atoll(argv[1]);
+	int maxThreads=parallelThreadCount(0);
+	if (argc>2) maxThreads=atoi(argv[2]);
+
+	if (!strcmp(argv[0],"stl")) {
+		benchSTL(size>0 ? size : 5000000);
+	} else if (!strcmp(argv[0],"stl-threads")) {
+		benchSTLThreads(size>0 ? size : 5000000,maxThreads);
+	} else if (!strcmp(argv[0],"stl-weld")) {
+		benchSTLWeld(size>0 ? size : 5000000);
+	} else if (!strcmp(argv[0],"stl-ascii")) {
+		benchAsciiSTL(size>0 ? size : 1000000);
+	} else if (!strcmp(argv[0],"dxf")) {
+		benchDXF(size>0 ? size : 5000000);
+	} else if (!strcmp(argv[0],"dxf-mesh")) {
+		benchDXFMesh(size>0 ? size : 1000);
+	} else if (!strcmp(argv[0],"3ds")) {
+		bench3DS(size>0 ? size : 200);
+	} else if (!strcmp(argv[0],"dxf-threads")) {
+		benchDXFThreads(size>0 ? size : 5000000,maxThreads);
+	} else if (!strcmp(argv[0],"iges-threads")) {
+		benchIGESThreads(size>0 ? size : 20000,maxThreads);
+	} else if (!strcmp(argv[0],"iges-tess")) {
+		benchIGESTessellation(size>0 ? size : 2000);
+	} else if (!strcmp(argv[0],"iges-subfig")) {
+		benchIGESSubfigures(size>0 ? size : 100000);
+	} else if (!strcmp(argv[0],"weld")) {
+		benchWeld(size>0 ? size : 12000000,maxThreads);
+	} else {
+		qDebug("Unknown benchmark '%s'",argv[0]);
+		return 1;
+	}
+	return 0;
+}
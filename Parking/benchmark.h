@@ -0,0 +1,7 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/*Command line loader benchmarks: Parking -bench <name> [size]*/
+int runBenchmark(int argc,char *argv[]);
+
+#endif
@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 
 BSpline::BSpline()
 {
@@ -107,37 +108,255 @@ int BSpline::getParamPoint(float t,float outp[3]) const
 }
 
 
-void BSpline::recalcCoords(float dt)
+
+/*
+ Rational B-spline curves sharing one knot vector, as rows of homogeneous
+ control points (w*x,w*y,w*z,w). Points are summed over the degree+1 basis
+ functions of the knot span only (The NURBS Book A2.1, A2.2), with the
+ scratch arrays allocated once. A curve is one row, a surface gives one row
+ per isoparametric curve
+*/
+class TessellationRows {
+public:
+	const float *U;
+	int n,p; /*control points 0:n, degree p*/
+	int rows;
+	float (*H)[4];
+	float *N,*left,*right;
+
+	TessellationRows(const float *knots,int last,int degree,int rowCount) {
+		U=knots;
+		n=last;
+		p=degree;
+		rows=rowCount;
+		H=(float(*)[4])calloc(rows*(n+1)+1,sizeof(float[4]));
+		N=new float[p+1];
+		left=new float[p+1];
+		right=new float[p+1];
+	}
+	~TessellationRows() {
+		free(H);
+		delete []N;
+		delete []left;
+		delete []right;
+	}
+
+	int span(float u) const {
+		if (u>=U[n+1]) {
+			int i=n;
+			while (i>p && U[i]>=U[n+1]) i--;
+			return i;
+		}
+		if (u<=U[p]) return p;
+		int low=p,high=n+1,mid=(low+high)/2;
+		while (u<U[mid] || u>=U[mid+1]) {
+			if (u<U[mid]) high=mid;
+			else low=mid;
+			mid=(low+high)/2;
+		}
+		return mid;
+	}
+
+	/*N[0:p] for the control points i-p:i*/
+	void basis(int i,float u) {
+		int j,r;
+		N[0]=1;
+		for (j=1; j<=p; j++) {
+			left[j]=u-U[i+1-j];
+			right[j]=U[i+j]-u;
+			float saved=0;
+			for (r=0; r<j; r++) {
+				float d=right[r+1]+left[j-r];
+				float temp=d!=0 ? N[r]/d : 0;
+				N[r]=saved+right[r+1]*temp;
+				saved=left[j-r]*temp;
+			}
+			N[j]=saved;
+		}
+	}
+
+	void point(int row,float u,float out[3]) {
+		int i=span(u);
+		basis(i,u);
+		float h[4]={0,0,0,0};
+		int j,k;
+		const float (*R)[4]=H+row*(n+1)+i-p;
+		for (j=0; j<=p; j++) {
+			for (k=0; k<4; k++) h[k]+=N[j]*R[j][k];
+		}
+		if (h[3]==0) h[3]=1;
+		out[0]=h[0]/h[3];
+		out[1]=h[1]/h[3];
+		out[2]=h[2]/h[3];
+	}
+};
+
+
+/*
+ Adaptive tessellation. A parameter interval is halved while the point at
+ its middle lies farther than the chord tolerance from the chord, or the two
+ half chords turn by more than the angle. Distinct knots are always kept, as
+ the shape may have a kink there
+*/
+
+static const int TESSELLATION_MAX_DEPTH=10;
+
+static int chordTooCoarse(const float p0[3],const float pm[3],const float p1[3],float chord,float cosAngle)
 {
-	int j;
-	float t;
-	vector3d<float> X;
+	float a[3],b[3],c[3];
+	float la,lb,lc,d;
+	vec_diff(a,pm,p0);
+	vec_diff(b,p1,pm);
+	vec_diff(c,p1,p0);
+	vec_length(&la,a);
+	vec_length(&lb,b);
+	vec_length(&lc,c);
+
+	/*Distance of the middle point from the chord*/
+	if (lc>0) {
+		float n[3];
+		vec_cross_product(n,a,c);
+		vec_length(&d,n);
+		d/=lc;
+	} else {
+		d=la;
+	}
+	if (d>chord) return 1;
 
-	myVector< vector3d<float> > F;
+	if (la>0 && lb>0) {
+		vec_dot_product(&d,a,b);
+		if (d<cosAngle*la*lb) return 1;
+	}
+	return 0;
+}
 
-	for (t=V[0]; t<V[1]; t+=dt) {
-		if (getParamPoint(t,X.data)) {
-			F.append(X);
+static void refineInterval(TessellationRows &R,float u0,const float *p0,float u1,const float *p1,float chord,float cosAngle,int depth,myVector<float> &params)
+{
+	float um=0.5f*(u0+u1);
+	float local[3*16];
+	float *pm=R.rows<=16 ? local : new float[3*R.rows];
+	int split=0;
+	int r;
+	for (r=0; r<R.rows; r++) {
+		R.point(r,um,pm+3*r);
+		if (!split) split=chordTooCoarse(p0+3*r,pm+3*r,p1+3*r,chord,cosAngle);
+	}
+	/*Before an interval is taken it is also checked at its quarters, for S shapes*/
+	if (!split) {
+		float q[3];
+		for (r=0; r<R.rows && !split; r++) {
+			R.point(r,0.5f*(u0+um),q);
+			split=chordTooCoarse(p0+3*r,q,p1+3*r,chord,cosAngle);
+			if (split) break;
+			R.point(r,0.5f*(um+u1),q);
+			split=chordTooCoarse(p0+3*r,q,p1+3*r,chord,cosAngle);
 		}
 	}
-	t=V[1];
-	if (getParamPoint(t,X.data)) {
-		F.append(X);
+	if (split && depth<TESSELLATION_MAX_DEPTH && um>u0 && um<u1) {
+		refineInterval(R,u0,p0,um,pm,chord,cosAngle,depth+1,params);
+		refineInterval(R,um,pm,u1,p1,chord,cosAngle,depth+1,params);
+	} else {
+		params.append(u1);
 	}
-	free(coords);
-	coords=(float(*)[3])calloc(F.length(),sizeof(float[3]));
-	total_coords=F.length();
+	if (pm!=local) delete []pm;
+}
 
-	free(strip);
-	strip=(int*)calloc(total_coords+2,sizeof(int));
-	strip[0]=total_coords;
-	
-	for (j=0; j<total_coords; j++) {
-		memcpy(coords[j],F.at(j).data,sizeof(float[3]));
-		strip[j+1]=j;
+/*Distinct knots inside [a,b] and both ends, each span cut into seeds pieces*/
+static void seedParams(const float *knots,int n,int seeds,float a,float b,myVector<float> &params)
+{
+	params.append(a);
+	if (!(b>a)) return;
+	int i,k;
+	float u0=a;
+	for (i=0; i<=n; i++) {
+		float u1=i<n ? knots[i] : b;
+		if (u1<=u0) continue;
+		if (u1>=b) {
+			if (i<n) continue;
+			u1=b;
+		}
+		for (k=1; k<seeds; k++) params.append(u0+(u1-u0)*k/seeds);
+		params.append(u1);
+		u0=u1;
+	}
+}
+
+/*Parameters from a to b refined until every row holds the limits*/
+static void adaptiveParams(TessellationRows &R,float a,float b,float chord,float angle,myVector<float> &params)
+{
+	myVector<float> seed;
+	seedParams(R.U,R.n+R.p+2,1,a,b,seed);
+	params.append(a);
+
+	float cosAngle=cos(angle);
+	float *p0=new float[3*R.rows];
+	float *p1=new float[3*R.rows];
+	int i,r;
+	for (r=0; r<R.rows; r++) R.point(r,a,p0+3*r);
+	for (i=1; i<seed.length(); i++) {
+		for (r=0; r<R.rows; r++) R.point(r,seed.at(i),p1+3*r);
+		refineInterval(R,seed.at(i-1),p0,seed.at(i),p1,chord,cosAngle,0,params);
+		float *swap=p0; p0=p1; p1=swap;
+	}
+	delete []p0;
+	delete []p1;
+}
+
+
+static void curveRows(const BSpline &BS,TessellationRows &R)
+{
+	int i,k;
+	for (i=0; i<=BS.K; i++) {
+		for (k=0; k<3; k++) R.H[i][k]=BS.W[i]*BS.P[i][k];
+		R.H[i][3]=BS.W[i];
+	}
+}
+
+/*Polyline through the curve points at params*/
+static void setCurveCoords(BSpline &BS,myVector<float> &params)
+{
+	int j;
+	TessellationRows R(BS.T,BS.K,BS.M,1);
+	curveRows(BS,R);
+
+	free(BS.coords);
+	BS.total_coords=params.length();
+	BS.coords=(float(*)[3])calloc(BS.total_coords,sizeof(float[3]));
+	for (j=0; j<BS.total_coords; j++) {
+		R.point(0,params.at(j),BS.coords[j]);
+	}
+
+	free(BS.strip);
+	BS.strip=(int*)calloc(BS.total_coords+2,sizeof(int));
+	BS.strip[0]=BS.total_coords;
+	for (j=0; j<BS.total_coords; j++) {
+		BS.strip[j+1]=j;
+	}
+	BS.strip[BS.total_coords+1]=0;
+}
+
+
+void BSpline::recalcCoords(float dt)
+{
+	float t;
+	myVector<float> params;
+
+	for (t=V[0]; t<V[1]; t+=dt) {
+		params.append(t);
 	}
-	strip[total_coords+1]=0;
+	params.append(V[1]);
+
+	setCurveCoords(*this,params);
+}
 
+
+void BSpline::tessellate(float chord,float angle)
+{
+	myVector<float> params;
+	TessellationRows R(T,K,M,1);
+	curveRows(*this,R);
+	adaptiveParams(R,V[0],V[1],chord,angle,params);
+	setCurveCoords(*this,params);
 }
 
 
@@ -199,6 +418,7 @@ BSplineSurf::~BSplineSurf()
         free(P);
 	free(coords);
 	free(normals);
+	free(strip);
 }
 
 
@@ -293,34 +513,48 @@ int BSplineSurf::getParamPoint(float s,float t,float outp[3]) const
 	return 1;
 }
 
-void BSplineSurf::recalcCoords(float ds,float dt)
+/*
+ Isoparametric curves of the surface: along s at the t values in fixed
+ (alongS) or along t at the s values in fixed
+*/
+static void surfaceRows(const BSplineSurf &BSS,int alongS,myVector<float> &fixed,TessellationRows &R)
 {
-	float s,t;
-	float out[3];
-	int ns,nt;
-	
-	myVector<float> sv;
-	myVector<float> tv;
-	for (s=U[0]; s<U[1]; s+=ds) {
-		sv.append(s);
+	TessellationRows across(alongS ? BSS.T : BSS.S,alongS ? BSS.K2 : BSS.K1,alongS ? BSS.M2 : BSS.M1,0);
+	int r,i,j,k;
+	for (r=0; r<fixed.length(); r++) {
+		int span=across.span(fixed.at(r));
+		across.basis(span,fixed.at(r));
+		float (*H)[4]=R.H+r*(R.n+1);
+		for (i=0; i<=R.n; i++) {
+			for (j=0; j<=across.p; j++) {
+				int c=span-across.p+j;
+				int ij=alongS ? i+c*(BSS.K1+1) : c+i*(BSS.K1+1);
+				float w=across.N[j]*BSS.W[ij];
+				for (k=0; k<3; k++) H[i][k]+=w*BSS.P[ij][k];
+				H[i][3]+=w;
+			}
+		}
 	}
-	sv.append(U[1]);
+}
 
-	for (t=V[0]; t<V[1]; t+=dt) {
-		tv.append(t);
-	}
-	tv.append(V[1]);
+/*Grid of the surface points at sv x tv, as triangle strips along t*/
+static void setSurfaceCoords(BSplineSurf &BSS,myVector<float> &sv,myVector<float> &tv)
+{
+	int ns,nt;
+
+	/*One isocurve along t per s value*/
+	TessellationRows R(BSS.T,BSS.K2,BSS.M2,sv.length());
+	surfaceRows(BSS,0,sv,R);
 	
-	total_coords=sv.length()*tv.length();
-	coords=(float(*)[3])malloc(total_coords*sizeof(float[3]));
+	free(BSS.coords);
+	BSS.total_coords=sv.length()*tv.length();
+	BSS.coords=(float(*)[3])malloc(BSS.total_coords*sizeof(float[3]));
 
-	total_coords=0;
+	BSS.total_coords=0;
 	for (ns=0; ns<sv.length(); ns++) {
-		s=sv.at(ns);
 		for (nt=0; nt<tv.length(); nt++) {
-			t=tv.at(nt);	
-			getParamPoint(s,t,coords[total_coords]);
-			total_coords++;
+			R.point(ns,tv.at(nt),BSS.coords[BSS.total_coords]);
+			BSS.total_coords++;
 		}
 	}
 	myVector<int> N;
@@ -336,44 +570,86 @@ void BSplineSurf::recalcCoords(float ds,float dt)
 	}
 	N.append(0);
 	
-	free(strip);
+	free(BSS.strip);
 
-	strip=(int*)malloc(N.length()*sizeof(int));
-	memcpy(strip,N.getData(),N.length()*sizeof(int));
+	BSS.strip=(int*)malloc(N.length()*sizeof(int));
+	memcpy(BSS.strip,N.getData(),N.length()*sizeof(int));
 
 
-	free(normals);
-	normals=(float(*)[3])calloc(total_coords,sizeof(float[3]));
+	free(BSS.normals);
+	BSS.normals=(float(*)[3])calloc(BSS.total_coords,sizeof(float[3]));
 
 	
 	int *ar,totta,k;
 
-	ar=strip;
+	ar=BSS.strip;
 	while (ar[0]) {
 		totta=ar[0]; ar++;
 		for (k=2; k<totta; k++) {
 			float g1[3],g2[3],g3[3];
-			vec_diff(g1,coords[ ar[k-2] ],coords[ ar[k-1] ]);
-			vec_diff(g2,coords[ ar[k-1] ],coords[ ar[k] ]);
+			vec_diff(g1,BSS.coords[ ar[k-2] ],BSS.coords[ ar[k-1] ]);
+			vec_diff(g2,BSS.coords[ ar[k-1] ],BSS.coords[ ar[k] ]);
 			vec_cross_product(g3,g1,g2);
 			vec_normalize(g3);
 			if (k&1) {
 				vec_flip(g3,g3);
 			}
-			vec_sum(normals[ ar[k] ],normals[ ar[k] ],g3);
+			vec_sum(BSS.normals[ ar[k] ],BSS.normals[ ar[k] ],g3);
 			if (k==2) {
-				vec_sum(normals[ ar[0] ],normals[ ar[0] ],g3);
-				vec_sum(normals[ ar[1] ],normals[ ar[1] ],g3);
+				vec_sum(BSS.normals[ ar[0] ],BSS.normals[ ar[0] ],g3);
+				vec_sum(BSS.normals[ ar[1] ],BSS.normals[ ar[1] ],g3);
 			}
 		}
 
 		ar+=totta;
 	}
-	for (k=0; k<total_coords; k++) {
-		vec_normalize(normals[k]);
+	for (k=0; k<BSS.total_coords; k++) {
+		vec_normalize(BSS.normals[k]);
+	}
+}
+
+void BSplineSurf::recalcCoords(float ds,float dt)
+{
+	float s,t;
+	
+	myVector<float> sv;
+	myVector<float> tv;
+	for (s=U[0]; s<U[1]; s+=ds) {
+		sv.append(s);
 	}
+	sv.append(U[1]);
 
+	for (t=V[0]; t<V[1]; t+=dt) {
+		tv.append(t);
+	}
+	tv.append(V[1]);
+	
+	setSurfaceCoords(*this,sv,tv);
 }
 
 
+/*
+ The s values are refined on the isocurves through the knots of t, with each
+ t span cut into degree pieces, and the other way round. So the grid is fine
+ only across the spans that bend
+*/
+void BSplineSurf::tessellate(float chord,float angle)
+{
+	myVector<float> sSeed,tSeed;
+	seedParams(S,K1+M1+2,M1,U[0],U[1],sSeed);
+	seedParams(T,K2+M2+2,M2,V[0],V[1],tSeed);
+
+	myVector<float> sv,tv;
+	{
+		TessellationRows R(S,K1,M1,tSeed.length());
+		surfaceRows(*this,1,tSeed,R);
+		adaptiveParams(R,U[0],U[1],chord,angle,sv);
+	}
+	{
+		TessellationRows R(T,K2,M2,sSeed.length());
+		surfaceRows(*this,0,sSeed,R);
+		adaptiveParams(R,V[0],V[1],chord,angle,tv);
+	}
 
+	setSurfaceCoords(*this,sv,tv);
+}
@@ -23,6 +23,8 @@ public:
 	int getParamPoint(float t,float outp[3]) const;
 
 	void recalcCoords(float dt);
+	/*Polyline off the curve by at most chord (model units), turning by at most angle (radians) within a knot span*/
+	void tessellate(float chord,float angle);
 };
 
 
@@ -54,6 +56,8 @@ public:
 	int getParamPoint(float s,float t,float outp[3]) const;
 
 	void recalcCoords(float ds,float dt);
+	/*Grid refined until its isocurves hold the chord and angle limits of BSpline::tessellate*/
+	void tessellate(float chord,float angle);
 
 
 };
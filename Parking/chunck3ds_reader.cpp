@@ -1,9 +1,12 @@
 #include "chunck3ds_reader.h"
 
 #include "geometry.h"
+#include "mapped_file.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <qdebug.h>
+#include <QElapsedTimer>
 
 const char *chunckName(unsigned short int id)
 {
@@ -18,6 +21,11 @@ const char *chunckName(unsigned short int id)
 		case 0x4110: return "Vertices list";
 		case 0x4160: return "Local coordinate system";
 		case 0x4120: return "Faces description";
+		case 0x4130: return "Face material";
+		case 0x4150: return "Smoothing groups";
+		case 0xAFFF: return "Material block";
+		case 0xA000: return "Material name";
+		case 0xA020: return "Diffuse color";
 		case 0xB000: return "Keyframer";
 
 
@@ -29,234 +37,667 @@ const char *chunckName(unsigned short int id)
 }
 
 
-int readChunck(FILE *fp,Geometry *geom)
+/*Chunk header: id and length, the length counting the header too*/
+static const int CHUNK_HEADER_SIZE=6;
+
+/*Deepest chunk nesting followed, deeper chunks are skipped*/
+static const int MAX_CHUNK_DEPTH=64;
+
+static inline unsigned short readU16(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+static inline unsigned int readU32(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24);
+}
+
+
+/*
+ Open chunk of the walk: its id, where it ends, the first grid of its mesh,
+ the object it starts and the material it describes (-1 if none). A faces
+ description also keeps its face list for the smoothing groups and face
+ materials that follow it
+*/
+class ChunkFrame {
+public:
+	unsigned short id;
+	const unsigned char *end;
+	int firstVertex;
+	int object;
+	int material;
+	const unsigned char *faces;
+	unsigned int faceCount;
+	int firstTriangle;
+};
+
+
+/*
+ Zero terminated string at the start of a chunk, cut to size-1 characters.
+ Returns the bytes it takes with the terminator
+*/
+static qint64 chunkString(const unsigned char *data,const unsigned char *end,char *dst,int size)
 {
-	unsigned short int chunck_id=0;
-	unsigned long int chunck_len=0;
-	fread((void *)&chunck_id,sizeof(short int),1,fp);
-	fread((void *)&chunck_len,sizeof(long int),1,fp);
-	
-        const char *chName=chunckName(chunck_id);
+	const unsigned char *q=(const unsigned char *)memchr(data,0,end-data);
+	qint64 len=q ? q-data : end-data;
+	int n=len>size-1 ? size-1 : len;
+	memcpy(dst,data,n);
+	dst[n]=0;
+	return q ? len+1 : len;
+}
 
 
-	//qDebug("Chunck %x: len :%d (%s)",chunck_id,chunck_len,chName);
+/*Pads a per triangle array up to the triangles read*/
+template <typename T> static void padPerTriangle(Geometry *geom,myVector<T> &v,T fill)
+{
+	unsigned int k=v.length();
+	v.resize(geom->triangles.length());
+	for (; k<geom->triangles.length(); k++) v.at(k)=fill;
+}
 
-	if (feof(fp)) {
-		return 0;
+
+/*Object block (0x4000) starts: its ranges begin at the current lengths*/
+static int beginObject(Geometry *geom,const char *name)
+{
+	MeshObject O;
+	strcpy(O.name,name);
+	O.firstGrid=geom->grids.length();
+	O.firstTriangle=geom->triangles.length();
+	O.firstEdge=geom->edges.length();
+	O.gridCount=0;
+	O.triangleCount=0;
+	O.edgeCount=0;
+	O.visible=1;
+	O.inView=1;
+	geom->objects.append(O);
+	return geom->objects.length()-1;
+}
+
+
+/*Object block ends: counts and box, objects without a mesh are dropped*/
+static void endObject(Geometry *geom,int object)
+{
+	MeshObject &O=geom->objects.at(object);
+	O.gridCount=geom->grids.length()-O.firstGrid;
+	O.triangleCount=geom->triangles.length()-O.firstTriangle;
+	O.edgeCount=geom->edges.length()-O.firstEdge;
+
+	if (!O.triangleCount) {
+		if (object==(int)geom->objects.length()-1) geom->objects.truncateInto(object);
+		return;
 	}
-	unsigned long int version;
-	float one_unit;
-	int k;
-	unsigned short vertNum;
-	float vector[3];
-	float coord[12];
-
-	static int firstVertexId;
-
-	unsigned short int faceNum;
-	unsigned short int face[3];
-	unsigned short int faceFlag;
-
-	QString obj_name;
-	char c;
-
-	unsigned long int remain,rm;
-
-	remain=6;
-	switch (chunck_id) {
-		case 0x4d4d:
-		case 0x3d3d:
-		case 0x4100:
-		case 0xb000:
-			if (chunck_id==0x4100) firstVertexId=geom->grids.length();
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+
+	int k,i;
+	for (k=0; k<O.gridCount; k++) {
+		const float *x=geom->grids.at(O.firstGrid+k).coords;
+		for (i=0; i<3; i++) {
+			if (k==0 || O.minn[i]>x[i]) O.minn[i]=x[i];
+			if (k==0 || O.maxx[i]<x[i]) O.maxx[i]=x[i];
+		}
+	}
+}
+
+
+/*Vertices list (0x4110): count, then x y z floats*/
+static void readVertices(Geometry *geom,const unsigned char *p,unsigned int n)
+{
+	unsigned int first=geom->grids.length();
+	geom->grids.resize(first+n);
+
+	float mn[3],mx[3];
+	unsigned int k;
+	int i;
+	for (k=0; k<n; k++) {
+		Grid &G=geom->grids.at(first+k);
+		memcpy(G.coords,p+12*k,3*sizeof(float));
+		G.pos=first+k;
+		for (i=0; i<3; i++) {
+			if (k==0 || mn[i]>G.coords[i]) mn[i]=G.coords[i];
+			if (k==0 || mx[i]<G.coords[i]) mx[i]=G.coords[i];
+		}
+	}
+	if (n) geom->mergeBoundingBox(first,mn,mx);
+}
+
+
+/*
+ Faces description (0x4120): count, then a b c and flags (unsigned short).
+ Indices are relative to the vertices of the mesh; faces pointing past them
+ are dropped
+*/
+static inline int faceInMesh(const unsigned char *f,unsigned int vertices)
+{
+	return readU16(f)<vertices && readU16(f+2)<vertices && readU16(f+4)<vertices;
+}
+
+static void readFaces(Geometry *geom,const unsigned char *p,unsigned int n,int firstVertex)
+{
+	unsigned int vertices=geom->grids.length()-firstVertex;
+	unsigned int first=geom->triangles.length();
+	geom->triangles.resize(first+n);
+
+	unsigned int k,count=first;
+	for (k=0; k<n; k++) {
+		const unsigned char *f=p+8*k;
+		unsigned short flags=readU16(f+6);
+		if (!faceInMesh(f,vertices)) continue;
+
+		Triangle &T=geom->triangles.at(count++);
+		T.node[0]=firstVertex+readU16(f);
+		T.node[1]=firstVertex+readU16(f+2);
+		T.node[2]=firstVertex+readU16(f+4);
+		T.normal.zero();
+		if (flags&1) geom->addEdge(T.node[2],T.node[0]);
+		if (flags&2) geom->addEdge(T.node[1],T.node[2]);
+		if (flags&4) geom->addEdge(T.node[0],T.node[1]);
+	}
+	geom->triangles.truncateInto(count);
+}
+
+
+/*
+ Smoothing groups (0x4150, inside the faces description): one 32 bit group
+ mask per face, in face order. Faces dropped by readFaces are skipped here too
+*/
+static void readSmoothGroups(Geometry *geom,const unsigned char *p,qint64 len,const ChunkFrame &faces)
+{
+	unsigned int vertices=geom->grids.length()-faces.firstVertex;
+	unsigned int n=faces.faceCount;
+	if (4*(qint64)n>len) n=len/4;
+
+	padPerTriangle(geom,geom->smoothGroups,0u);
+
+	unsigned int k,count=faces.firstTriangle;
+	for (k=0; k<n; k++) {
+		if (!faceInMesh(faces.faces+8*k,vertices)) continue;
+		geom->smoothGroups.at(count++)=readU32(p+4*k);
+	}
+}
+
+
+/*
+ Material by name, added with the default color if not defined (yet): face
+ materials may come before the material block
+*/
+static int findMaterial(Geometry *geom,const char *name)
+{
+	unsigned int k;
+	for (k=0; k<geom->materials.length(); k++) {
+		if (!strcmp(geom->materials.at(k).name,name)) return k;
+	}
+	Material M;
+	strcpy(M.name,name);
+	M.color[0]=.7;
+	M.color[1]=.6;
+	M.color[2]=.4;
+	geom->materials.append(M);
+	return geom->materials.length()-1;
+}
+
+
+/*
+ Face material (0x4130, inside the faces description): material name, count
+ and the faces using it
+*/
+static void readFaceMaterials(Geometry *geom,const unsigned char *p,const unsigned char *end,const ChunkFrame &faces)
+{
+	char name[64];
+	p+=chunkString(p,end,name,sizeof(name));
+	if (end-p<2) return;
+	unsigned int n=readU16(p);
+	p+=2;
+	if (2*(qint64)n>end-p) n=(end-p)/2;
+
+	int material=findMaterial(geom,name);
+	padPerTriangle(geom,geom->triangleMaterials,-1);
+
+	/*Triangle of each face when readFaces dropped some*/
+	int *triangle=NULL;
+	unsigned int k;
+	if (geom->triangles.length()-faces.firstTriangle!=faces.faceCount) {
+		unsigned int vertices=geom->grids.length()-faces.firstVertex;
+		int count=faces.firstTriangle;
+		triangle=(int *)malloc(faces.faceCount*sizeof(int));
+		for (k=0; k<faces.faceCount; k++) {
+			triangle[k]=faceInMesh(faces.faces+8*k,vertices) ? count++ : -1;
+		}
+	}
+
+	for (k=0; k<n; k++) {
+		unsigned int f=readU16(p+2*k);
+		if (f>=faces.faceCount) continue;
+		int t=triangle ? triangle[f] : faces.firstTriangle+f;
+		if (t!=-1) geom->triangleMaterials.at(t)=material;
+	}
+	free(triangle);
+}
+
+
+static int compareMaterialRange(const MaterialRange *a,const MaterialRange *b)
+{
+	if (a->material!=b->material) return a->material<b->material ? -1 : 1;
+	return a->object-b->object;
+}
+
+
+/*
+ Sorts the triangles of each object from firstObject on by material (stable
+ counting sort, objects stay contiguous) and lists the material ranges by
+ material
+*/
+static void sortByMaterial(Geometry *geom,unsigned int firstObject)
+{
+	padPerTriangle(geom,geom->triangleMaterials,-1);
+	int grouped=geom->smoothGroups.length()==geom->triangles.length();
+
+	unsigned int buckets=geom->materials.length()+1;
+	int *start=(int *)malloc((buckets+1)*sizeof(int));
+	unsigned int o,k;
+	for (o=firstObject; o<geom->objects.length(); o++) {
+		const MeshObject &O=geom->objects.at(o);
+		int *mat=&geom->triangleMaterials.at(O.firstTriangle);
+
+		for (k=0; k<=buckets; k++) start[k]=0;
+		for (k=0; k<(unsigned int)O.triangleCount; k++) start[mat[k]+2]++;
+		for (k=1; k<=buckets; k++) start[k]+=start[k-1];
+
+		int single=0;
+		for (k=0; k<buckets; k++) {
+			int count=start[k+1]-start[k];
+			if (!count) continue;
+			if (count==O.triangleCount) single=1;
+			MaterialRange R;
+			R.material=(int)k-1;
+			R.object=o;
+			R.firstTriangle=O.firstTriangle+start[k];
+			R.triangleCount=count;
+			geom->materialRanges.append(R);
+		}
+
+		if (single) continue;
+
+		Triangle *tria=(Triangle *)malloc(O.triangleCount*sizeof(Triangle));
+		unsigned int *groups=grouped ? (unsigned int *)malloc(O.triangleCount*sizeof(unsigned int)) : NULL;
+		int *mats=(int *)malloc(O.triangleCount*sizeof(int));
+		for (k=0; k<(unsigned int)O.triangleCount; k++) {
+			int to=start[mat[k]+1]++;
+			memcpy(&tria[to],&geom->triangles.at(O.firstTriangle+k),sizeof(Triangle));
+			if (groups) groups[to]=geom->smoothGroups.at(O.firstTriangle+k);
+			mats[to]=mat[k];
+		}
+		memcpy(&geom->triangles.at(O.firstTriangle),tria,O.triangleCount*sizeof(Triangle));
+		if (groups) memcpy(&geom->smoothGroups.at(O.firstTriangle),groups,O.triangleCount*sizeof(unsigned int));
+		memcpy(mat,mats,O.triangleCount*sizeof(int));
+		free(tria);
+		free(groups);
+		free(mats);
+	}
+	free(start);
+
+	geom->materialRanges.Qsort(compareMaterialRange);
+}
+
+
+/*
+ Walks the chunk tree of a mapped file with an explicit stack. Data is read
+ in place, nothing is static, so several files can load at once.
+*/
+static void walkChunks(Geometry *geom,const unsigned char *begin,const unsigned char *end)
+{
+	ChunkFrame stack[MAX_CHUNK_DEPTH];
+	int depth=0;
+	stack[0].id=0;
+	stack[0].end=end;
+	stack[0].firstVertex=geom->grids.length();
+	stack[0].object=-1;
+	stack[0].material=-1;
+	stack[0].faces=NULL;
+
+	const unsigned char *p=begin;
+	while (depth>=0) {
+		ChunkFrame &parent=stack[depth];
+		if (parent.end-p<CHUNK_HEADER_SIZE) {
+			if (parent.object!=-1) endObject(geom,parent.object);
+			p=parent.end;
+			depth--;
+			continue;
+		}
+
+		unsigned short id=readU16(p);
+		unsigned int len=readU32(p+2);
+		const unsigned char *data=p+CHUNK_HEADER_SIZE;
+		const unsigned char *chunkEnd=p+len;
+		if (len<CHUNK_HEADER_SIZE || len>(unsigned int)(parent.end-p)) {
+			qDebug("3DS: chunk %x (%s) overruns its parent, truncated",id,chunckName(id));
+			chunkEnd=parent.end;
+		}
+		p=chunkEnd;
+
+		/*Data before the sub-chunks, -1 for chunks without sub-chunks*/
+		qint64 skip=-1;
+		int firstVertex=parent.firstVertex;
+		int object=-1;
+		int material=-1;
+		const unsigned char *faces=NULL;
+		unsigned int faceCount=0;
+		int firstTriangle=0;
+		switch (id) {
+			case 0x4d4d:
+			case 0x3d3d:
+			case 0xb000:
+				skip=0;
+				break;
+			case 0x4100:
+				skip=0;
+				firstVertex=geom->grids.length();
+				break;
+			case 0x2:
+			case 0x3d3e:
+				skip=4;
+				break;
+			case 0x100:
+				skip=sizeof(float);
+				break;
+			case 0x4000:
+				{
+					char name[64];
+					skip=chunkString(data,chunkEnd,name,sizeof(name));
+					object=beginObject(geom,name);
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x2:
-		case 0x3d3e:
-			fread((void *)&version,sizeof(unsigned long int),1,fp);
-			//qDebug("Version : %d",version);
-			remain+=sizeof(unsigned long int);
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+				break;
+			case 0x4110:
+				if (chunkEnd-data>=2) {
+					unsigned int n=readU16(data);
+					if (2+12*(qint64)n>chunkEnd-data) n=(chunkEnd-data-2)/12;
+					readVertices(geom,data+2,n);
+					skip=2+12*n;
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x100:
-			fread((void *)&one_unit,sizeof(float),1,fp);
-			//qDebug("One unit : %f",one_unit);
-			remain+=sizeof(float);
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+				break;
+			case 0x4160:
+				skip=12*sizeof(float);
+				break;
+			case 0x4120:
+				if (chunkEnd-data>=2) {
+					unsigned int n=readU16(data);
+					if (2+8*(qint64)n>chunkEnd-data) n=(chunkEnd-data-2)/8;
+					faces=data+2;
+					faceCount=n;
+					firstTriangle=geom->triangles.length();
+					readFaces(geom,data+2,n,firstVertex);
+					skip=2+8*n;
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x4000:
-			do {
-				fread((void *)&c,sizeof(char),1,fp);
-				remain++;
-				if (c) obj_name.append(QChar::fromAscii(c));
-			} while (c);
-			//qDebug("Object name: %s",obj_name.toLocal8Bit().data());
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+				break;
+			case 0x4130:
+				if (parent.faces) readFaceMaterials(geom,data,chunkEnd,parent);
+				break;
+			case 0x4150:
+				if (parent.faces) readSmoothGroups(geom,data,chunkEnd-data,parent);
+				break;
+			case 0xafff:
+				skip=0;
+				break;
+			case 0xa000:
+				/*The name comes first in the block, later chunks use its material*/
+				if (parent.id==0xafff) {
+					char name[64];
+					chunkString(data,chunkEnd,name,sizeof(name));
+					parent.material=findMaterial(geom,name);
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x4110:
-			fread((void *)&vertNum,sizeof(unsigned short int),1,fp);
-			remain+=sizeof(unsigned short int);
-			//qDebug("Total vertices: %d",vertNum);
-			for (k=0; k<vertNum; k++) {
-				fread((void *)vector,sizeof(float),3,fp);
-				remain+=3*sizeof(float);
-				//qDebug("Vertex %d: %f,%f,%f",k,vector[0],vector[1],vector[2]);
-				int id=geom->addGrid(vector[0],vector[1],vector[2]);
-				//geom->addPoint(id);
-			}
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break; 
+				break;
+			case 0xa020:
+				if (parent.id==0xafff && parent.material!=-1) {
+					skip=0;
+					material=parent.material;
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x4160:
-			fread((void *)coord,sizeof(float),12,fp);
-			remain+=12*sizeof(float);
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+				break;
+			case 0x10:
+				/*Color as floats or as bytes*/
+				if (parent.id==0xa020 && chunkEnd-data>=12) {
+					memcpy(geom->materials.at(parent.material).color,data,3*sizeof(float));
 				}
-				remain+=rm;
-			}
-			break;
-		case 0x4120:
-			fread((void *)&faceNum,sizeof(unsigned short),1,fp);
-			remain+=sizeof(unsigned short);
-			//qDebug("Total faces : %d",faceNum);
-			for (k=0; k<faceNum; k++) {
-				fread((void *)face,sizeof(unsigned short[3]),1,fp);
-				fread((void *)&faceFlag,sizeof(unsigned short),1,fp);
-				remain+=sizeof(unsigned short[4]);
-				face[0]+=firstVertexId;
-				face[1]+=firstVertexId;
-				face[2]+=firstVertexId;
-				//qDebug("Face %d: %d,%d,%d (%d)",k,face[0],face[1],face[2],faceFlag);
-				geom->addTriangle(face[0],face[1],face[2],0);
-				if (faceFlag&1) geom->addEdge(face[2],face[0]);
-				if (faceFlag&2) geom->addEdge(face[1],face[2]);
-				if (faceFlag&4) geom->addEdge(face[0],face[1]);
-			}
-			while (remain<chunck_len) {
-				rm=readChunck(fp,geom); 
-				if (!rm) {
-					break;
+				break;
+			case 0x11:
+				if (parent.id==0xa020 && chunkEnd-data>=3) {
+					float *c=geom->materials.at(parent.material).color;
+					c[0]=data[0]/255.;
+					c[1]=data[1]/255.;
+					c[2]=data[2]/255.;
 				}
-				remain+=rm;
-			}
-			break;
-		default:
-			//qDebug("Passing through chunck...");
-			fseek(fp,chunck_len-remain,SEEK_CUR);
-			break;
+				break;
+			default:
+				break;
+		}
+
+		if (skip>=0 && skip<=chunkEnd-data && depth<MAX_CHUNK_DEPTH-1) {
+			depth++;
+			stack[depth].id=id;
+			stack[depth].end=chunkEnd;
+			stack[depth].firstVertex=firstVertex;
+			stack[depth].object=object;
+			stack[depth].material=material;
+			stack[depth].faces=faces;
+			stack[depth].faceCount=faceCount;
+			stack[depth].firstTriangle=firstTriangle;
+			p=data+skip;
+		}
 	}
-	//qDebug("Done with chunck %x (%s)",chunck_id,chName);
-	
-	return chunck_len;
 }
 
 
-void readChunck3DS(Geometry *geom,const char *name)
+/*
+ Per triangle data of the objects decoded from firstObject on. Every object
+ has its material ranges once any has: when the first materials show up,
+ the objects decoded before them get theirs (material -1) too
+*/
+static void finishObjects(Geometry *geom,unsigned int firstObject)
 {
-	FILE *fp=fopen(name,"rb");
-	if (!fp) return;
-
-	readChunck(fp,geom);
+	if (geom->smoothGroups.length()) padPerTriangle(geom,geom->smoothGroups,0u);
+	if (geom->triangleMaterials.length()) sortByMaterial(geom,geom->materialRanges.length() ? firstObject : 0);
+}
 
 
+Chunck3DSIndex::Chunck3DSIndex()
+{
+	materialsLoaded=0;
+}
 
 
-	fclose(fp);
+/*Vertex list of an object seen by the index: counts and box, nothing is kept*/
+static void growEntryBox(Chunck3DSEntry &E,const unsigned char *p,unsigned int n)
+{
+	unsigned int k;
+	int i;
+	for (k=0; k<n; k++) {
+		float x[3];
+		memcpy(x,p+12*k,3*sizeof(float));
+		for (i=0; i<3; i++) {
+			if (!E.vertices || E.minn[i]>x[i]) E.minn[i]=x[i];
+			if (!E.vertices || E.maxx[i]<x[i]) E.maxx[i]=x[i];
+		}
+		E.vertices++;
+	}
 }
 
 
+/*
+ Skims the chunk headers: only the main, editor, object and mesh chunks are
+ entered, object blocks and material blocks are recorded and the vertex
+ lists give the object boxes. Returns the number of objects, 0 if the file
+ cannot be read
+*/
+int Chunck3DSIndex::open(const char *name)
+{
+	objects.clear();
+	materials.clear();
+	materialsLoaded=0;
+	if (!file.open(name)) return 0;
+
+	QElapsedTimer t;
+	t.start();
 
-class chunck3ds {
-	chunck3ds *parent;
-	chunck3ds **kids;
-	int kidLen,kidMem;
-	void *data;
-public:
-	chunck3ds(chunck3ds *par);
-	~chunck3ds();
-	void attachData(void *d,size_t dlen);
-};
+	/*Open chunks: where they end and the object they are in (-1 if none)*/
+	const unsigned char *stack[MAX_CHUNK_DEPTH];
+	int stackObject[MAX_CHUNK_DEPTH];
+	int depth=0;
+	stack[0]=file.data+file.size;
+	stackObject[0]=-1;
 
-chunck3ds::chunck3ds(chunck3ds *par)
-{
-	parent=par;
-	data=0;
-	kids=(chunck3ds **)malloc(sizeof(chunck3ds *));
-	kidLen=0; kidMem=1;
-	if (parent) {
-		if (parent->kidLen==parent->kidMem) {
-			parent->kidMem*=2;
-			parent->kids=(chunck3ds **)realloc(parent->kids,parent->kidMem*sizeof(chunck3ds *));
+	const unsigned char *p=file.data;
+	while (depth>=0) {
+		if (stack[depth]-p<CHUNK_HEADER_SIZE) {
+			p=stack[depth];
+			depth--;
+			continue;
+		}
+		int object=stackObject[depth];
+
+		unsigned short id=readU16(p);
+		unsigned int len=readU32(p+2);
+		const unsigned char *data=p+CHUNK_HEADER_SIZE;
+		const unsigned char *chunkEnd=p+len;
+		if (len<CHUNK_HEADER_SIZE || len>(unsigned int)(stack[depth]-p)) chunkEnd=stack[depth];
+
+		qint64 skip=-1;
+		Chunck3DSEntry E;
+		switch (id) {
+			case 0x4d4d:
+			case 0x3d3d:
+			case 0x4100:
+				skip=0;
+				break;
+			case 0x4000:
+				E.offset=p-file.data;
+				E.length=chunkEnd-p;
+				skip=chunkString(data,chunkEnd,E.name,sizeof(E.name));
+				E.vertices=0;
+				E.faces=0;
+				E.loaded=0;
+				E.object=-1;
+				objects.append(E);
+				object=objects.length()-1;
+				break;
+			case 0xafff:
+				E.offset=p-file.data;
+				E.length=chunkEnd-p;
+				E.name[0]=0;
+				E.vertices=0;
+				E.faces=0;
+				E.loaded=0;
+				E.object=-1;
+				materials.append(E);
+				break;
+			case 0x4110:
+				if (object!=-1 && chunkEnd-data>=2) {
+					unsigned int n=readU16(data);
+					if (2+12*(qint64)n>chunkEnd-data) n=(chunkEnd-data-2)/12;
+					growEntryBox(objects.at(object),data+2,n);
+				}
+				break;
+			case 0x4120:
+				if (object!=-1 && chunkEnd-data>=2) objects.at(object).faces+=readU16(data);
+				break;
+			default:
+				break;
+		}
+		p=chunkEnd;
+
+		if (skip>=0 && skip<=chunkEnd-data && depth<MAX_CHUNK_DEPTH-1) {
+			depth++;
+			stack[depth]=chunkEnd;
+			stackObject[depth]=object;
+			p=data+skip;
 		}
-		parent->kids[parent->kidLen]=this;
-		parent->kidLen++;
 	}
+
+	qDebug("Time to index 3DS: %lld msec (%u objects, %u materials)",t.elapsed(),objects.length(),materials.length());
+	return objects.length();
 }
 
-chunck3ds::~chunck3ds()
+
+/*Box of all the objects, 0 if none has vertices*/
+int Chunck3DSIndex::box(float mn[3],float mx[3])
 {
-	int k;
-	for (k=0; k<kidLen; k++) {
-		kids[k]->parent=NULL;
-		delete kids[k];
-	}
-	free(kids);
-	if (parent) {
-		int fnd=0;
-		for (k=0; k<parent->kidLen; k++) {
-			if (parent->kids[k]==this) {
-				fnd=1;
-			}
-			if (fnd) {
-				if (k<parent->kidLen-1) {
-					parent->kids[k]=parent->kids[k+1];
-				}
-			}
+	int found=0;
+	unsigned int k;
+	int i;
+	for (k=0; k<objects.length(); k++) {
+		const Chunck3DSEntry &E=objects.at(k);
+		if (!E.vertices) continue;
+		for (i=0; i<3; i++) {
+			if (!found || mn[i]>E.minn[i]) mn[i]=E.minn[i];
+			if (!found || mx[i]<E.maxx[i]) mx[i]=E.maxx[i];
 		}
-		if (fnd) parent->kidLen--;
+		found=1;
+	}
+	return found;
+}
+
+
+/*Material blocks go first, objects refer to them by name*/
+void Chunck3DSIndex::loadMaterials(Geometry *geom)
+{
+	if (materialsLoaded) return;
+	materialsLoaded=1;
+
+	unsigned int k;
+	for (k=0; k<materials.length(); k++) {
+		const Chunck3DSEntry &E=materials.at(k);
+		walkChunks(geom,file.data+E.offset,file.data+E.offset+E.length);
+		materials.at(k).loaded=1;
 	}
-	free(data);
 }
 
 
-void chunck3ds::attachData(void *d,size_t dlen)
+/*Decodes object k if not yet, returns its object in the geometry (-1 if none)*/
+int Chunck3DSIndex::loadObject(Geometry *geom,unsigned int k)
+{
+	if (k>=objects.length()) return -1;
+	Chunck3DSEntry &E=objects.at(k);
+	if (E.loaded) return E.object;
+
+	loadMaterials(geom);
+
+	unsigned int first=geom->objects.length();
+	walkChunks(geom,file.data+E.offset,file.data+E.offset+E.length);
+	finishObjects(geom,first);
+	E.loaded=1;
+	E.object=geom->objects.length()>first ? (int)first : -1;
+	return E.object;
+}
+
+
+/*Decodes all the objects not yet decoded*/
+void Chunck3DSIndex::loadAll(Geometry *geom)
 {
-	if (data) free(data);
-	data=0;
-	if (dlen) {
-		data=malloc(dlen);
-		memcpy(data,d,dlen);
+	loadMaterials(geom);
+
+	unsigned int first=geom->objects.length();
+	unsigned int k;
+	for (k=0; k<objects.length(); k++) {
+		Chunck3DSEntry &E=objects.at(k);
+		if (E.loaded) continue;
+		unsigned int before=geom->objects.length();
+		walkChunks(geom,file.data+E.offset,file.data+E.offset+E.length);
+		E.loaded=1;
+		E.object=geom->objects.length()>before ? (int)before : -1;
 	}
+	finishObjects(geom,first);
+}
+
+
+/*Decodes every object at once, the viewer decodes them on demand (Geometry::load3DS)*/
+void readChunck3DS(Geometry *geom,const char *name)
+{
+	QElapsedTimer t;
+	t.start();
+
+	Chunck3DSIndex index;
+	if (!index.open(name)) return;
+	index.loadAll(geom);
+	qDebug("%u objects, %u materials",geom->objects.length(),geom->materials.length());
+
+	double sec=t.elapsed()/1000.;
+	if (sec<=0) sec=1e-3;
+	qDebug("Time to read 3DS: %lld msec (%.1f MB/s, %.0f triangles/s)",t.elapsed(),index.fileSize()/(1024.*1024.)/sec,geom->triangles.length()/sec);
 }
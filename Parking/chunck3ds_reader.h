@@ -1,8 +1,56 @@
 #ifndef CHUNCK3DS_READER_H
 #define CHUNCK3DS_READER_H
 
+#include "mapped_file.h"
+#include "myvector.h"
+
 class Geometry;
 
+/*
+ Block of a 3DS file found by the index: where its chunk lies in the file.
+ An object block also has its name, mesh sizes, the box of its vertices (if
+ it has any) and, once decoded, its object in the geometry (-1 if it has no
+ mesh)
+*/
+class Chunck3DSEntry {
+public:
+	qint64 offset;
+	unsigned int length;
+	char name[64];
+	int vertices,faces;
+	float minn[3],maxx[3];
+	int loaded;
+	int object;
+};
+
+
+/*
+ Index of the object and material blocks of a 3DS file, built by skimming
+ the chunk headers. Only the vertex lists are read, for the object boxes.
+ Objects are decoded into a geometry on demand, the file stays mapped while
+ the index lives. All the objects of an index go to the same geometry
+*/
+class Chunck3DSIndex {
+	Chunck3DSIndex(Chunck3DSIndex &x); //deactivated copy-constructor
+
+	MappedFile file;
+	int materialsLoaded;
+
+	void loadMaterials(Geometry *geom);
+
+public:
+	myVector<Chunck3DSEntry> objects;
+	myVector<Chunck3DSEntry> materials;
+
+	Chunck3DSIndex();
+
+	int open(const char *name);
+	qint64 fileSize() const {return file.size;}
+	int box(float mn[3],float mx[3]);
+	int loadObject(Geometry *geom,unsigned int k);
+	void loadAll(Geometry *geom);
+};
+
 void readChunck3DS(Geometry *geom,const char *name);
 
 #endif
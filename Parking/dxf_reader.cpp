@@ -1,12 +1,20 @@
 #include "dxf_reader.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <math.h>
 #include "geometry.h"
 #include "coord_system.h"
+#include "numparse.h"
+#include "mapped_file.h"
+#include "parallel.h"
 
 #include <stdio.h>
 #include <qdebug.h>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QString>
 
 enum {
 	ENT_FIRST,
@@ -16,18 +24,17 @@ enum {
 	ENT_CIRCLE,
 	ENT_ARC,
 	ENT_3DFACE,
+	ENT_INSERT,
+	ENT_POLYLINE,
+	ENT_VERTEX,
+	ENT_SEQEND,
+	ENT_BLOCK,
+	ENT_ENDBLK,
 	ENT_LAST
 };
 
 
 
-static void readData(int *code,char *data,FILE *fp)
-{
-	fgets(data,1024,fp);
-	(*code)=atoi(data);
-	fgets(data,1024,fp);
-}
-
 static void createObjectCoordSystem(CoordinateSystem<double> *pXYZ,const double Z[3])
 {
 	static const double cc=1./64.;
@@ -85,341 +92,1116 @@ static void extrudePoint(double X[3],const double Z[3])
 }
 
 
-template <typename T> class myStack {
-	T *data;
-	int datalen;
-	int datamem;
-	myStack(myStack &x);
+/*Highest group code kept by the accumulator*/
+static const int DXF_MAX_CODE=1072;
+
+/*
+ Group values of the entity being read. The values of one code are chained
+ newest first, so pop returns them in reverse file order; clear only resets
+ the codes that were actually seen.
+*/
+class GroupAccumulator {
+	class Value {
 	public:
-	myStack() {
-		data=(T *)malloc(1*sizeof(T));
-		datalen=0; datamem=1;
+		double d;
+		int i;
+		int prev;
+	};
+
+	GroupAccumulator(GroupAccumulator &x); //deactivated copy-constructor
+
+	int head[DXF_MAX_CODE];
+	myVector<Value> values;
+	myVector<int> seen;
+
+public:
+	GroupAccumulator() {
+		int k;
+		for (k=0; k<DXF_MAX_CODE; k++) head[k]=-1;
 	}
-	~myStack() {
-		free(data);
+
+	void push(int code,double d,int i) {
+		if (code<0 || code>=DXF_MAX_CODE) return;
+		if (head[code]==-1) seen.append(code);
+		Value V;
+		V.d=d;
+		V.i=i;
+		V.prev=head[code];
+		head[code]=values.length();
+		values.append(V);
 	}
-	void push(const T *val) {
-		if (datalen==datamem) {
-			datamem*=2;
-			data=(T *)realloc(data,datamem*sizeof(double));
-		}
-		memcpy(&data[datalen],val,sizeof(T));
-		datalen++;
+
+	int pop(int code,double *d) {
+		int id=head[code];
+		if (id==-1) return 0;
+		(*d)=values.at(id).d;
+		head[code]=values.at(id).prev;
+		return 1;
 	}
-	int pop(T *val) {
-		if (datalen==0) return 0;
-		datalen--;
-		memcpy(val,&data[datalen],sizeof(T));
+
+	int pop(int code,int *i) {
+		int id=head[code];
+		if (id==-1) return 0;
+		(*i)=values.at(id).i;
+		head[code]=values.at(id).prev;
 		return 1;
 	}
 
 	void clear() {
-		datalen=0;
+		unsigned int k;
+		for (k=0; k<seen.length(); k++) head[seen.at(k)]=-1;
+		seen.clear();
+		values.clear();
 	}
 };
 
 
+/*Adds the entity whose group values are in acc*/
+static void addEntity(Geometry *geom,int entityCode,GroupAccumulator &acc)
+{
+	switch (entityCode) {
+		case ENT_LINE:
+			{
+				double x1[3],x2[3],Z[3];
+				acc.pop(10,&x1[0]); 
+				acc.pop(20,&x1[1]);
+				acc.pop(30,&x1[2]);
+				acc.pop(11,&x2[0]); 
+				acc.pop(21,&x2[1]);
+				acc.pop(31,&x2[2]);
+				
+				if (acc.pop(210,&Z[0])) {
+					acc.pop(220,&Z[1]);
+					acc.pop(230,&Z[2]);
+				} else {
+					Z[0]=0; Z[1]=0; Z[2]=1;
+				}
+
+				extrudePoint(x1,Z);
+				extrudePoint(x2,Z);
+
+				
+				int id1=geom->addGrid(x1[0],x1[1],x1[2]);
+				int id2=geom->addGrid(x2[0],x2[1],x2[2]);
+				geom->addLine(id1,id2);
 
-void readDXF(Geometry *geom,const char *name)
+			}
+			break;
+		case ENT_POINT:
+			{
+				double x[3];
+				double Z[3];
+
+				
+				acc.pop(10,&x[0]); 
+				acc.pop(20,&x[1]);
+				acc.pop(30,&x[2]);
+
+				if (acc.pop(210,&Z[0])) {
+					acc.pop(220,&Z[1]);
+					acc.pop(230,&Z[2]);
+				} else {
+					Z[0]=0; Z[1]=0; Z[2]=1;
+				}
+				extrudePoint(x,Z);
+				int id=geom->addGrid(x[0],x[1],x[2]);
+				geom->addPoint(id);
+			}
+			break;
+		case ENT_LWPOLYLINE:
+			{
+				double x[3];
+				double Z[3];
+				int k,n;
+				acc.pop(90,&n);
+				if (acc.pop(210,&Z[0])) {
+					acc.pop(220,&Z[1]);
+					acc.pop(230,&Z[2]);
+				} else {
+					Z[0]=0; Z[1]=0; Z[2]=1;
+				}
+
+				if (n>0) {
+					int *id=new int[n];
+					for (k=0; k<n; k++) {
+						acc.pop(10,&x[0]); 
+						acc.pop(20,&x[1]);
+						x[2]=0;
+						extrudePoint(x,Z);
+
+						id[k]=geom->addGrid(x[0],x[1],x[2]);
+					}
+					for (k=n-1; k>=1; k--) {
+						geom->addLine(id[k],id[k-1]);
+					}
+					if (n>1) {
+						acc.pop(70,&k);
+						if (k==1) geom->addLine(id[0],id[n-1]);
+					}
+
+					delete []id;
+				}
+			}
+			break;
+		case ENT_CIRCLE:
+			{
+				double x0_d[3];
+				double x[3];
+
+				double r_d;
+				double Z_d[3];
+
+				float Z[3];
+				float x0[3];
+				float r;
+
+				int k,n;
+				acc.pop(90,&n);
+				if (acc.pop(210,&Z_d[0])) {
+					acc.pop(220,&Z_d[1]);
+					acc.pop(230,&Z_d[2]);
+				} else {
+					Z_d[0]=0; Z_d[1]=0; Z_d[2]=1;
+				}
+				Z[0]=Z_d[0]; Z[1]=Z_d[1]; Z[2]=Z_d[2];
+				
+				acc.pop(10,&x0_d[0]); 
+				acc.pop(20,&x0_d[1]);
+				acc.pop(30,&x0_d[2]);
+
+				x0[0]=x0_d[0]; x0[1]=x0_d[1]; x0[2]=x0_d[2];
+
+				acc.pop(40,&r_d);
+				r=r_d;
+
+				CoordinateSystem<float> XYZ;
+
+				createObjectCoordSystem(&XYZ,Z);
+
+				float x_center[3];
+				XYZ.fromLocalToGlobal(x_center,x0);
+
+				XYZ.setCenter(x_center);
+				geom->addCircle(XYZ,r);
+
+			}
+			break;
+
+		case ENT_ARC:
+			{
+				double x0_d[3];
+				double x[3];
+
+				double r_d;
+				double Z_d[3];
+				double f_d;
+
+				float Z[3];
+				float x0[3];
+				float r;
+				float fmin,fmax;
+
+				int k,n;
+				acc.pop(90,&n);
+				if (acc.pop(210,&Z_d[0])) {
+					acc.pop(220,&Z_d[1]);
+					acc.pop(230,&Z_d[2]);
+				} else {
+					Z_d[0]=0; Z_d[1]=0; Z_d[2]=1;
+				}
+				Z[0]=Z_d[0]; Z[1]=Z_d[1]; Z[2]=Z_d[2];
+
+				acc.pop(10,&x0_d[0]); 
+				acc.pop(20,&x0_d[1]);
+				acc.pop(30,&x0_d[2]);
+
+				x0[0]=x0_d[0]; x0[1]=x0_d[1]; x0[2]=x0_d[2];
+
+				acc.pop(40,&r_d);
+				r=r_d;
+
+				acc.pop(50,&f_d);
+				fmin=f_d*pi/180.;
+				acc.pop(51,&f_d);
+				fmax=f_d*pi/180.;
+
+
+				CoordinateSystem<float> XYZ;
+
+				createObjectCoordSystem(&XYZ,Z);
+
+				float x_center[3];
+				XYZ.fromLocalToGlobal(x_center,x0);
+
+				XYZ.setCenter(x_center);
+				geom->addArc(XYZ,r,fmin,fmax);
+
+			}
+			break;
+		case ENT_3DFACE:
+			{
+				double x[4][3];
+				int edgeMask=0;
+				acc.pop(10,&x[0][0]);
+				acc.pop(20,&x[0][1]);
+				acc.pop(30,&x[0][2]);
+				acc.pop(11,&x[1][0]);
+				acc.pop(21,&x[1][1]);
+				acc.pop(31,&x[1][2]);
+				acc.pop(12,&x[2][0]);
+				acc.pop(22,&x[2][1]);
+				acc.pop(32,&x[2][2]);
+				acc.pop(13,&x[3][0]);
+				acc.pop(23,&x[3][1]);
+				acc.pop(33,&x[3][2]);
+				acc.pop(70,&edgeMask);
+
+				int id1,id2,id3,id4;
+				id1=geom->addGrid(x[0][0],x[0][1],x[0][2]);
+				id2=geom->addGrid(x[1][0],x[1][1],x[1][2]);
+				id3=geom->addGrid(x[2][0],x[2][1],x[2][2]);
+				if (x[3][0]==x[2][0] && x[3][1]==x[2][1] && x[3][2]==x[2][2]) {
+					geom->addTriangle(id1,id2,id3,0);
+					if (!(edgeMask & 1)) geom->addEdge(id1,id2);
+					if (!(edgeMask & 2)) geom->addEdge(id2,id3);
+					if (!(edgeMask & 4)) geom->addEdge(id3,id1);
+				} else {
+					id4=geom->addGrid(x[3][0],x[3][1],x[3][2]);
+					geom->addTriangle(id1,id2,id3,0);
+					geom->addTriangle(id3,id4,id1,0);
+					if (!(edgeMask & 1)) geom->addEdge(id1,id2);
+					if (!(edgeMask & 2)) geom->addEdge(id2,id3);
+					if (!(edgeMask & 4)) geom->addEdge(id3,id4);
+					if (!(edgeMask & 1)) geom->addEdge(id4,id1);
+				}
+
+			}
+			break;
+
+	}
+}
+
+
+/*Group codes whose values are numbers the entities use*/
+static inline int isNumericCode(int code)
+{
+	return (code>=10 && code<=99) || (code>=210 && code<=239);
+}
+
+
+/*Codes 60-99 hold integers, the others doubles*/
+static inline int isIntegerCode(int code)
 {
-	FILE *fp=fopen(name,"rb");
-	if (!fp) return;
+	return code>=60 && code<=99;
+}
+
+
+/*Compares a value with a keyword, ignoring trailing blanks of the value*/
+static int isKeyword(const char *value,int len,const char *word)
+{
+	while (len>0 && isBlankChar(value[len-1])) len--;
+	int n=strlen(word);
+	return len==n && !memcmp(value,word,n);
+}
+
+
+/*POLYLINE flags (70)*/
+static const int POLYLINE_CLOSED=1;
+static const int POLYLINE_MESH=16;
+static const int POLYLINE_MESH_CLOSED_N=32;
+static const int POLYLINE_POLYFACE=64;
+static const int POLYLINE_3D=8;
+
+/*VERTEX flags (70)*/
+static const int VERTEX_FRAME=16;
+static const int VERTEX_POLYFACE_VERTEX=64;
+static const int VERTEX_POLYFACE=128;
+
+
+/*
+ POLYLINE with its VERTEX entities, up to SEQEND. Each vertex is one grid,
+ so polyface and polygon meshes are indexed as in the file and need no
+ welding; plain polylines become lines.
+*/
+class DXFPolyline {
+	int flags;
+	int meshM,meshN;
+	double Z[3];
+	double elevation;
+	myVector<int> ids;
+
+public:
+	int active;
+
+	DXFPolyline() {active=0;}
+
+	void begin(GroupAccumulator &acc) {
+		active=1;
+		ids.clear();
+		if (!acc.pop(70,&flags)) flags=0;
+		if (!acc.pop(71,&meshM)) meshM=0;
+		if (!acc.pop(72,&meshN)) meshN=0;
+		if (!acc.pop(30,&elevation)) elevation=0;
+		if (acc.pop(210,&Z[0])) {
+			acc.pop(220,&Z[1]);
+			acc.pop(230,&Z[2]);
+		} else {
+			Z[0]=0; Z[1]=0; Z[2]=1;
+		}
+	}
+
+	/*Returns 1 for polyface and polygon meshes, which add no duplicate grids*/
+	int indexed() {return (flags & (POLYLINE_POLYFACE | POLYLINE_MESH))!=0;}
+
+	void vertex(Geometry *geom,GroupAccumulator &acc) {
+		int vflags;
+		if (!acc.pop(70,&vflags)) vflags=0;
+		if (vflags & VERTEX_FRAME) return;
+
+		if ((flags & POLYLINE_POLYFACE) && (vflags & VERTEX_POLYFACE) && !(vflags & VERTEX_POLYFACE_VERTEX)) {
+			/*Face record: 1-based vertex numbers, negative for an invisible edge*/
+			int v[4]={0,0,0,0};
+			acc.pop(71,&v[0]);
+			acc.pop(72,&v[1]);
+			acc.pop(73,&v[2]);
+			acc.pop(74,&v[3]);
+			int n=v[3] ? 4 : 3;
+			int id[4],k;
+			for (k=0; k<n; k++) {
+				int a=v[k]<0 ? -v[k] : v[k];
+				if (a<1 || a>(int)ids.length()) return;
+				id[k]=ids.at(a-1);
+			}
+			geom->addTriangle(id[0],id[1],id[2],0);
+			if (n==4) geom->addTriangle(id[0],id[2],id[3],0);
+			for (k=0; k<n; k++) {
+				if (v[k]>0) geom->addEdge(id[k],id[(k+1)%n]);
+			}
+			return;
+		}
+
+		double x[3];
+		if (!acc.pop(10,&x[0])) x[0]=0;
+		if (!acc.pop(20,&x[1])) x[1]=0;
+		if (!acc.pop(30,&x[2])) x[2]=0;
+		if (!(flags & (POLYLINE_3D | POLYLINE_MESH | POLYLINE_POLYFACE))) {
+			/*2D polyline: object coordinates at the polyline elevation*/
+			x[2]=elevation;
+			extrudePoint(x,Z);
+		}
+		ids.append(geom->addGrid(x[0],x[1],x[2]));
+	}
+
+	void end(Geometry *geom) {
+		active=0;
+		int n=ids.length();
+		int i,j;
+
+		if (flags & POLYLINE_POLYFACE) return;
+
+		if (flags & POLYLINE_MESH) {
+			int M=meshM,N=meshN;
+			if (M<1 || N<1 || M*N>n) return;
+			int closedM=(flags & POLYLINE_CLOSED)!=0;
+			int closedN=(flags & POLYLINE_MESH_CLOSED_N)!=0;
+			int rows=closedM ? M : M-1;
+			int cols=closedN ? N : N-1;
+			for (i=0; i<rows; i++) {
+				for (j=0; j<cols; j++) {
+					int a=ids.at(i*N+j);
+					int b=ids.at(i*N+(j+1)%N);
+					int c=ids.at(((i+1)%M)*N+(j+1)%N);
+					int d=ids.at(((i+1)%M)*N+j);
+					geom->addTriangle(a,b,c,0);
+					geom->addTriangle(a,c,d,0);
+				}
+			}
+			/*Mesh lines along both directions*/
+			for (i=0; i<M; i++) {
+				for (j=0; j<cols; j++) geom->addEdge(ids.at(i*N+j),ids.at(i*N+(j+1)%N));
+			}
+			for (j=0; j<N; j++) {
+				for (i=0; i<rows; i++) geom->addEdge(ids.at(i*N+j),ids.at(((i+1)%M)*N+j));
+			}
+			return;
+		}
+
+		for (i=1; i<n; i++) geom->addLine(ids.at(i-1),ids.at(i));
+		if ((flags & POLYLINE_CLOSED) && n>2) geom->addLine(ids.at(n-1),ids.at(0));
+	}
+};
 
-	int code;
-	char buffer[1024];
-	int inSection=0;
-	int inEntities=0;
-	int entityCode,preEntityCode,entityDone;
 
-	myStack<double> codeDouble[2000];
-	myStack<int> codeInt[2000];
+/*Where a DXFParser reports done, letting the tokenizer return*/
+enum {
+	DXF_STOP_NONE,
+	DXF_STOP_ENTITIES_START,
+	DXF_STOP_ENTITIES_END
+};
+
+enum {
+	DXF_SECTION_NONE,
+	DXF_SECTION_OTHER,
+	DXF_SECTION_BLOCKS,
+	DXF_SECTION_ENTITIES
+};
+
+
+class BlockBase {
+public:
+	double x[3];
+};
+
+
+/*
+ Block names and base points of a drawing, shared by all its parsers. The
+ block geometries themselves are in Geometry::blocks of the top geometry.
+*/
+class DXFBlockTable {
+public:
+	QMap<QString,int> ids;
+	myVector<BlockBase> bases;
+
+	/*Index of a block by name, -1 if unknown and create is not set*/
+	int find(Geometry *top,const char *name,int create) {
+		QString key=QString::fromLatin1(name);
+		/*Parallel entity sections only look up, through the const map*/
+		const QMap<QString,int> &cids=ids;
+		QMap<QString,int>::const_iterator it=cids.constFind(key);
+		if (it!=cids.constEnd()) return it.value();
+		if (!create) return -1;
+
+		int id=top->addBlock();
+		ids.insert(key,id);
+		BlockBase B;
+		B.x[0]=0; B.x[1]=0; B.x[2]=0;
+		bases.append(B);
+		return id;
+	}
+};
+
+
+/*Unit X and Y of the object coordinate system of extrusion Z (normalized)*/
+static void objectAxes(double X[3],double Y[3],double Z[3])
+{
+	vec_normalize(Z);
+	CoordinateSystem<double> XYZ;
+	createObjectCoordSystem(&XYZ,Z);
+	double e[3]={1,0,0},o[3]={0,0,0};
+	double x0[3];
+	XYZ.fromLocalToGlobal(x0,o);
+	XYZ.fromLocalToGlobal(X,e);
+	vec_diff(X,X,x0);
+	e[0]=0; e[1]=1;
+	XYZ.fromLocalToGlobal(Y,e);
+	vec_diff(Y,Y,x0);
+}
+
+
+/*
+ Adds the placements of an INSERT (MINSERT: columns x rows of them). The
+ block base point is not known yet for blocks defined later, it is applied
+ by applyBlockBases once the whole file is read.
+*/
+static void addInsert(Geometry *geom,int block,GroupAccumulator &acc)
+{
+	double P[3],S[3],Z[3],rot;
+	double colSpacing,rowSpacing;
+	int cols,rows;
+
+	if (!acc.pop(10,&P[0])) P[0]=0;
+	if (!acc.pop(20,&P[1])) P[1]=0;
+	if (!acc.pop(30,&P[2])) P[2]=0;
+	if (!acc.pop(41,&S[0])) S[0]=1;
+	if (!acc.pop(42,&S[1])) S[1]=1;
+	if (!acc.pop(43,&S[2])) S[2]=1;
+	if (!acc.pop(50,&rot)) rot=0;
+	if (!acc.pop(70,&cols) || cols<1) cols=1;
+	if (!acc.pop(71,&rows) || rows<1) rows=1;
+	if (!acc.pop(44,&colSpacing)) colSpacing=0;
+	if (!acc.pop(45,&rowSpacing)) rowSpacing=0;
+	if (acc.pop(210,&Z[0])) {
+		acc.pop(220,&Z[1]);
+		acc.pop(230,&Z[2]);
+	} else {
+		Z[0]=0; Z[1]=0; Z[2]=1;
+	}
+
+	double X[3],Y[3];
+	objectAxes(X,Y,Z);
+
+	/*Block X and Y axes: rotated in the object plane*/
+	double c=cos(rot*pi/180.),s=sin(rot*pi/180.);
+	double BX[3],BY[3];
 	int k;
+	for (k=0; k<3; k++) {
+		BX[k]=c*X[k]+s*Y[k];
+		BY[k]=-s*X[k]+c*Y[k];
+	}
 
+	float mat[4][4];
+	for (k=0; k<3; k++) {
+		mat[0][k]=S[0]*BX[k];
+		mat[1][k]=S[1]*BY[k];
+		mat[2][k]=S[2]*Z[k];
+	}
+	mat[0][3]=0; mat[1][3]=0; mat[2][3]=0; mat[3][3]=1;
+
+	int col,row;
+	for (row=0; row<rows; row++) {
+		for (col=0; col<cols; col++) {
+			for (k=0; k<3; k++) {
+				mat[3][k]=P[0]*X[k]+P[1]*Y[k]+P[2]*Z[k]+col*colSpacing*BX[k]+row*rowSpacing*BY[k];
+			}
+			geom->addInstance(block,mat);
+		}
+	}
+}
+
+
+/*Moves the block base points to the placements: mat*translate(-base)*/
+static void applyBlockBases(Geometry *geom,DXFBlockTable &table)
+{
+	unsigned int k;
+	int i;
+	for (k=0; k<geom->instances.length(); k++) {
+		BlockInstance &I=geom->instances.at(k);
+		const double *b=table.bases.at(I.block).x;
+		for (i=0; i<3; i++) {
+			I.mat[3][i]-=I.mat[0][i]*b[0]+I.mat[1][i]*b[1]+I.mat[2][i]*b[2];
+		}
+	}
+}
+
+
+/*
+ Section and entity state of a drawing, fed with one group (code and value)
+ at a time. value is not zero terminated; d and i only hold the number when
+ isNumericCode(code). Entities of the ENTITIES section go to geom, those of
+ a BLOCK to its geometry in top->blocks.
+*/
+class DXFParser {
+	DXFParser(DXFParser &x); //deactivated copy-constructor
+
+	Geometry *top;
+	Geometry *geom;
+	Geometry *target;
+	DXFBlockTable *blocks;
+	GroupAccumulator acc;
+	int section;
+	int entityCode;
+	char name[256];
+	DXFPolyline polyline;
+
+	void flushEntity() {
+		switch (entityCode) {
+			case ENT_BLOCK:
+				{
+					int b=blocks->find(top,name,1);
+					BlockBase &B=blocks->bases.at(b);
+					if (!acc.pop(10,&B.x[0])) B.x[0]=0;
+					if (!acc.pop(20,&B.x[1])) B.x[1]=0;
+					if (!acc.pop(30,&B.x[2])) B.x[2]=0;
+					target=top->blocks.at(b);
+				}
+				break;
+			case ENT_ENDBLK:
+				if (polyline.active) polyline.end(target);
+				target=geom;
+				break;
+			case ENT_POLYLINE:
+				if (polyline.active) polyline.end(target);
+				polyline.begin(acc);
+				if (!polyline.indexed()) looseGrids++;
+				break;
+			case ENT_VERTEX:
+				if (polyline.active) polyline.vertex(target,acc);
+				break;
+			case ENT_SEQEND:
+				if (polyline.active) polyline.end(target);
+				break;
+			case ENT_INSERT:
+				{
+					/*Forward references are only possible between blocks*/
+					int b=blocks->find(top,name,section==DXF_SECTION_BLOCKS);
+					if (b>=0) addInsert(target,b,acc);
+					else qDebug("DXF: INSERT of undefined block %s",name);
+				}
+				break;
+			case ENT_FIRST:
+			case ENT_LAST:
+				break;
+			default:
+				addEntity(target,entityCode,acc);
+				looseGrids++;
+				break;
+		}
+		acc.clear();
+		entityCode=ENT_FIRST;
+		name[0]=0;
+	}
 
-	while (!feof(fp)) {
-		readData(&code,buffer,fp);
+	int inEntities() {return section==DXF_SECTION_BLOCKS || section==DXF_SECTION_ENTITIES;}
+
+public:
+	unsigned int entities;
+	/*Entities whose corners are added as separate grids, needing a weld*/
+	unsigned int looseGrids;
+	int stopAt;
+	int done;
+
+	DXFParser(Geometry *t,Geometry *g,DXFBlockTable *b) {
+		top=t;
+		geom=g;
+		target=g;
+		blocks=b;
+		section=DXF_SECTION_NONE;
+		entityCode=ENT_FIRST;
+		name[0]=0;
+		entities=0;
+		looseGrids=0;
+		stopAt=DXF_STOP_NONE;
+		done=0;
+	}
+
+	/*For a part of the ENTITIES section starting at an entity*/
+	void startEntities() {
+		section=DXF_SECTION_ENTITIES;
+		target=geom;
+		entityCode=ENT_FIRST;
+	}
 
-		if (!inSection) {
-			if (code==0 && !strncmp(buffer,"SECTION",7)) {
-				inSection=1;
+	void group(int code,const char *value,int len,double d,int i) {
+		if (section==DXF_SECTION_NONE) {
+			if (code==0 && isKeyword(value,len,"SECTION")) {
+				section=DXF_SECTION_OTHER;
 				qDebug("Entering Section");
-				continue;
 			}
-		} else {
-			if (code==0 && !strncmp(buffer,"ENDSEC",6)) {
-				inSection=0;
-				inEntities=0;
-				qDebug("Out of section");
-				continue;
+			return;
+		}
+
+		if (code==0 && isKeyword(value,len,"ENDSEC")) {
+			if (inEntities()) {
+				flushEntity();
+				if (polyline.active) polyline.end(target);
+				if (section==DXF_SECTION_ENTITIES && stopAt==DXF_STOP_ENTITIES_END) done=1;
 			}
+			section=DXF_SECTION_NONE;
+			target=geom;
+			qDebug("Out of section");
+			return;
 		}
 
-		if (!inSection) continue;
+		if (!inEntities()) {
+			if (code==2 && isKeyword(value,len,"ENTITIES")) {
+				section=DXF_SECTION_ENTITIES;
+				qDebug("Entering entities");
+				entityCode=ENT_FIRST;
+				if (stopAt==DXF_STOP_ENTITIES_START) done=1;
+			} else if (code==2 && isKeyword(value,len,"BLOCKS")) {
+				section=DXF_SECTION_BLOCKS;
+				qDebug("Entering blocks");
+				entityCode=ENT_FIRST;
+			}
+			return;
+		}
 
-		/*In SECTION*/
-		if (!inEntities && code==2 && !strncmp(buffer,"ENTITIES",8)) {
-			inEntities=1;
-			qDebug("Entering entities");
-			entityCode=ENT_FIRST; 
-			continue;
+		if (code==0) {
+			flushEntity();
+			entities++;
+			if (isKeyword(value,len,"LINE")) entityCode=ENT_LINE;
+			else if (isKeyword(value,len,"POINT")) entityCode=ENT_POINT;
+			else if (isKeyword(value,len,"LWPOLYLINE")) entityCode=ENT_LWPOLYLINE;
+			else if (isKeyword(value,len,"CIRCLE")) entityCode=ENT_CIRCLE;
+			else if (isKeyword(value,len,"ARC")) entityCode=ENT_ARC;
+			else if (isKeyword(value,len,"3DFACE")) entityCode=ENT_3DFACE;
+			else if (isKeyword(value,len,"INSERT") || isKeyword(value,len,"MINSERT")) entityCode=ENT_INSERT;
+			else if (isKeyword(value,len,"POLYLINE")) entityCode=ENT_POLYLINE;
+			else if (isKeyword(value,len,"VERTEX")) entityCode=ENT_VERTEX;
+			else if (isKeyword(value,len,"SEQEND")) entityCode=ENT_SEQEND;
+			else if (section==DXF_SECTION_BLOCKS && isKeyword(value,len,"BLOCK")) entityCode=ENT_BLOCK;
+			else if (section==DXF_SECTION_BLOCKS && isKeyword(value,len,"ENDBLK")) entityCode=ENT_ENDBLK;
+			else entityCode=ENT_LAST;
+		} else if (isNumericCode(code)) {
+			acc.push(code,d,i);
+		} else if (code==2 && (entityCode==ENT_BLOCK || entityCode==ENT_INSERT)) {
+			/*Block names are case insensitive*/
+			while (len>0 && isBlankChar(value[len-1])) len--;
+			if (len>(int)sizeof(name)-1) len=sizeof(name)-1;
+			int k;
+			for (k=0; k<len; k++) name[k]=toupper((unsigned char)value[k]);
+			name[len]=0;
 		}
-		
-		if (inEntities) {
-			entityDone=0;
-			preEntityCode=entityCode;
-
-			if (code==0) {
-				entityDone=1;
-				//qDebug("Code: %s",buffer);
-				if (!strncmp(buffer,"LINE",4)) entityCode=ENT_LINE;
-				else if (!strncmp(buffer,"POINT",5)) entityCode=ENT_POINT;
-				else if (!strncmp(buffer,"LWPOLYLINE",10)) entityCode=ENT_LWPOLYLINE;
-				else if (!strncmp(buffer,"CIRCLE",6)) entityCode=ENT_CIRCLE;
-				else if (!strncmp(buffer,"ARC",3)) entityCode=ENT_ARC;
-				else if (!strncmp(buffer,"3DFACE",5)) entityCode=ENT_3DFACE;
-				else entityCode=ENT_LAST;
+	}
+
+	/*End of data: a truncated file still gets its last entity*/
+	void finish() {
+		if (inEntities()) flushEntity();
+		if (polyline.active) polyline.end(target);
+		section=DXF_SECTION_NONE;
+		target=geom;
+	}
+};
+
+
+/*Returns the end of the line starting at p, '\r' of CRLF files excluded*/
+static inline const char *lineEnd(const char *p,const char *end,const char **next)
+{
+	const char *q=(const char *)memchr(p,'\n',end-p);
+	if (!q) {
+		(*next)=end;
+		q=end;
+	} else {
+		(*next)=q+1;
+	}
+	if (q>p && q[-1]=='\r') q--;
+	return q;
+}
+
+
+/*
+ ASCII DXF: alternating group code and value lines, walked in place. Values
+ are converted only for the codes the entities use. Returns where it
+ stopped, after the group that made the parser done.
+*/
+static const char *tokenizeAsciiDXF(DXFParser &parser,const char *p,const char *end)
+{
+	while (p<end && !parser.done) {
+		const char *next;
+		const char *e=lineEnd(p,end,&next);
+		int code;
+		const char *q=parseInt(skipBlanks(p,e),e,&code);
+		if (q==skipBlanks(p,e)) {
+			if (skipBlanks(p,e)==e) {
+				/*Empty line, e.g. trailing newlines*/
+				p=next;
+				continue;
 			}
-			double dvalue=atof(buffer);
-			int ivalue=atoi(buffer);
-
-			if (code>=10 && code<=39) codeDouble[code].push(&dvalue);
-			if (code>=40 && code<=59) codeDouble[code].push(&dvalue);
-			if (code>=60 && code<=99) codeInt[code].push(&ivalue);
-			if (code>=210 && code<=239) codeDouble[code].push(&dvalue);
-
-
- 
-
-			if (entityDone) {
-				switch (preEntityCode) {
-					case ENT_LINE:
-						{
-							double x1[3],x2[3],Z[3];
-							codeDouble[10].pop(&x1[0]); 
-							codeDouble[20].pop(&x1[1]);
-							codeDouble[30].pop(&x1[2]);
-							codeDouble[11].pop(&x2[0]); 
-							codeDouble[21].pop(&x2[1]);
-							codeDouble[31].pop(&x2[2]);
-							
-							if (codeDouble[210].pop(&Z[0])) {
-								codeDouble[220].pop(&Z[1]);
-								codeDouble[230].pop(&Z[2]);
-							} else {
-								Z[0]=0; Z[1]=0; Z[2]=1;
-							}
-
-							extrudePoint(x1,Z);
-							extrudePoint(x2,Z);
-
-							
-							int id1=geom->addGrid(x1[0],x1[1],x1[2]);
-							int id2=geom->addGrid(x2[0],x2[1],x2[2]);
-							geom->addLine(id1,id2);
-
-						}
-						break;
-					case ENT_POINT:
-						{
-							double x[3];
-							double Z[3];
-
-							
-							codeDouble[10].pop(&x[0]); 
-							codeDouble[20].pop(&x[1]);
-							codeDouble[30].pop(&x[2]);
-
-							if (codeDouble[210].pop(&Z[0])) {
-								codeDouble[220].pop(&Z[1]);
-								codeDouble[230].pop(&Z[2]);
-							} else {
-								Z[0]=0; Z[1]=0; Z[2]=1;
-							}
-							extrudePoint(x,Z);
-							int id=geom->addGrid(x[0],x[1],x[2]);
-							geom->addPoint(id);
-						}
-						break;
-					case ENT_LWPOLYLINE:
-						{
-							double x[3];
-							double Z[3];
-							int k,n;
-							codeInt[90].pop(&n);
-							if (codeDouble[210].pop(&Z[0])) {
-								codeDouble[220].pop(&Z[1]);
-								codeDouble[230].pop(&Z[2]);
-							} else {
-								Z[0]=0; Z[1]=0; Z[2]=1;
-							}
-
-							if (n>0) {
-								int *id=new int[n];
-								for (k=0; k<n; k++) {
-									codeDouble[10].pop(&x[0]); 
-									codeDouble[20].pop(&x[1]);
-									x[2]=0;
-									extrudePoint(x,Z);
-
-									id[k]=geom->addGrid(x[0],x[1],x[2]);
-								}
-								for (k=n-1; k>=1; k--) {
-									geom->addLine(id[k],id[k-1]);
-								}
-								if (n>1) {
-									codeInt[70].pop(&k);
-									if (k==1) geom->addLine(id[0],id[n-1]);
-								}
-
-								delete []id;
-							}
-						}
-						break;
-					case ENT_CIRCLE:
-						{
-							double x0_d[3];
-							double x[3];
-
-							double r_d;
-							double Z_d[3];
-
-							float Z[3];
-							float x0[3];
-							float r;
-
-							int k,n;
-							codeInt[90].pop(&n);
-							if (codeDouble[210].pop(&Z_d[0])) {
-								codeDouble[220].pop(&Z_d[1]);
-								codeDouble[230].pop(&Z_d[2]);
-							} else {
-								Z_d[0]=0; Z_d[1]=0; Z_d[2]=1;
-							}
-							Z[0]=Z_d[0]; Z[1]=Z_d[1]; Z[2]=Z_d[2];
-							
-							codeDouble[10].pop(&x0_d[0]); 
-							codeDouble[20].pop(&x0_d[1]);
-							codeDouble[30].pop(&x0_d[2]);
-
-							x0[0]=x0_d[0]; x0[1]=x0_d[1]; x0[2]=x0_d[2];
-
-							codeDouble[40].pop(&r_d);
-							r=r_d;
-
-							CoordinateSystem<float> XYZ;
-
-							createObjectCoordSystem(&XYZ,Z);
-
-							float x_center[3];
-							XYZ.fromLocalToGlobal(x_center,x0);
-
-							XYZ.setCenter(x_center);
-							geom->addCircle(XYZ,r);
-
-						}
-						break;
-
-					case ENT_ARC:
-						{
-							double x0_d[3];
-							double x[3];
-
-							double r_d;
-							double Z_d[3];
-							double f_d;
-
-							float Z[3];
-							float x0[3];
-							float r;
-							float fmin,fmax;
-
-							int k,n;
-							codeInt[90].pop(&n);
-							if (codeDouble[210].pop(&Z_d[0])) {
-								codeDouble[220].pop(&Z_d[1]);
-								codeDouble[230].pop(&Z_d[2]);
-							} else {
-								Z_d[0]=0; Z_d[1]=0; Z_d[2]=1;
-							}
-							Z[0]=Z_d[0]; Z[1]=Z_d[1]; Z[2]=Z_d[2];
-
-							codeDouble[10].pop(&x0_d[0]); 
-							codeDouble[20].pop(&x0_d[1]);
-							codeDouble[30].pop(&x0_d[2]);
-
-							x0[0]=x0_d[0]; x0[1]=x0_d[1]; x0[2]=x0_d[2];
-
-							codeDouble[40].pop(&r_d);
-							r=r_d;
-
-							codeDouble[50].pop(&f_d);
-							fmin=f_d*3.14159/180.;
-							codeDouble[51].pop(&f_d);
-							fmax=f_d*3.14159/180.;
-
-
-							CoordinateSystem<float> XYZ;
-
-							createObjectCoordSystem(&XYZ,Z);
-
-							float x_center[3];
-							XYZ.fromLocalToGlobal(x_center,x0);
-
-							XYZ.setCenter(x_center);
-							geom->addArc(XYZ,r,fmin,fmax);
-
-						}
-						break;
-					case ENT_3DFACE:
-						{
-							double x[4][3];
-							int edgeMask;
-							codeDouble[10].pop(&x[0][0]);
-							codeDouble[20].pop(&x[0][1]);
-							codeDouble[30].pop(&x[0][2]);
-							codeDouble[11].pop(&x[1][0]);
-							codeDouble[21].pop(&x[1][1]);
-							codeDouble[31].pop(&x[1][2]);
-							codeDouble[12].pop(&x[2][0]);
-							codeDouble[22].pop(&x[2][1]);
-							codeDouble[32].pop(&x[2][2]);
-							codeDouble[13].pop(&x[3][0]);
-							codeDouble[23].pop(&x[3][1]);
-							codeDouble[33].pop(&x[3][2]);
-							codeInt[70].pop(&edgeMask);
-
-							int id1,id2,id3,id4;
-							id1=geom->addGrid(x[0][0],x[0][1],x[0][2]);
-							id2=geom->addGrid(x[1][0],x[1][1],x[1][2]);
-							id3=geom->addGrid(x[2][0],x[2][1],x[2][2]);
-							if (x[3][0]==x[2][0] && x[3][1]==x[2][1] && x[3][2]==x[2][2]) {
-								geom->addTriangle(id1,id2,id3,0);
-								if (!(edgeMask & 1)) geom->addEdge(id1,id2);
-								if (!(edgeMask & 2)) geom->addEdge(id2,id3);
-								if (!(edgeMask & 4)) geom->addEdge(id3,id1);
-							} else {
-								id4=geom->addGrid(x[3][0],x[3][1],x[3][2]);
-								geom->addTriangle(id1,id2,id3,0);
-								geom->addTriangle(id3,id4,id1,0);
-								if (!(edgeMask & 1)) geom->addEdge(id1,id2);
-								if (!(edgeMask & 2)) geom->addEdge(id2,id3);
-								if (!(edgeMask & 4)) geom->addEdge(id3,id4);
-								if (!(edgeMask & 1)) geom->addEdge(id4,id1);
-							}
-
-						}
-						break;
+			qDebug("DXF: invalid group code line");
+			break;
+		}
+		if (next==end) break;
+
+		const char *value=next;
+		const char *valueEnd=lineEnd(value,end,&next);
+		double d=0;
+		int i=0;
+		if (isNumericCode(code)) {
+			const char *v=skipBlanks(value,valueEnd);
+			if (isIntegerCode(code)) {
+				parseInt(v,valueEnd,&i);
+				d=i;
+			} else {
+				parseDouble(v,valueEnd,&d);
+				i=(int)d;
+			}
+		}
+		parser.group(code,value,valueEnd-value,d,i);
+		p=next;
+	}
+	return p;
+}
+
+
+/*Line holding only an integer (blanks around it allowed)*/
+static int isIntegerLine(const char *p,const char *e,int *v)
+{
+	p=skipBlanks(p,e);
+	const char *q=parseInt(p,e,v);
+	return q!=p && skipBlanks(q,e)==e;
+}
+
+
+/*
+ First entity start at or after p: a 0 group code line followed by a name.
+ Value lines are never followed by another value, and a name (3DFACE too)
+ is never a plain integer, so a "0" value line can not be taken for a code.
+ VERTEX and SEQEND belong to the POLYLINE before them and are passed over.
+*/
+static const char *nextEntityBoundary(const char *p,const char *begin,const char *end)
+{
+	if (p>begin && p[-1]!='\n') {
+		const char *q=(const char *)memchr(p,'\n',end-p);
+		if (!q) return end;
+		p=q+1;
+	}
+	while (p<end) {
+		const char *next,*next2;
+		const char *e=lineEnd(p,end,&next);
+		int code;
+		if (isIntegerLine(p,e,&code) && code==0 && next<end) {
+			const char *e2=lineEnd(next,end,&next2);
+			if (skipBlanks(next,e2)!=e2 && !isIntegerLine(next,e2,&code) &&
+				!isKeyword(next,e2-next,"VERTEX") && !isKeyword(next,e2-next,"SEQEND")) return p;
+		}
+		p=next;
+	}
+	return end;
+}
+
+
+/*Smallest part of the ENTITIES section worth a thread*/
+static const qint64 DXF_MIN_BYTES_PER_THREAD=4<<20;
+
+/*Part of the ENTITIES section parsed into its own geometry*/
+class DXFChunk {
+public:
+	const char *begin;
+	const char *end;
+	Geometry *top;
+	DXFBlockTable *blocks;
+	Geometry geom;
+	unsigned int entities;
+	unsigned int looseGrids;
+	int sectionEnded;
+};
+
+
+static void parseDXFChunks(void *ctx,int first,int last,int thread)
+{
+	DXFChunk *chunks=(DXFChunk *)ctx;
+	int k;
+	for (k=first; k<last; k++) {
+		DXFChunk &C=chunks[k];
+		DXFParser parser(C.top,&C.geom,C.blocks);
+		parser.stopAt=DXF_STOP_ENTITIES_END;
+		parser.startEntities();
+		tokenizeAsciiDXF(parser,C.begin,C.end);
+		parser.finish();
+		C.entities=parser.entities;
+		C.looseGrids=parser.looseGrids;
+		C.sectionEnded=parser.done;
+	}
+}
+
+
+/*
+ Everything up to the ENTITIES section is read sequentially. The section is
+ then cut at entity starts into one part per thread, each parsed into its own
+ geometry; the parts are appended in file order, so the result is the same
+ for any thread count. Parts past the end of the section are dropped.
+*/
+static unsigned int readAsciiDXFParallel(Geometry *geom,DXFBlockTable &blocks,const char *begin,const char *end,int threads,unsigned int *looseGrids)
+{
+	DXFParser head(geom,geom,&blocks);
+	head.stopAt=DXF_STOP_ENTITIES_START;
+	const char *p=tokenizeAsciiDXF(head,begin,end);
+	if (!head.done) {
+		head.finish();
+		(*looseGrids)=head.looseGrids;
+		return head.entities;
+	}
+
+	qint64 size=end-p;
+	int n=threads;
+	if (size/n<DXF_MIN_BYTES_PER_THREAD) n=size/DXF_MIN_BYTES_PER_THREAD;
+	if (n<1) n=1;
+
+	DXFChunk *chunks=new DXFChunk[n];
+	int k;
+	const char *from=p;
+	for (k=0; k<n; k++) {
+		const char *to=end;
+		if (k<n-1) to=nextEntityBoundary(p+size*(k+1)/n,begin,end);
+		if (to<from) to=from;
+		chunks[k].begin=from;
+		chunks[k].end=to;
+		chunks[k].top=geom;
+		chunks[k].blocks=&blocks;
+		from=to;
+	}
+
+	parallelFor(n,n,parseDXFChunks,chunks);
 
+	unsigned int entities=head.entities;
+	(*looseGrids)=head.looseGrids;
+	for (k=0; k<n; k++) {
+		geom->appendGeometry(chunks[k].geom);
+		entities+=chunks[k].entities;
+		(*looseGrids)+=chunks[k].looseGrids;
+		if (chunks[k].sectionEnded) break;
+	}
+	delete []chunks;
+
+	return entities;
+}
+
+
+/*Binary DXF starts with this sentinel, its terminating zero included*/
+static const char DXF_BINARY_SENTINEL[]="AutoCAD Binary DXF\r\n\x1a";
+static const int DXF_BINARY_SENTINEL_SIZE=22;
+
+enum {
+	DXF_STRING,
+	DXF_DOUBLE,
+	DXF_INT16,
+	DXF_INT32,
+	DXF_INT64,
+	DXF_BOOL,
+	DXF_CHUNK
+};
+
+
+/*Value encoding of a group code in binary DXF*/
+static int binaryValueType(int code)
+{
+	if (code>=10 && code<=59) return DXF_DOUBLE;
+	if (code>=60 && code<=79) return DXF_INT16;
+	if (code>=90 && code<=99) return DXF_INT32;
+	if (code>=110 && code<=149) return DXF_DOUBLE;
+	if (code>=160 && code<=169) return DXF_INT64;
+	if (code>=170 && code<=179) return DXF_INT16;
+	if (code>=210 && code<=239) return DXF_DOUBLE;
+	if (code>=270 && code<=289) return DXF_INT16;
+	if (code>=290 && code<=299) return DXF_BOOL;
+	if (code>=310 && code<=319) return DXF_CHUNK;
+	if (code>=370 && code<=389) return DXF_INT16;
+	if (code>=400 && code<=409) return DXF_INT16;
+	if (code>=420 && code<=429) return DXF_INT32;
+	if (code>=440 && code<=459) return DXF_INT32;
+	if (code>=460 && code<=469) return DXF_DOUBLE;
+	if (code==1004) return DXF_CHUNK;
+	if (code>=1010 && code<=1059) return DXF_DOUBLE;
+	if (code>=1060 && code<=1070) return DXF_INT16;
+	if (code==1071) return DXF_INT32;
+	return DXF_STRING;
+}
+
+
+static int isBinaryDXF(const unsigned char *p,qint64 size)
+{
+	return size>=DXF_BINARY_SENTINEL_SIZE && !memcmp(p,DXF_BINARY_SENTINEL,DXF_BINARY_SENTINEL_SIZE);
+}
+
+
+/*
+ Binary DXF: little endian group code (one byte with 255 as escape to a
+ two byte code in R12, two bytes since R13), then the value in the encoding
+ of binaryValueType. The file starts with 0/SECTION, so a zero byte after
+ the first code tells the two byte form.
+*/
+static void tokenizeBinaryDXF(DXFParser &parser,const unsigned char *p,const unsigned char *end)
+{
+	int wideCodes=(end-p>=2 && p[1]==0);
+
+	while (p<end) {
+		int code;
+		if (wideCodes || p[0]==255) {
+			if (!wideCodes) p++;
+			if (end-p<2) break;
+			short c16;
+			memcpy(&c16,p,2);
+			code=c16;
+			p+=2;
+		} else {
+			code=p[0];
+			p++;
+		}
+
+		const char *value=(const char *)p;
+		int len=0;
+		double d=0;
+		int i=0;
+		switch (binaryValueType(code)) {
+			case DXF_STRING:
+				{
+					const unsigned char *q=(const unsigned char *)memchr(p,0,end-p);
+					if (!q) {
+						qDebug("DXF: unterminated string in binary file");
+						return;
+					}
+					len=q-p;
+					p=q+1;
 				}
-				for (k=0; k<2000; k++) {
-					codeDouble[k].clear();
-					codeInt[k].clear();
+				break;
+			case DXF_DOUBLE:
+				if (end-p<8) return;
+				memcpy(&d,p,8);
+				i=(int)d;
+				p+=8;
+				break;
+			case DXF_INT16:
+				{
+					if (end-p<2) return;
+					short v;
+					memcpy(&v,p,2);
+					i=v; d=v;
+					p+=2;
 				}
-			}
+				break;
+			case DXF_INT32:
+				if (end-p<4) return;
+				memcpy(&i,p,4);
+				d=i;
+				p+=4;
+				break;
+			case DXF_INT64:
+				{
+					if (end-p<8) return;
+					long long v;
+					memcpy(&v,p,8);
+					i=(int)v; d=(double)v;
+					p+=8;
+				}
+				break;
+			case DXF_BOOL:
+				if (end-p<1) return;
+				i=p[0]; d=i;
+				p++;
+				break;
+			case DXF_CHUNK:
+				if (end-p<1 || end-p<1+p[0]) return;
+				value=(const char *)p+1;
+				len=p[0];
+				p+=1+len;
+				break;
 		}
+
+		parser.group(code,value,len,d,i);
+		if (code==0 && isKeyword(value,len,"EOF")) break;
 	}
+}
+
 
-		
-	fclose(fp);
+void readDXF(Geometry *geom,const char *name)
+{
+	MappedFile file;
+	if (!file.open(name)) return;
+
+	QElapsedTimer t;
+	t.start();
+
+	DXFBlockTable blocks;
+	unsigned int entities,looseGrids;
+	int threads=parallelThreadCount(geom->loadThreads);
+	if (isBinaryDXF(file.data,file.size)) {
+		DXFParser parser(geom,geom,&blocks);
+		tokenizeBinaryDXF(parser,file.data+DXF_BINARY_SENTINEL_SIZE,file.data+file.size);
+		parser.finish();
+		entities=parser.entities;
+		looseGrids=parser.looseGrids;
+	} else if (threads>1 && file.size>=2*DXF_MIN_BYTES_PER_THREAD) {
+		entities=readAsciiDXFParallel(geom,blocks,file.begin(),file.end(),threads,&looseGrids);
+	} else {
+		DXFParser parser(geom,geom,&blocks);
+		tokenizeAsciiDXF(parser,file.begin(),file.end());
+		parser.finish();
+		entities=parser.entities;
+		looseGrids=parser.looseGrids;
+	}
+
+	/*Only indexed meshes: every grid is a distinct vertex already*/
+	geom->gridsWelded=(looseGrids==0);
+
+	unsigned int k;
+	applyBlockBases(geom,blocks);
+	for (k=0; k<geom->blocks.length(); k++) {
+		applyBlockBases(geom->blocks.at(k),blocks);
+		geom->blocks.at(k)->gridsWelded=geom->gridsWelded;
+	}
+	if (geom->blocks.length()) qDebug("%u blocks, %u placements",geom->blocks.length(),geom->instances.length());
 
+	double sec=t.elapsed()/1000.;
+	if (sec<=0) sec=1e-3;
+	qDebug("Time to read DXF: %lld msec (%.1f MB/s, %.0f entities/s)",t.elapsed(),file.size/(1024.*1024.)/sec,entities/sec);
 }
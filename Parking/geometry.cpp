@@ -4,7 +4,11 @@
 #include "dxf_reader.h"
 #include "chunck3ds_reader.h"
 #include "iges_reader.h"
+#include "weld.h"
 #include <qdebug.h>
+#include <QThread>
+#include <QAtomicInt>
+#include <QElapsedTimer>
 
 #ifdef WIN32
 #include <Windows.h>
@@ -19,10 +23,111 @@ using namespace std;
 #include <set>
 #include <ctime>
 #include <cmath>
+#include <cfloat>
+
+/*
+ Tessellates the freeform curves and surfaces in order, one of each kind in
+ turn while both are wanted. curves and surfs count the finished ones; they
+ are published after the coords and strips are complete, so the drawing
+ thread only reads entities below them
+*/
+class TessellationWorker : public QThread {
+public:
+	Geometry *geom;
+	QAtomicInt wantCurves,wantSurfs;
+	QAtomicInt curves,surfs;
+	QAtomicInt cancel;
+	float chord;
+
+	TessellationWorker(Geometry *g) : geom(g),chord(0) {}
+
+protected:
+	void run();
+};
+
+
+static void growBox(float mn[3],float mx[3],const float p[3])
+{
+	int i;
+	for (i=0; i<3; i++) {
+		if (mn[i]>p[i]) mn[i]=p[i];
+		if (mx[i]<p[i]) mx[i]=p[i];
+	}
+}
+
+/*Diagonal of the box of the grids and control points*/
+static float freeformModelSize(Geometry *geom)
+{
+	float mn[3],mx[3];
+	const float *first=0;
+	int i,j;
+	if (geom->grids.length()) first=geom->grids.at(0).coords;
+	else if (geom->bsplines.length()) first=geom->bsplines.at(0).P[0];
+	else if (geom->bsplinesurfs.length()) first=geom->bsplinesurfs.at(0).P[0];
+	if (!first) return 0;
+	vec_copy(mn,first);
+	vec_copy(mx,first);
+
+	for (i=0; i<geom->grids.length(); i++) growBox(mn,mx,geom->grids.at(i).coords);
+	for (i=0; i<geom->bsplines.length(); i++) {
+		const BSpline &BS=geom->bsplines.at(i);
+		for (j=0; j<=BS.K; j++) growBox(mn,mx,BS.P[j]);
+	}
+	for (i=0; i<geom->bsplinesurfs.length(); i++) {
+		const BSplineSurf &BSS=geom->bsplinesurfs.at(i);
+		for (j=0; j<(BSS.K1+1)*(BSS.K2+1); j++) growBox(mn,mx,BSS.P[j]);
+	}
+
+	float d[3],size;
+	vec_diff(d,mx,mn);
+	vec_length(&size,d);
+	return size;
+}
+
+void TessellationWorker::run()
+{
+	if (chord<=0) {
+		chord=geom->tessellationChord;
+		if (chord<=0) chord=freeformModelSize(geom)*1e-3f;
+	}
+	float angle=geom->tessellationAngle*pi/180.;
+
+	while (!cancel.fetchAndAddOrdered(0)) {
+		int work=0;
+		int i=curves.fetchAndAddOrdered(0);
+		if (wantCurves.fetchAndAddOrdered(0) && i<(int)geom->bsplines.length()) {
+			geom->bsplines.at(i).tessellate(chord,angle);
+			curves.fetchAndStoreOrdered(i+1);
+			work=1;
+		}
+		i=surfs.fetchAndAddOrdered(0);
+		if (wantSurfs.fetchAndAddOrdered(0) && i<(int)geom->bsplinesurfs.length()) {
+			geom->bsplinesurfs.at(i).tessellate(chord,angle);
+			surfs.fetchAndStoreOrdered(i+1);
+			work=1;
+		}
+		if (!work) break;
+	}
+}
+
 
 Geometry::Geometry()
 {
 	hasSmoothNormals=0;
+
+	loadThreads=0;
+	weldOnLoad=1;
+	gridsWelded=0;
+	weldTolerance=1e-6f;
+	trustFileNormals=0;
+	tessellationChord=0;
+	tessellationAngle=20;
+	tessellation=NULL;
+	index3DS=NULL;
+	shrinkCenter[0]=0;
+	shrinkCenter[1]=0;
+	shrinkCenter[2]=0;
+	shrinkScale=1;
 	 
 	pickedGrid=-1;
 
@@ -47,8 +152,18 @@ Geometry::Geometry()
 
 Geometry::~Geometry()
 {
+	if (tessellation) {
+		tessellation->cancel.fetchAndStoreOrdered(1);
+		tessellation->wait();
+		delete tessellation;
+	}
+	delete index3DS;
+
 	free(edgeStrip);
 	free(lineStrip);
+
+	unsigned int k;
+	for (k=0; k<blocks.length(); k++) delete blocks.at(k);
 }
 
 
@@ -79,6 +194,103 @@ int Geometry::addGrid(float x,float y,float z)
 }
 
 
+/*Merges the box of the grids appended in bulk from firstGrid on*/
+void Geometry::mergeBoundingBox(int firstGrid,const float mn[3],const float mx[3])
+{
+	int k;
+	if (firstGrid==0) {
+		for (k=0; k<3; k++) {
+			minn[k]=mn[k];
+			maxx[k]=mx[k];
+		}
+	} else {
+		for (k=0; k<3; k++) {
+			if (minn[k]>mn[k]) minn[k]=mn[k];
+			if (maxx[k]<mx[k]) maxx[k]=mx[k];
+		}
+	}
+}
+
+
+/*
+ Appends the entities of other, whose indices are shifted past the ones
+ already here. Used to merge the shards of the parallel readers.
+*/
+void Geometry::appendGeometry(Geometry &other)
+{
+	unsigned int k;
+	int gridOffset=grids.length();
+	int lineOffset=lines.length();
+	unsigned int firstTria=triangles.length();
+
+	if (other.grids.length()) {
+		mergeBoundingBox(gridOffset,other.minn,other.maxx);
+	}
+
+	grids.reserve(grids.length()+other.grids.length());
+	for (k=0; k<other.grids.length(); k++) {
+		Grid G=other.grids.at(k);
+		G.pos+=gridOffset;
+		grids.append(G);
+	}
+	for (k=0; k<other.points.length(); k++) {
+		points.append(other.points.at(k)+gridOffset);
+	}
+	lines.reserve(lines.length()+other.lines.length());
+	for (k=0; k<other.lines.length(); k++) {
+		Line L=other.lines.at(k);
+		L.node[0]+=gridOffset;
+		L.node[1]+=gridOffset;
+		lines.append(L);
+	}
+	int polylineOffset=polylineGrids.length();
+	polylineGrids.reserve(polylineGrids.length()+other.polylineGrids.length());
+	for (k=0; k<other.polylineGrids.length(); k++) {
+		polylineGrids.append(other.polylineGrids.at(k)+gridOffset);
+	}
+	for (k=0; k<other.polylines.length(); k++) {
+		Polyline P=other.polylines.at(k);
+		P.first+=polylineOffset;
+		polylines.append(P);
+	}
+	for (k=0; k<other.edges.length(); k++) {
+		Line L=other.edges.at(k);
+		L.node[0]+=gridOffset;
+		L.node[1]+=gridOffset;
+		edges.append(L);
+	}
+	triangles.reserve(triangles.length()+other.triangles.length());
+	for (k=0; k<other.triangles.length(); k++) {
+		triangles.append(other.triangles.at(k));
+		Triangle &T=triangles.at(triangles.length()-1);
+		T.node[0]+=gridOffset;
+		T.node[1]+=gridOffset;
+		T.node[2]+=gridOffset;
+	}
+	if (triangleColors.length() || other.triangleColors.length()) {
+		unsigned int n=triangleColors.length();
+		triangleColors.resize(triangles.length());
+		for (; n<firstTria; n++) triangleColors.at(n)=0;
+		for (k=0; k<other.triangles.length(); k++) {
+			triangleColors.at(firstTria+k)=k<other.triangleColors.length() ? other.triangleColors.at(k) : 0;
+		}
+	}
+	for (k=0; k<other.circles.length(); k++) circles.append(other.circles.at(k));
+	for (k=0; k<other.arcs.length(); k++) arcs.append(other.arcs.at(k));
+	for (k=0; k<other.splines.length(); k++) splines.append(other.splines.at(k));
+	for (k=0; k<other.bsplines.length(); k++) addBSpline(other.bsplines.at(k));
+	for (k=0; k<other.bsplinesurfs.length(); k++) addBSplineSurf(other.bsplinesurfs.at(k));
+	for (k=0; k<other.revolvelines.length(); k++) {
+		RevolveLine RL=other.revolvelines.at(k);
+		RL.line_axis_pos+=lineOffset;
+		RL.line_gen_pos+=lineOffset;
+		revolvelines.append(RL);
+	}
+	/*Block indices refer to the top geometry and are kept*/
+	for (k=0; k<other.instances.length(); k++) instances.append(other.instances.at(k));
+}
+
+
 int Geometry::addPoint(int n)
 {
 	points.append(n);
@@ -94,6 +306,18 @@ int Geometry::addLine(int n1,int n2)
 	return lines.length()-1;
 }
 
+/*Polyline through count consecutive grids from firstGrid on*/
+int Geometry::addPolyline(int firstGrid,int count)
+{
+	Polyline P;
+	P.first=polylineGrids.length();
+	P.count=count;
+	int k;
+	for (k=0; k<count; k++) polylineGrids.append(firstGrid+k);
+	polylines.append(P);
+	return polylines.length()-1;
+}
+
 int Geometry::addEdge(int n1,int n2)
 {
 	Line L;
@@ -165,7 +389,28 @@ int Geometry::addBSplineSurf(const BSplineSurf &BSS)
 	return bsplinesurfs.length()-1;
 }
 
+int Geometry::addBlock()
+{
+	blocks.append(new Geometry);
+	return blocks.length()-1;
+}
+
+int Geometry::addInstance(int block,const float mat[4][4])
+{
+	BlockInstance I;
+	I.block=block;
+	memcpy(I.mat,mat,sizeof(I.mat));
+	instances.append(I);
+	return instances.length()-1;
+}
+
 void Geometry::calcTrianglesNormals()
+{
+	calcTrianglesNormals(0,triangles.length());
+}
+
+/*Normals of the triangles [first,last)*/
+void Geometry::calcTrianglesNormals(unsigned int first,unsigned int last)
 {
         unsigned int k;
 	Triangle *tria;
@@ -176,7 +421,7 @@ void Geometry::calcTrianglesNormals()
 	float normal_s[3]={0};
 
 	float s;
-	for (k=0; k<triangles.length(); k++) {
+	for (k=first; k<last; k++) {
                 tria=&triangles.at(k);
 
                 crd[0]=grids.at(tria->node[0]).coords;
@@ -296,6 +541,101 @@ void Geometry::calcTrianglesSmoothNormals()
 
 }
 
+/*Normal sum of the corners on one grid sharing one smoothing group*/
+class GroupNormal {
+public:
+	unsigned int group;
+	int next;
+	vector3d<float> sum;
+};
+
+
+/*
+ Corner normals from the smoothing groups, without the triangle adjacency:
+ one pass sums the triangle normals per (grid,group), a second one hands
+ them to the corners. Corners of faceted triangles (group 0) take the
+ triangle normal. The sums are chained per grid, a grid has few groups
+*/
+void Geometry::calcTrianglesGroupNormals()
+{
+	if (hasSmoothNormals) return;
+	hasSmoothNormals=1;
+
+	clock_t t=clock();
+
+	unsigned int groups=calcGroupNormals(0,triangles.length(),0,grids.length());
+
+	qDebug("Time to calcTrianglesGroupNormals: %f msec (%u grid groups)",(clock()-t)/(CLOCKS_PER_SEC/1000.),groups);
+}
+
+/*
+ Group normals of the triangles [first,last), whose corners all lie in the
+ gridCount grids from firstGrid. Without smoothing groups every triangle is
+ in one group, as calcTrianglesSmoothNormals smooths them. Returns the
+ number of grid groups
+*/
+unsigned int Geometry::calcGroupNormals(unsigned int first,unsigned int last,int firstGrid,int gridCount)
+{
+	int grouped=smoothGroups.length()==triangles.length();
+
+	unsigned int k,k1;
+	int *head=(int *)malloc(gridCount*sizeof(int));
+	for (k=0; k<(unsigned int)gridCount; k++) head[k]=-1;
+
+	myVector<GroupNormal> sums;
+	sums.reserve(gridCount);
+	for (k=first; k<last; k++) {
+		Triangle &T=triangles.at(k);
+		unsigned int group=grouped ? smoothGroups.at(k) : 1;
+		if (!group) continue;
+		for (k1=0; k1<3; k1++) {
+			int n=T.node[k1]-firstGrid;
+			int s=head[n];
+			while (s!=-1 && sums.at(s).group!=group) s=sums.at(s).next;
+			if (s==-1) {
+				GroupNormal G;
+				G.group=group;
+				G.next=head[n];
+				G.sum.zero();
+				sums.append(G);
+				s=head[n]=sums.length()-1;
+			}
+			sums.at(s).sum.add(T.normal);
+		}
+	}
+
+	for (k=0; k<sums.length(); k++) {
+		float *norm=sums.at(k).sum.data;
+		float s=sqrtf(norm[0]*norm[0]+norm[1]*norm[1]+norm[2]*norm[2]);
+		if (s>0) sums.at(k).sum.scale(1./s);
+	}
+
+	for (k=first; k<last; k++) {
+		Triangle &T=triangles.at(k);
+		unsigned int group=grouped ? smoothGroups.at(k) : 1;
+		for (k1=0; k1<3; k1++) {
+			int s=group ? head[T.node[k1]-firstGrid] : -1;
+			while (s!=-1 && sums.at(s).group!=group) s=sums.at(s).next;
+			T.cnormal[k1].copy(s==-1 ? T.normal : sums.at(s).sum);
+		}
+	}
+
+	free(head);
+	return sums.length();
+}
+
+/*
+ Normals of an object decoded after the others (load3DS): its triangle
+ normals, then the corner normals from its own grids
+*/
+void Geometry::calcObjectNormals(unsigned int object)
+{
+	const MeshObject &O=objects.at(object);
+	calcTrianglesNormals(O.firstTriangle,O.firstTriangle+O.triangleCount);
+	calcGroupNormals(O.firstTriangle,O.firstTriangle+O.triangleCount,O.firstGrid,O.gridCount);
+}
+
+
 void Geometry::translateGeometry(float mat[4][4])
 {
 	int k;
@@ -444,7 +784,21 @@ static int compareGrids1(const Grid *f1,const Grid *f2)
 
 void Geometry::shrinkGeometry()
 {
-	int k;
+	shrinkTransform();
+
+	unsigned int k;
+	for (k=0; k<grids.length(); k++) shrinkPoint(grids.at(k).coords);
+
+	/*Same move for the object boxes*/
+	for (k=0; k<objects.length(); k++) {
+		shrinkPoint(objects.at(k).minn);
+		shrinkPoint(objects.at(k).maxx);
+	}
+}
+
+/*The move and scale of shrinkGeometry, from the model box*/
+void Geometry::shrinkTransform()
+{
 	/*Must move whole model into [-5,0,0],[5,10,5]*/
 	float r1=maxx[0]-minn[0];
 	float r2=maxx[1]-minn[1];
@@ -455,23 +809,64 @@ void Geometry::shrinkGeometry()
 	if (r2<r) r=r2;
 	if (r3<r) r=r3;
 
-	for (k=0; k<grids.length(); k++) {
-                grids.at(k).coords[0]-=(minn[0]+maxx[0])*.5;
-                grids.at(k).coords[1]-=(minn[1]+maxx[1])*.5;
-                grids.at(k).coords[2]-=(minn[2]+maxx[2])*.5;
+	int i;
+	for (i=0; i<3; i++) shrinkCenter[i]=(minn[i]+maxx[i])*.5;
+	shrinkScale=r;
+}
 
-		
-                grids.at(k).coords[0]*=r;
-                grids.at(k).coords[1]*=r;
-                grids.at(k).coords[2]*=r;
+/*Moves a point (or a box corner) like shrinkGeometry*/
+void Geometry::shrinkPoint(float p[3]) const
+{
+	float shift[3]={0,5,2.5};
+	int i;
+	for (i=0; i<3; i++) p[i]=(p[i]-shrinkCenter[i])*shrinkScale+shift[i];
+}
+
+
+/*
+ Merges the grids within weldTolerance (weldGrids, a parallel spatial hash)
+ and renumbers the entities. Grids keep their order
+*/
+void Geometry::compressGrids()
+{
+	if (!grids.length()) return;
+	int *realPos=new int[grids.length()];
+	weldGrids(this,weldTolerance,loadThreads,realPos);
 
-                grids.at(k).coords[1]+=5;
-                grids.at(k).coords[2]+=2.5;
+	unsigned int k;
+	/*Converting triangle grids*/
+	for (k=0; k<triangles.length(); k++) {
+		triangles.at(k).node[0]=realPos[triangles.at(k).node[0]];
+		triangles.at(k).node[1]=realPos[triangles.at(k).node[1]];
+		triangles.at(k).node[2]=realPos[triangles.at(k).node[2]];
+	}
+	/*Converting line grids*/
+	for (k=0; k<lines.length(); k++) {
+		lines.at(k).node[0]=realPos[lines.at(k).node[0]];
+		lines.at(k).node[1]=realPos[lines.at(k).node[1]];
+	}
+	/*Converting point grids*/
+	for (k=0; k<points.length(); k++) {
+		points.at(k)=realPos[points.at(k)];
+	}
+	/*Converting polyline grids*/
+	for (k=0; k<polylineGrids.length(); k++) {
+		polylineGrids.at(k)=realPos[polylineGrids.at(k)];
+	}
+	/*Converting edge grids*/
+	for (k=0; k<edges.length(); k++) {
+		edges.at(k).node[0]=realPos[edges.at(k).node[0]];
+		edges.at(k).node[1]=realPos[edges.at(k).node[1]];
 	}
+	delete []realPos;
 }
 
 
-void Geometry::compressGrids()
+/*
+ Former merge: sorts the grids and merges neighbours in the sorted order
+ closer than 1e-6. Kept as the baseline of the weld benchmark
+*/
+void Geometry::compressGridsSorted()
 {
 	if (!grids.length()) return;
 	float dx,dy,dz;
@@ -502,6 +897,10 @@ void Geometry::compressGrids()
 	for (k=0; k<points.length(); k++) {
 		points.at(k)=realPos[points.at(k)];
 	}
+	/*Converting polyline grids*/
+	for (k=0; k<polylineGrids.length(); k++) {
+		polylineGrids.at(k)=realPos[polylineGrids.at(k)];
+	}
 	/*Converting edge grids*/
 	for (k=0; k<edges.length(); k++) {
 		edges.at(k).node[0]=realPos[edges.at(k).node[0]];
@@ -546,6 +945,10 @@ void Geometry::compressGrids()
 	for (k=0; k<points.length(); k++) {
 		points.at(k)=realPos[points.at(k)];
 	}
+	/*Converting polyline grids*/
+	for (k=0; k<polylineGrids.length(); k++) {
+		polylineGrids.at(k)=realPos[polylineGrids.at(k)];
+	}
 	/*Converting edge grids*/
 	for (k=0; k<edges.length(); k++) {
 		edges.at(k).node[0]=realPos[edges.at(k).node[0]];
@@ -554,17 +957,284 @@ void Geometry::compressGrids()
 	delete []realPos;
 }
 
+/*Maximum nesting of block instances, deeper (or cyclic) ones are skipped*/
+static const int MAX_BLOCK_DEPTH=16;
+
+static inline void transformPoint(float out[3],const float mat[4][4],const float p[3])
+{
+	int i;
+	for (i=0; i<3; i++) out[i]=mat[0][i]*p[0]+mat[1][i]*p[1]+mat[2][i]*p[2]+mat[3][i];
+}
+
+static void boxCorners(float corners[8][3],const float mn[3],const float mx[3])
+{
+	int k;
+	for (k=0; k<8; k++) {
+		corners[k][0]=(k&1) ? mx[0] : mn[0];
+		corners[k][1]=(k&2) ? mx[1] : mn[1];
+		corners[k][2]=(k&4) ? mx[2] : mn[2];
+	}
+}
+
+
+/*
+ Bounding box of block b including its nested instances. Empty blocks are
+ left with minn>maxx. state: 0 not done, 1 in progress (cycle), 2 done
+*/
+static void blockBounds(Geometry *top,int b,char *state)
+{
+	if (state[b]) return;
+	state[b]=1;
+
+	Geometry *B=top->blocks.at(b);
+	int k;
+	if (!B->grids.length()) {
+		for (k=0; k<3; k++) {
+			B->minn[k]=FLT_MAX;
+			B->maxx[k]=-FLT_MAX;
+		}
+	}
+	/*Freeform shapes by their control points*/
+	for (k=0; k<B->bsplines.length(); k++) {
+		const BSpline &BS=B->bsplines.at(k);
+		int j;
+		for (j=0; j<=BS.K; j++) growBox(B->minn,B->maxx,BS.P[j]);
+	}
+	for (k=0; k<B->bsplinesurfs.length(); k++) {
+		const BSplineSurf &BSS=B->bsplinesurfs.at(k);
+		int j;
+		for (j=0; j<(BSS.K1+1)*(BSS.K2+1); j++) growBox(B->minn,B->maxx,BSS.P[j]);
+	}
+	for (k=0; k<B->instances.length(); k++) {
+		const BlockInstance &I=B->instances.at(k);
+		blockBounds(top,I.block,state);
+		if (state[I.block]!=2) continue;
+
+		Geometry *N=top->blocks.at(I.block);
+		if (N->minn[0]>N->maxx[0]) continue;
+		float corners[8][3],p[3];
+		boxCorners(corners,N->minn,N->maxx);
+		int k1;
+		for (k1=0; k1<8; k1++) {
+			transformPoint(p,I.mat,corners[k1]);
+			growBox(B->minn,B->maxx,p);
+		}
+	}
+	state[b]=2;
+}
+
+
+/*
+ Corners of the placed bounding box of instance k, returns 0 if the block
+ is empty
+*/
+int Geometry::instanceCorners(unsigned int k,float corners[8][3])
+{
+	const BlockInstance &I=instances.at(k);
+	Geometry *B=blocks.at(I.block);
+	if (B->minn[0]>B->maxx[0]) return 0;
+
+	float box[8][3];
+	boxCorners(box,B->minn,B->maxx);
+	int k1;
+	for (k1=0; k1<8; k1++) transformPoint(corners[k1],I.mat,box[k1]);
+	return 1;
+}
+
+
+/*
+ Prepares the block geometries like a loaded model and includes the placed
+ instances in the bounding box
+*/
+void Geometry::prepareBlocks()
+{
+	if (!blocks.length()) return;
+
+	unsigned int k;
+	for (k=0; k<blocks.length(); k++) {
+		Geometry *B=blocks.at(k);
+		if (!B->gridsWelded) B->compressGrids();
+		B->calcTrianglesNormals();
+		B->makeEdgeStrip();
+		B->makeLineStrip();
+	}
+
+	char *state=(char *)calloc(blocks.length(),sizeof(char));
+	for (k=0; k<blocks.length(); k++) blockBounds(this,k,state);
+	free(state);
+
+	int empty=!grids.length();
+	for (k=0; k<instances.length(); k++) {
+		float corners[8][3];
+		if (!instanceCorners(k,corners)) continue;
+		int k1;
+		for (k1=0; k1<8; k1++) {
+			if (empty) {
+				mergeBoundingBox(0,corners[k1],corners[k1]);
+				empty=0;
+			} else {
+				growBox(minn,maxx,corners[k1]);
+			}
+		}
+	}
+
+	/*
+	 Freeform shapes of the blocks are tessellated once here, not per
+	 instance, to a thousandth of the placed model unless a chord is set
+	*/
+	float chord=tessellationChord;
+	if (chord<=0 && !empty) {
+		float d[3];
+		vec_diff(d,maxx,minn);
+		vec_length(&chord,d);
+		chord*=1e-3f;
+	}
+	for (k=0; k<blocks.length(); k++) {
+		Geometry *B=blocks.at(k);
+		if (!B->bsplines.length() && !B->bsplinesurfs.length()) continue;
+		B->tessellationChord=chord;
+		B->tessellationAngle=tessellationAngle;
+		B->waitTessellation();
+	}
+}
+
+
+/*Object holding grid, -1 if none*/
+int Geometry::objectOfGrid(int grid)
+{
+	unsigned int k;
+	for (k=0; k<objects.length(); k++) {
+		const MeshObject &O=objects.at(k);
+		if (grid>=O.firstGrid && grid<O.firstGrid+O.gridCount) return k;
+	}
+	return -1;
+}
+
+
+/*Projection times modelview, the current GL matrices*/
+static void viewMatrix(float m[4][4])
+{
+	float mv[4][4],pr[4][4];
+	glGetFloatv(GL_MODELVIEW_MATRIX,&mv[0][0]);
+	glGetFloatv(GL_PROJECTION_MATRIX,&pr[0][0]);
+	int i,j,l;
+	for (i=0; i<4; i++) {
+		for (j=0; j<4; j++) {
+			m[i][j]=0;
+			for (l=0; l<4; l++) m[i][j]+=pr[l][j]*mv[i][l];
+		}
+	}
+}
+
+/*0 when all corners of the box are beyond one of the six clip planes*/
+static int boxInView(const float m[4][4],const float mn[3],const float mx[3])
+{
+	float corners[8][3];
+	boxCorners(corners,mn,mx);
+
+	int outside[6]={1,1,1,1,1,1};
+	int i,l;
+	for (l=0; l<8; l++) {
+		const float *p=corners[l];
+		float c[4];
+		for (i=0; i<4; i++) c[i]=m[0][i]*p[0]+m[1][i]*p[1]+m[2][i]*p[2]+m[3][i];
+		for (i=0; i<3; i++) {
+			if (c[i]>=-c[3]) outside[2*i]=0;
+			if (c[i]<=c[3]) outside[2*i+1]=0;
+		}
+	}
+	for (i=0; i<6; i++) {
+		if (outside[i]) return 0;
+	}
+	return 1;
+}
+
+/*
+ Marks the objects whose box is outside the view volume, using the current
+ modelview and projection matrices
+*/
+void Geometry::cullObjects()
+{
+	if (!objects.length()) return;
+
+	float m[4][4];
+	viewMatrix(m);
+
+	unsigned int k;
+	for (k=0; k<objects.length(); k++) {
+		MeshObject &O=objects.at(k);
+		O.inView=boxInView(m,O.minn,O.maxx);
+	}
+}
+
+
+/*Time a frame spends decoding 3DS objects, the rest waits for the next ones*/
+static const int LOAD_3DS_FRAME_MSEC=40;
+
+/*
+ Decodes the 3DS objects of index3DS that came into view (current GL
+ matrices) and gives them the shrinkGeometry move and their normals.
+ Returns 1 when objects in view are left for the next frame
+*/
+int Geometry::loadObjectsInView()
+{
+	if (!index3DS) return 0;
+
+	float m[4][4];
+	viewMatrix(m);
+
+	/*Decoding merges the object boxes into the model box, which the index already gave*/
+	float mn[3],mx[3];
+	memcpy(mn,minn,sizeof(mn));
+	memcpy(mx,maxx,sizeof(mx));
+
+	QElapsedTimer t;
+	t.start();
+	int pending=0;
+	unsigned int k;
+	for (k=0; k<index3DS->objects.length(); k++) {
+		const Chunck3DSEntry &E=index3DS->objects.at(k);
+		if (E.loaded || !E.faces) continue;
+
+		float bmn[3],bmx[3];
+		memcpy(bmn,E.minn,sizeof(bmn));
+		memcpy(bmx,E.maxx,sizeof(bmx));
+		shrinkPoint(bmn);
+		shrinkPoint(bmx);
+		if (!boxInView(m,bmn,bmx)) continue;
+
+		if (t.elapsed()>=LOAD_3DS_FRAME_MSEC) {
+			pending=1;
+			break;
+		}
+
+		int o=index3DS->loadObject(this,k);
+		if (o==-1) continue;
+		MeshObject &O=objects.at(o);
+		int i;
+		for (i=0; i<O.gridCount; i++) shrinkPoint(grids.at(O.firstGrid+i).coords);
+		shrinkPoint(O.minn);
+		shrinkPoint(O.maxx);
+		calcObjectNormals(o);
+	}
+
+	memcpy(minn,mn,sizeof(mn));
+	memcpy(maxx,mx,sizeof(mx));
+	return pending;
+}
+
+
 void Geometry::loadSTL(char *name)
 {
 	readSTL(this,name);
 		
 	//shrinkGeometry();
 	
-	compressGrids();
+	if (!gridsWelded) compressGrids();
 
-	calcTrianglesNormals();
+	if (!trustFileNormals) calcTrianglesNormals();
 
-	recalcEdge(30*3.14159/180.);
+	recalcEdge(30*pi/180.);
 
 	makeEdgeStrip();
 	makeLineStrip();
@@ -580,10 +1250,12 @@ void Geometry::loadDXF(char *name)
 
 	//shrinkGeometry();
 
-	compressGrids();
+	if (!gridsWelded) compressGrids();
 
 	calcTrianglesNormals();
 
+	prepareBlocks();
+
 	makeEdgeStrip();
 	makeLineStrip();
 	makeTriaStrip();
@@ -594,19 +1266,25 @@ void Geometry::loadDXF(char *name)
 
 
 
+/*
+ Only indexes the file: the index gives the model box and so the move of
+ shrinkGeometry, the objects are decoded by loadObjectsInView once they
+ come into view. Their corners get the smoothing groups of the file if any,
+ otherwise they are smoothed. Objects draw their edge ranges directly and
+ 3DS has no lines, so there are no strips to build
+*/
 void Geometry::load3DS(char *name)
 {
-	readChunck3DS(this,name);
-	
-
-	shrinkGeometry();
-	calcTrianglesNormals();
-
-	calcTrianglesSmoothNormals();
+	delete index3DS;
+	index3DS=new Chunck3DSIndex;
+	if (!index3DS->open(name) || !index3DS->box(minn,maxx)) {
+		delete index3DS;
+		index3DS=NULL;
+		return;
+	}
 
-	makeEdgeStrip();
-	makeLineStrip();
-	makeTriaStrip();
+	shrinkTransform();
+	hasSmoothNormals=1;
 }
 
 
@@ -618,6 +1296,8 @@ void Geometry::loadIGES(char *name)
 
 	calcTrianglesNormals();
 
+	prepareBlocks();
+
 	makeEdgeStrip();
 	makeLineStrip();
 	makeTriaStrip();
@@ -971,11 +1651,164 @@ void Geometry::makeTriaStrip()
 }
 
 
+static void drawTriangleRange(Geometry *geom,unsigned int first,unsigned int last)
+{
+	unsigned int k,k1;
+	float *norm,*norm1;
+	float cosf;
+
+	int colored=geom->triangleColors.length()==geom->triangles.length();
+	/*Corner normals from smoothing groups are used as they are*/
+	int grouped=geom->smoothGroups.length()==geom->triangles.length();
+
+	for (k=first; k<last; k++) {
+		const Triangle &T=geom->triangles.at(k);
+		if (colored) {
+			unsigned short c=geom->triangleColors.at(k);
+			if (c&0x8000) glColor3f(((c>>10)&31)/31.,((c>>5)&31)/31.,(c&31)/31.);
+			else glColor3f(.7,.6,.4);
+		}
+		norm1=(float *)T.normal.data;
+		if (!geom->hasSmoothNormals) {
+			glNormal3fv(norm1);
+			for (k1=0; k1<3; k1++) {
+				glVertex3fv(geom->grids.at(T.node[k1]).coords);
+			}
+		} else {
+			for (k1=0; k1<3; k1++) {
+				norm=(float *)T.cnormal[k1].data;
+				cosf=norm[0]*norm1[0]+norm[1]*norm1[1]+norm[2]*norm1[2];
+				if (grouped) {
+					glNormal3fv(norm);
+				} else if (1 || (cosf>-.94 && cosf<.94)) {
+					glNormal3fv(norm1);
+				} else {
+					glNormal3fv(norm);
+				}
+				glVertex3fv(geom->grids.at(T.node[k1]).coords);
+			}
+		}
+	}
+}
+
+
+/*Triangles of the whole model, or of the visible objects in view*/
+void Geometry::drawTriangles()
+{
+	if (hasSmoothNormals) {
+		glShadeModel(GL_SMOOTH);
+	}
+	if (materialRanges.length()) {
+		/*One color and one glBegin per material, over all the objects*/
+		unsigned int k;
+		int current=-2;
+		for (k=0; k<materialRanges.length(); k++) {
+			const MaterialRange &R=materialRanges.at(k);
+			const MeshObject &O=objects.at(R.object);
+			if (!O.visible || !O.inView) continue;
+			if (R.material!=current) {
+				if (current!=-2) glEnd();
+				current=R.material;
+				if (current==-1) glColor3f(.7,.6,.4);
+				else glColor3fv(materials.at(current).color);
+				glBegin(GL_TRIANGLES);
+			}
+			drawTriangleRange(this,R.firstTriangle,R.firstTriangle+R.triangleCount);
+		}
+		if (current!=-2) glEnd();
+
+		glShadeModel(GL_FLAT);
+		return;
+	}
+
+	glColor3f(.7,.6,.4);
+	glBegin(GL_TRIANGLES);
+
+	if (!objects.length()) {
+		drawTriangleRange(this,0,triangles.length());
+	} else {
+		unsigned int k;
+		for (k=0; k<objects.length(); k++) {
+			const MeshObject &O=objects.at(k);
+			if (!O.visible || !O.inView) continue;
+			drawTriangleRange(this,O.firstTriangle,O.firstTriangle+O.triangleCount);
+		}
+	}
+
+	glEnd();
+
+	glShadeModel(GL_FLAT);
+}
+
+
+static void drawBlockInstances(Geometry *top,Geometry *geom,int lines,int depth)
+{
+	if (depth>=MAX_BLOCK_DEPTH) return;
+
+	unsigned int k,k1;
+	for (k=0; k<geom->instances.length(); k++) {
+		const BlockInstance &I=geom->instances.at(k);
+		Geometry *B=top->blocks.at(I.block);
+
+		glPushMatrix();
+		glMultMatrixf(&I.mat[0][0]);
+		if (lines) {
+			B->drawEdgeStrip();
+			B->drawLineStrip();
+			B->drawCircles();
+			B->drawArcs();
+			B->drawSplines();
+			B->drawBSplines();
+			glBegin(GL_POINTS);
+			for (k1=0; k1<B->points.length(); k1++) {
+				glVertex3fv(B->grids.at(B->points.at(k1)).coords);
+			}
+			glEnd();
+		} else {
+			B->drawTriangles();
+			B->drawRevolveLines();
+			B->drawBSplineSurfs();
+		}
+		drawBlockInstances(top,B,lines,depth+1);
+		glPopMatrix();
+	}
+}
+
+
+/*
+ Draws the placed blocks, the surfaces or (lines set) the wireframe part.
+ Each block is drawn once per placement from its shared geometry.
+*/
+void Geometry::drawInstances(int lines)
+{
+	if (!instances.length()) return;
+
+	glMatrixMode(GL_MODELVIEW);
+	if (!lines) glEnable(GL_NORMALIZE);
+	drawBlockInstances(this,this,lines,0);
+	if (!lines) glDisable(GL_NORMALIZE);
+}
+
+
 void Geometry::drawEdgeStrip()
 {
 
 	glColor4fv(edgeStripColor);
 
+	if (objects.length() && edges.length()) {
+		/*Edges of the visible objects in view, straight from the edge list*/
+		unsigned int k;
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(3,GL_FLOAT,sizeof(Grid),&grids.at(0).coords);
+		for (k=0; k<objects.length(); k++) {
+			const MeshObject &O=objects.at(k);
+			if (!O.visible || !O.inView || !O.edgeCount) continue;
+			glDrawElements(GL_LINES,2*O.edgeCount,GL_UNSIGNED_INT,edges.at(O.firstEdge).node);
+		}
+		glDisableClientState(GL_VERTEX_ARRAY);
+		return;
+	}
+
 	if (!edgeStrip) {
 		int k;
 		glBegin(GL_LINES);
@@ -1060,7 +1893,17 @@ void Geometry::drawLineStrip()
 #endif
 	}
 
-
+	/*Polylines are one draw range each, however long*/
+	if (polylines.length()) {
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(3,GL_FLOAT,sizeof(Grid),&grids.at(0).coords);
+		unsigned int k;
+		for (k=0; k<polylines.length(); k++) {
+			const Polyline &P=polylines.at(k);
+			glDrawElements(GL_LINE_STRIP,P.count,GL_UNSIGNED_INT,&polylineGrids.at(P.first));
+		}
+		glDisableClientState(GL_VERTEX_ARRAY);
+	}
 }
 
 
@@ -1075,7 +1918,7 @@ void Geometry::drawCircles()
 	float X[3];
 	float fmin,fmax;
 	float df;
-	fmin=0; fmax=2*3.14159;
+	fmin=0; fmax=2*pi;
 	df=fmax/50.;
 	for (i=0; i<circles.length(); i++) {
 		const Circle & C=circles.at(i);
@@ -1101,7 +1944,7 @@ void Geometry::drawArcs()
 	float X0[3];
 	float X[3];
 	float df;
-	df=(2*3.14159)/50.;
+	df=(2*pi)/50.;
 	for (i=0; i<arcs.length(); i++) {
 		const ArcCircle & C=arcs.at(i);
 		glBegin(GL_LINE_STRIP);
@@ -1147,6 +1990,47 @@ void Geometry::drawSplines()
 	}
 }
 
+/*
+ Number of B-spline curves (or surfaces) tessellated so far, from the first
+ one on. The background tessellation is started if some are left
+*/
+int Geometry::tessellated(int surfaces)
+{
+	int n=surfaces ? bsplinesurfs.length() : bsplines.length();
+	if (!n) return 0;
+	if (!tessellation) tessellation=new TessellationWorker(this);
+
+	TessellationWorker *W=tessellation;
+	int done=surfaces ? W->surfs.fetchAndAddOrdered(0) : W->curves.fetchAndAddOrdered(0);
+	if (done<n) {
+		if (surfaces) W->wantSurfs.fetchAndStoreOrdered(1);
+		else W->wantCurves.fetchAndStoreOrdered(1);
+		if (!W->isRunning()) W->start(QThread::LowPriority);
+	}
+	return done;
+}
+
+/*Set while asked for curves or surfaces are not all tessellated yet, the view polls it*/
+int Geometry::tessellationPending()
+{
+	if (!tessellation) return 0;
+	TessellationWorker *W=tessellation;
+	if (W->wantCurves.fetchAndAddOrdered(0) && W->curves.fetchAndAddOrdered(0)<(int)bsplines.length()) return 1;
+	if (W->wantSurfs.fetchAndAddOrdered(0) && W->surfs.fetchAndAddOrdered(0)<(int)bsplinesurfs.length()) return 1;
+	return 0;
+}
+
+/*Tessellates all curves and surfaces, for callers that need every coordinate*/
+void Geometry::waitTessellation()
+{
+	for (;;) {
+		tessellated(0);
+		tessellated(1);
+		if (!tessellationPending()) return;
+		tessellation->wait();
+	}
+}
+
 void Geometry::drawBSplines()
 {
 	glColor4fv(lineStripColor);
@@ -1154,7 +2038,8 @@ void Geometry::drawBSplines()
 	float t;
 	float dt=0.05;
 	float X[3];
-	for (i=0; i<bsplines.length(); i++) {
+	int n=tessellated(0);
+	for (i=0; i<n; i++) {
 		const BSpline & BS=bsplines.at(i);
 		glEnableClientState(GL_VERTEX_ARRAY);
 		glVertexPointer(3,GL_FLOAT,0,BS.coords);
@@ -1178,9 +2063,10 @@ void Geometry::drawBSplineSurfs()
 {
 	glShadeModel(GL_SMOOTH);
 	int i;
+	int n=tessellated(1);
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
-	for (i=0; i<bsplinesurfs.length(); i++) {
+	for (i=0; i<n; i++) {
 		const BSplineSurf &BSS=bsplinesurfs.at(i);
 		glVertexPointer(3,GL_FLOAT,0,BSS.coords);
 		glNormalPointer(GL_FLOAT,0,BSS.normals);
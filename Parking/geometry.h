@@ -54,6 +54,57 @@ public:
 };
 
 
+/*Placement of a shared block (DXF INSERT), mat in OpenGL column order*/
+class BlockInstance {
+public:
+	int block;
+	float mat[4][4];
+};
+
+
+/*
+ Named part of a model (3DS object): its ranges of grids, triangles and
+ edges with the bounding box. inView is updated by cullObjects every frame
+*/
+class MeshObject {
+public:
+	char name[64];
+	int firstGrid,gridCount;
+	int firstTriangle,triangleCount;
+	int firstEdge,edgeCount;
+	float minn[3],maxx[3];
+	int visible;
+	int inView;
+};
+
+
+/*Surface material (3DS), drawn with its diffuse color*/
+class Material {
+public:
+	char name[64];
+	float color[3];
+};
+
+
+/*
+ Triangles of one object sharing one material, material -1 for triangles
+ without one. The ranges are sorted by material so each material is set once
+*/
+class MaterialRange {
+public:
+	int material;
+	int object;
+	int firstTriangle,triangleCount;
+};
+
+
+/*Range of Geometry::polylineGrids drawn as one line strip*/
+class Polyline {
+public:
+	int first,count;
+};
+
+
 class RevolveLine {
 public:	
 	int line_axis_pos;
@@ -63,6 +114,9 @@ public:
 };
 
 
+class TessellationWorker;
+class Chunck3DSIndex;
+
 class Geometry 
 {
 public:
@@ -80,18 +134,74 @@ public:
 
 	myVector<RevolveLine> revolvelines;
 
+	/*Ordered polylines as the readers wrote them, drawn without makeLineStrip*/
+	myVector<int> polylineGrids;
+	myVector<Polyline> polylines;
+
+	/*Per triangle 15-bit colors (VisCAM/SolidView STL attribute word:
+	 bit 15 valid, red 10-14, green 5-9, blue 0-4), empty if the model has none*/
+	myVector<unsigned short> triangleColors;
+
+	/*Per triangle smoothing group mask (3DS), 0 for a faceted triangle,
+	 empty if the model has none*/
+	myVector<unsigned int> smoothGroups;
+
+	/*Materials, per triangle material (-1 for none) and the triangles of
+	 each object sorted into material ranges. Empty if the model has none*/
+	myVector<Material> materials;
+	myVector<int> triangleMaterials;
+	myVector<MaterialRange> materialRanges;
+
+	/*Shared geometry of the blocks, owned by the top geometry. The instances
+	 of a block geometry (nested blocks) also refer to the top geometry's list*/
+	myVector<Geometry *> blocks;
+	myVector<BlockInstance> instances;
+
+	/*Parts of the model, empty if the file has none (only 3DS)*/
+	myVector<MeshObject> objects;
+
 	int pickedGrid;
 
 	float minn[3],maxx[3];
 
 	int hasSmoothNormals;
 
+	/*Threads used by the parallel loaders, 0 for all cores*/
+	int loadThreads;
+
+	/*Readers merge equal vertices while loading instead of compressGrids*/
+	int weldOnLoad;
+	/*Set by a reader when grids holds no duplicates, compressGrids is skipped*/
+	int gridsWelded;
+
+	/*compressGrids merges grids closer than this part of the model's diagonal*/
+	float weldTolerance;
+
+	/*Keep normals stored in the file (checked per triangle) instead of recalculating*/
+	int trustFileNormals;
+
+	/*Freeform curves and surfaces (IGES) are tessellated to stay within
+	 tessellationChord of the true shape (model units, 0 for a thousandth of
+	 the model size) and to turn by at most tessellationAngle degrees*/
+	float tessellationChord;
+	float tessellationAngle;
+
+	/*Tessellates them on a background thread, started by the first draw*/
+	TessellationWorker *tessellation;
+
+	/*3DS file shown by load3DS, its objects are decoded as they come into view*/
+	Chunck3DSIndex *index3DS;
+
+	/*Move and scale of shrinkGeometry, kept for the objects decoded later*/
+	float shrinkCenter[3],shrinkScale;
+
 	Geometry();
 	~Geometry();
 
 	int addGrid(float x,float y,float z);
 	int addPoint(int n);
 	int addLine(int n1,int n2); 
+	int addPolyline(int firstGrid,int count);
 	int addEdge(int n1,int n2);
 	int addTriangle(int n1,int n2,int n3,float normal[3]);
 	int addCircle(const CoordinateSystem<float> XYZ,float radius);
@@ -99,15 +209,37 @@ public:
 	int addSpline(float Px[4],float Py[4],float Pz[4]);
 	int addBSpline(const BSpline &BS);
 	int addBSplineSurf(const BSplineSurf &BSS);
+	int addBlock();
+	int addInstance(int block,const float mat[4][4]);
+
+	void mergeBoundingBox(int firstGrid,const float mn[3],const float mx[3]);
+	void appendGeometry(Geometry &other);
 	
 	void shrinkGeometry();
+	void shrinkTransform();
+	void shrinkPoint(float p[3]) const;
 	void compressGrids();
+	void compressGridsSorted();
 	void calcTrianglesNormals();
+	void calcTrianglesNormals(unsigned int first,unsigned int last);
 	void calcTrianglesSmoothNormals();
+	void calcTrianglesGroupNormals();
+	unsigned int calcGroupNormals(unsigned int first,unsigned int last,int firstGrid,int gridCount);
+	void calcObjectNormals(unsigned int object);
 
 	void recalcEdge(float angle);
 
 
+	void prepareBlocks();
+	int objectOfGrid(int grid);
+	void cullObjects();
+	int loadObjectsInView();
+	int instanceCorners(unsigned int k,float corners[8][3]);
+
+	int tessellated(int surfaces);
+	int tessellationPending();
+	void waitTessellation();
+
 	void loadSTL(char *name);
 	void loadDXF(char *name);
 	void load3DS(char *name);
@@ -127,6 +259,9 @@ public:
 	void makeLineStrip();
 	void makeTriaStrip();
 
+	void drawTriangles();
+	void drawInstances(int lines);
+
 	void drawEdgeStrip();
 	void drawLineStrip();
 
@@ -5,97 +5,15 @@
 #include <math.h>
 #include "geometry.h"
 #include "coord_system.h"
+#include "mapped_file.h"
+#include "numparse.h"
+#include "parallel.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <qdebug.h>
 #include <QSet>
-
-static float myatof(const char *d)
-{
-	char buffer[1024];
-	strncpy(buffer,d,1023);
-	buffer[1023]=0;
-	for (int i=0; i<1023; i++) {
-		if (buffer[i]=='D' || buffer[i]=='d') buffer[i]='E';
-		if (buffer[i]==0) break;
-	}
-	return atof(buffer);
-}
-
-static void stripTrailingSpaces(char *d)
-{
-	if (!d) return;
-	int n=strlen(d);
-	for (;n>0; n--) {
-		if (d[n-1]!=' ') {
-			d[n]=0;
-			break;
-		}
-	}
-}
-
-class IGES_line {
-	public:
-	char data[73];
-	char letterCode;
-	int sequenceNumber;
-
-	char ParameterDelimiterChar;
-	char RecordDelimiterChar;
-
-	IGES_line() { 
-		ParameterDelimiterChar=',';
-		RecordDelimiterChar=';';
-	}
-
-	int readLine(FILE *fp) {
-		if (feof(fp)) return 0;
-		char temp[100];
-		fgets(temp,100,fp);
-		memcpy(data,temp,72*sizeof(char));
-		data[72]=0;
-
-		letterCode=temp[72];
-		sequenceNumber=atoi(&temp[73]);
-		return 1;
-	}
-
-	int readDelimString(const char *data,char *target) {
-		int k=0;
-		const char *pdata=data;
-		while (pdata[0]!=ParameterDelimiterChar && pdata[0]!=RecordDelimiterChar) {
-			target[k]=pdata[0];
-			k++;
-			pdata++;
-			if (pdata[0]==0) break;
-		}
-		target[k]=0;
-		if (data[k]!=0) k++;	
-		return k;
-	}
-
-};
-
-static int readHollerithString(const char *data,char *target)
-{
-	int ret=0;
-	int total=0;
-	while (data[0]!='H') {
-            if (data[0]=='\0') {target[0]=0; return ret;}
-            if (data[0]<'0' || data[0]>'9') {target[0]=0; return ret;}
-		total=total*10+ data[0]-'0';
-		data++; ret++;
-	}
-	data++; ret++;
-	int k;
-	for (k=0; k<total; k++) {
-		target[k]=data[0];
-		data++; ret++;
-	}
-	target[total]=0;
-	return ret;
-}
-
+#include <QElapsedTimer>
 
 class IGES_directory {
 public:
@@ -138,289 +56,407 @@ void IGES_directory::fill(const char Directory[18][9])
 }
 
 
-void readIGES(Geometry *geom,const char *name)
-{
+/*One record (line) of the mapped file: columns 1-72, the section letter dropped*/
+class IGESRecord {
+public:
+	const char *data;
+	int length;
+};
 
-	FILE *fp=fopen(name,"rb");
-	if (!fp) return;
-
-	IGES_line igs;
-
-	int ok=igs.readLine(fp);
-
-	while (ok) {
-		if (igs.letterCode!='S') break;
-		ok=igs.readLine(fp);
-	}
-
-	int globalParamCount=0;
-	char GlobalParam[26][100];
-
-
-	QString globalData=QString::fromUtf8("");
-	while (ok) {
-		if (igs.letterCode!='G') break;
-		stripTrailingSpaces(igs.data);
-		globalData.append(QString::fromUtf8(igs.data));
-		ok=igs.readLine(fp);
-	}
-	if (globalData.count()!=0) {
-		char *cpnt,*pnt;
-		cpnt=strdup(globalData.toUtf8().data());
-		pnt=cpnt;
-		if (globalParamCount==0) {
-			if (pnt[0]==',' && pnt[1]==',') {
-				globalParamCount+=2;
-				pnt+=2;
-			} else if (pnt[0]=='1' && pnt[1]=='H' && pnt[2]==pnt[3] && pnt[3] !=pnt[4] && pnt[4]=='1' && pnt[5]=='H') {
-				igs.ParameterDelimiterChar=pnt[2];
-				igs.RecordDelimiterChar=pnt[6];
-				pnt=&pnt[8];
-				globalParamCount+=2;
-			} else if (pnt[0]=='1' && pnt[1]=='H' && pnt[2]==pnt[3] && pnt[3]==pnt[4]) {
-				igs.ParameterDelimiterChar=pnt[2];
-				pnt=&pnt[5];
-				globalParamCount+=2;
-			} else if (pnt[0]==',' && pnt[1]=='1' && pnt[2]=='H' && pnt[4]==',') {
-				igs.RecordDelimiterChar=pnt[3];
-				pnt=&pnt[5];
-				globalParamCount+=2;
-			}
-		}
-		while (pnt[0]!=0) {
-			switch (globalParamCount) {
-				case 2: case 3: case 4: case 5:
-				case 11:
-				case 14:
-				case 17:
-				case 20: case 21:
-				case 24: case 25:
-					pnt+=readHollerithString(pnt,GlobalParam[globalParamCount]);
-					if (pnt[0]!=0) {
-						pnt++;
-					}
-					break;
-				default:
-					pnt+=igs.readDelimString(pnt,GlobalParam[globalParamCount]);
-					break;
 
+/*
+ Splits the mapped file into records and sorts them by section letter
+ (column 73). Lines may end in LF or CR LF, files without line ends are read
+ as 80 column records. Start and terminate sections are not kept
+*/
+static void indexIGESRecords(const MappedFile &file,myVector<IGESRecord> &global,myVector<IGESRecord> &directory,myVector<IGESRecord> &parameter)
+{
+	const char *p=file.begin();
+	const char *end=file.end();
+	while (p<end) {
+		const char *nl=(const char *)memchr(p,'\n',end-p);
+		const char *lineEnd=nl ? nl : end;
+		const char *next=nl ? nl+1 : end;
+		if (lineEnd-p>82) {
+			lineEnd=p+80;
+			next=lineEnd;
+		}
+		if (lineEnd>p && lineEnd[-1]=='\r') lineEnd--;
+
+		if (lineEnd-p>=73) {
+			IGESRecord R;
+			R.data=p;
+			R.length=72;
+			switch (p[72]) {
+				case 'G': global.append(R); break;
+				case 'D': directory.append(R); break;
+				case 'P': parameter.append(R); break;
+				default: break;
 			}
-			qDebug("Parameter %d is '%s'",globalParamCount,GlobalParam[globalParamCount]);
-			globalParamCount++;
 		}
+		p=next;
+	}
+}
 
-		free(cpnt);
+
+/*
+ Parameters read in place from a run of records, where only the first
+ columns (64 in the parameter section, 72 in the global section) hold data.
+ Parameters are separated by the parameter delimiter, the record delimiter
+ ends the run; reading past it gives empty (default) parameters. Hollerith
+ strings (nHxxx) are counted out, so they may hold delimiters and span
+ records
+*/
+class IGESParams {
+	const IGESRecord *record,*lastRecord;
+	const char *p,*end;
+	int columns;
+	char delim,recordDelim;
+	int ended;
+	int separator;
+
+	void setRecord(const IGESRecord *r) {
+		record=r;
+		p=r->data;
+		end=p+(r->length<columns ? r->length : columns);
 	}
 
-	myVector<IGES_directory> dirlist;
-	while (ok) {
-		if (igs.letterCode!='D') break;
-		char Directory[18][9];
-		char *pnt=igs.data;
-		int k;
-		for (k=0; k<9; k++) {
-			memcpy(Directory[k],pnt,8);
-			Directory[k][8]=0;
-			pnt+=8;
+	/*Skips blanks, also over record ends; 0 when no data is left*/
+	int advance() {
+		for (;;) {
+			p=skipBlanks(p,end);
+			if (p<end) return 1;
+			if (record==lastRecord) return 0;
+			setRecord(record+1);
 		}
+	}
 
-		ok=igs.readLine(fp);
-		if (!ok) break;
-		if (igs.letterCode!='D') break;
+	/*Length of the Hollerith string starting at p, -1 when none starts there*/
+	int hollerithLength() const {
+		int n;
+		const char *q=parseInt(p,end,&n);
+		if (q==p || *p=='-' || *p=='+' || q==end || *q!='H') return -1;
+		return n;
+	}
 
-		pnt=igs.data;
+	/*Steps over n string characters after the H, copying at most size-1 of them*/
+	int readHollerith(int n,char *target,int size) {
+		int k=0;
+		p=(const char *)memchr(p,'H',end-p)+1;
+		while (n>0) {
+			if (p==end) {
+				if (record==lastRecord) break;
+				setRecord(record+1);
+			}
+			int m=end-p;
+			if (m>n) m=n;
+			if (target) {
+				int c=m;
+				if (c>size-1-k) c=size-1-k;
+				memcpy(target+k,p,c);
+				k+=c;
+			}
+			p+=m;
+			n-=m;
+		}
+		if (target) target[k]=0;
+		return k;
+	}
 
-		for (k=9; k<18; k++) {
-			memcpy(Directory[k],pnt,8);
-			Directory[k][8]=0;
-			pnt+=8;
+	/*Starts the next parameter: consumes the separator left by the previous one*/
+	int begin() {
+		if (separator) {
+			separator=0;
+			if (advance()) {
+				if (*p==recordDelim) ended=1;
+				if (*p==delim || *p==recordDelim) p++;
+			}
 		}
-		IGES_directory IGESD;
-		IGESD.fill(Directory);
+		if (ended || !advance()) {
+			ended=1;
+			return 0;
+		}
+		separator=1;
+		return 1;
+	}
 
-		dirlist.append(IGESD);
+public:
+	IGESParams(const IGESRecord *first,int count,int columnCount,char delimChar,char recordDelimChar) {
+		columns=columnCount;
+		lastRecord=first+count-1;
+		setRecord(first);
+		delim=delimChar;
+		recordDelim=recordDelimChar;
+		ended=(count<=0);
+		separator=0;
+	}
 
+	void setDelimiters(char delimChar,char recordDelimChar) {
+		delim=delimChar;
+		recordDelim=recordDelimChar;
+	}
 
+	/*Next parameter as [b,e) without blanks around it, 0 past the end*/
+	int token(const char **b,const char **e) {
+		if (!begin()) {
+			(*b)=(*e)=p;
+			return 0;
+		}
+		(*b)=p;
+		int n=hollerithLength();
+		if (n>=0) {
+			readHollerith(n,NULL,0);
+			(*e)=p;
+			return 1;
+		}
+		while (p<end && *p!=delim && *p!=recordDelim) p++;
+		const char *q=p;
+		while (q>(*b) && isBlankChar(q[-1])) q--;
+		(*e)=q;
+		return 1;
+	}
 
+	/*
+	 Next parameter as a zero terminated string of at most size-1 characters:
+	 the text of a Hollerith string, other parameters as written. Returns its
+	 length, -1 past the end
+	*/
+	int string(char *target,int size) {
+		if (!begin()) {
+			target[0]=0;
+			return -1;
+		}
+		int n=hollerithLength();
+		if (n>=0) return readHollerith(n,target,size);
+		const char *b=p;
+		while (p<end && *p!=delim && *p!=recordDelim) p++;
+		const char *q=p;
+		while (q>b && isBlankChar(q[-1])) q--;
+		n=q-b;
+		if (n>size-1) n=size-1;
+		memcpy(target,b,n);
+		target[n]=0;
+		return n;
+	}
 
-		ok=igs.readLine(fp);
+	float real() {
+		const char *b,*e;
+		double v;
+		token(&b,&e);
+		parseDouble(b,e,&v,1);
+		return (float)v;
+	}
 
+	int integer() {
+		const char *b,*e;
+		int v;
+		token(&b,&e);
+		parseInt(b,e,&v);
+		return v;
 	}
 
+	void skip() {
+		const char *b,*e;
+		token(&b,&e);
+	}
+};
 
-	int igesCount=0;
-	QString ParameterLine;
-	QString nextParameterLine;
 
-	nextParameterLine=QString::fromLocal8Bit("");
+/*Smallest number of parameter records worth a thread*/
+static const int IGES_MIN_RECORDS_PER_THREAD=20000;
 
-	QSet<int> usedParamSet;
+/*
+ Items an entity turned into, by directory entry ((DE-1)/2), -1 for none.
+ They index the part geometry until the parts are merged
+*/
+class IGESEntityItems {
+public:
+	int firstGrid,gridCount;
+	int firstLine;
+	int polyline;
+	int instance;
+	int arc;
+	int bspline;
+	int bsplineSurf;
+};
 
-	QMap<int,CoordinateSystem<float> > crdMap;
-	QMap<int,int> depcrdMap;
-	QMap<int,int> arcCoordMap;
-	QMap<int,int> gridCoordMap;
-	QMap<int,int> bsplineCoordMap;
-	QMap<int,int> bsplineSurfCoordMap;
+enum {
+	IGES_NO_TRANSFORM,
+	IGES_TRANSFORM_LOCAL,
+	IGES_TRANSFORM_COMPOSING,
+	IGES_TRANSFORM_GLOBAL
+};
 
-	QMap<int,int> lineMap;
+/*Coordinate system of a 124 entity, by directory entry: as read, then composed with its parents*/
+class IGESTransform {
+public:
+	CoordinateSystem<float> crd;
+	int state;
+};
 
 
-	
-	
+/*
+ Entities [first,last) of the directory decoded into their own geometry.
+ The entity tables are shared, each part writes its own entries only.
+ Entities of subfigure definitions are left to their block: owner is the
+ block of each entity (-1 for the model), subfigureBlock the block of each
+ definition (308). A part decodes the entities of its block only
+*/
+class IGESPart {
+public:
+	myVector<IGES_directory> *dirlist;
+	myVector<IGESRecord> *parameterRecords;
+	IGESEntityItems *items;
+	IGESTransform *transforms;
+	int *owner;
+	int *subfigureBlock;
+	int block;
+	char delim,recordDelim;
+	int first,last;
+
+	Geometry geom;
 
+	QSet<int> usedParamSet;
+};
 
-	while (ok) {
-		if (igs.letterCode!='P') break;
 
-		int DE=2*igesCount+1;
-		int paramId;
-		ParameterLine=nextParameterLine;
-		nextParameterLine=QString::fromLocal8Bit("");
-		while (ok) {
-			if (igs.letterCode!='P') break;
+static void decodeIGESEntity(IGESPart &part,Geometry *geom,int igesCount)
+{
+	if (part.owner[igesCount]!=part.block) return;
 
-			char paramIdstr[9]={0};
-			memcpy(paramIdstr,&igs.data[64],8);
-			paramIdstr[8]=0;
-			paramId=atoi(paramIdstr);
+	myVector<IGES_directory> &dirlist=*part.dirlist;
+	myVector<IGESRecord> &parameterRecords=*part.parameterRecords;
 
-			igs.data[64]=0;
-			stripTrailingSpaces(igs.data);
+	QSet<int> &usedParamSet=part.usedParamSet;
 
-			if (paramId>DE) {
-				nextParameterLine.append(QString::fromLocal8Bit(igs.data));
-				break;
-			}
-			ParameterLine.append(QString::fromLocal8Bit(igs.data));
-			ok=igs.readLine(fp);
-		}
-		//qDebug("Parameter Line : '%s'",ParameterLine.toLocal8Bit().data());
+	IGES_directory *igesd;
+	igesd=&dirlist.at(igesCount);
 
-		IGES_directory *igesd;
-		igesd=&dirlist.at(igesCount);
+	/*Parameter records of the entity, straight from the directory entry*/
+	int firstRecord=igesd->parameterData-1;
+	int recordCount=igesd->paramLineCount;
+	if (firstRecord<0 || recordCount<=0 || firstRecord>=(int)parameterRecords.length()) return;
+	if (firstRecord+recordCount>(int)parameterRecords.length()) recordCount=parameterRecords.length()-firstRecord;
 
-		char param[100];
-		char *cpnt,*pnt;
+	IGESParams par(&parameterRecords.at(firstRecord),recordCount,64,part.delim,part.recordDelim);
 
-		cpnt=strdup(ParameterLine.toLocal8Bit().data());
-		pnt=cpnt;
+	/*Entity type*/
+	par.skip();
 
-		pnt+=igs.readDelimString(pnt,param);
+	if (!usedParamSet.contains(igesd->entityType)) {
+		qDebug("Entity: %d",igesd->entityType);
+	}
 
-		if (!usedParamSet.contains(igesd->entityType)) {
-			qDebug("Entity: %d",igesd->entityType);
-		}
-		switch (igesd->entityType) {
-			case 0: /*Null*/
-				break;
-			case 100: /*Circular arc*/
-				{
-					float x1,y1,x2,y2,x3,y3;
-					float z;
-					pnt+=igs.readDelimString(pnt,param);
-					z=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					x1=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					y1=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					x2=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					y2=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					x3=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					y3=myatof(param);
-					CoordinateSystem<float> C;
-					float xC[3];
-					xC[0]=x1; xC[1]=y1; xC[2]=z;
-					C.setCenter(xC);
-					float fmin=atan2(y2-y1,x2-x1);
-					float fmax=atan2(y3-y1,x3-x1);
-					if (fmax<fmin) fmax+=2*3.14159;
-					float rad=sqrt((x2-x1)*(x2-x1)+(y2-y1)*(y2-y1));
-					int arcid=geom->addArc(C,rad,fmin,fmax);
-					if (igesd->transMatrix!=0) {
-						arcCoordMap.insert(arcid,igesd->transMatrix);
-					}
+	/*Entities add at most one arc or spline, grids and lines in a row*/
+	IGESEntityItems &I=part.items[igesCount];
+	I.firstGrid=geom->grids.length();
+	I.firstLine=geom->lines.length();
+	unsigned int polylines=geom->polylines.length();
+	unsigned int instances=geom->instances.length();
+	unsigned int arcs=geom->arcs.length();
+	unsigned int bsplines=geom->bsplines.length();
+	unsigned int bsplinesurfs=geom->bsplinesurfs.length();
+
+	switch (igesd->entityType) {
+		case 0: /*Null*/
+			break;
+		case 100: /*Circular arc*/
+			{
+				float x1,y1,x2,y2,x3,y3;
+				float z;
+				z=par.real();
+				x1=par.real();
+				y1=par.real();
+				x2=par.real();
+				y2=par.real();
+				x3=par.real();
+				y3=par.real();
+				CoordinateSystem<float> C;
+				float xC[3];
+				xC[0]=x1; xC[1]=y1; xC[2]=z;
+				C.setCenter(xC);
+				float fmin=atan2(y2-y1,x2-x1);
+				float fmax=atan2(y3-y1,x3-x1);
+				if (fmax<fmin) fmax+=2*pi;
+				float rad=sqrt((x2-x1)*(x2-x1)+(y2-y1)*(y2-y1));
+				geom->addArc(C,rad,fmin,fmax);
 
-				}
-				break;
-			case 104: /*Conic section*/
+			}
+			break;
+		case 104: /*Conic section*/
 #if 0
-				{
-					float A,B,C,D,E,F;
-					float Z;
-					float x1,y1,x2,y2;
-
-					if (igesd->formNumber==1) {
-						/*Ellipse*/
-					} else if (igesd->formNumber==2) {
-						/*Hyperbola*/
-					} else if (igesd->formNumber==3) {
-						/*Parabola*/
-						B^2=4AC
-
-							Cy^2+(Bx+E)y+Ax^2+Dx+F=0
-							disc=(Bx+E)^2-4C(Ax^2+Dx+F)
+			{
+				float A,B,C,D,E,F;
+				float Z;
+				float x1,y1,x2,y2;
+
+				if (igesd->formNumber==1) {
+					/*Ellipse*/
+				} else if (igesd->formNumber==2) {
+					/*Hyperbola*/
+				} else if (igesd->formNumber==3) {
+					/*Parabola*/
+					B^2=4AC
+
+						Cy^2+(Bx+E)y+Ax^2+Dx+F=0
+						disc=(Bx+E)^2-4C(Ax^2+Dx+F)
 
-					}
-					t=x0, y0=t^2
-						x=cx0+sy0+a
-						y=-sx0+cy0+b
+				}
+				t=x0, y0=t^2
+					x=cx0+sy0+a
+					y=-sx0+cy0+b
 
 
 
-						Ax^2+Bxy+Cy^2+Dx+Ey+F=0
+					Ax^2+Bxy+Cy^2+Dx+Ey+F=0
 
-						A(c^2x0^2+s^2y0^2+a^2+2csx0y0+2say0+2acx0)
-						+B(-scx0^2+(s^2+c^2)x0y0+(as+bc)x0+csy0^2+(ac+bs)y0+ab)
-						+C(s^2x0^2+c^2y0^2+b^2-2scx0y0+2bcy0-2bsx0)
-						+D(cx0+sy0+a)
-						+E(-sx0+cy0+b)
-						+F
+					A(c^2x0^2+s^2y0^2+a^2+2csx0y0+2say0+2acx0)
+					+B(-scx0^2+(s^2+c^2)x0y0+(as+bc)x0+csy0^2+(ac+bs)y0+ab)
+					+C(s^2x0^2+c^2y0^2+b^2-2scx0y0+2bcy0-2bsx0)
+					+D(cx0+sy0+a)
+					+E(-sx0+cy0+b)
+					+F
 
-						(Ac^2-Bsc+Cs^2)x0^2
-						+(As^2+Bsc+Cc^2)y0^2
-						+(2Asc+B(s^2+c^2)-2Csc)x0y0
-						+(2Aac+B(as+bc)-2Cbs+Dc-Es)x0
-						+(2As+B(ac+bs)+2Cbc+Ds+Ec)y0
-						+(Aa^2+Bab+Cb^2+Da+Eb+F)
+					(Ac^2-Bsc+Cs^2)x0^2
+					+(As^2+Bsc+Cc^2)y0^2
+					+(2Asc+B(s^2+c^2)-2Csc)x0y0
+					+(2Aac+B(as+bc)-2Cbs+Dc-Es)x0
+					+(2As+B(ac+bs)+2Cbc+Ds+Ec)y0
+					+(Aa^2+Bab+Cb^2+Da+Eb+F)
 
-						1: s^2+c^2=1
+					1: s^2+c^2=1
 
-						sc=B/(2(C-A))
+					sc=B/(2(C-A))
 
 
-						yparxei eutheia y=ax+b <->x=y/a-b/a
+					yparxei eutheia y=ax+b <->x=y/a-b/a
 
-						A(y/a-b/a)^2+B(y/a-b/a)(ax+b)+C(ax+b)^2+D(y/a-b/a)+E(ax+b)+F= Ax^2+Bxy+Cy^2+Dx+Ey+F
-						A(y^2/a^2+b^2/a^2-2yb/a^2)+B(xy+by/a-bx-b^2/a)+C(a^2x^2+b^2+2abx)+D(y/a-b/a)+E(ax+b)+F
+					A(y/a-b/a)^2+B(y/a-b/a)(ax+b)+C(ax+b)^2+D(y/a-b/a)+E(ax+b)+F= Ax^2+Bxy+Cy^2+Dx+Ey+F
+					A(y^2/a^2+b^2/a^2-2yb/a^2)+B(xy+by/a-bx-b^2/a)+C(a^2x^2+b^2+2abx)+D(y/a-b/a)+E(ax+b)+F
 
-						(Ca^2)x^2+(B)xy+(A/a^2)y^2+(-Bb+2Cab+Ea)x+(Bb/a-2Ab/a^2+D/a)y+Ab^2/a^2-Bb^2/a+Cb^2-Db/a+Eb+F
+					(Ca^2)x^2+(B)xy+(A/a^2)y^2+(-Bb+2Cab+Ea)x+(Bb/a-2Ab/a^2+D/a)y+Ab^2/a^2-Bb^2/a+Cb^2-Db/a+Eb+F
 
-						a^2=A/C
-						2Ab+EA/C=Da+Bab
+					a^2=A/C
+					2Ab+EA/C=Da+Bab
 
-						-Bb+2Cab+Ea=D 
-						Bb/a-2Ab/a^2+D/a=E
-						Ab^2/a^2-Bb^2/a+Cb^2-Db/a+Eb+F=F
-						A(-b/a)^2+B(-b/a)b+Cb^2+D(-b/a)+Eb+F=F
+					-Bb+2Cab+Ea=D 
+					Bb/a-2Ab/a^2+D/a=E
+					Ab^2/a^2-Bb^2/a+Cb^2-Db/a+Eb+F=F
+					A(-b/a)^2+B(-b/a)b+Cb^2+D(-b/a)+Eb+F=F
 
-						Ca^2=A -> a^2=A/C
-						A/a^2=C -> Ca^2=A
-						-Bb+2Cab+Ea=D -> b=(D-Ea)/(2Ca-B)
-						Bb/a-2Ab/a^2+D/a=E -> b=(D-Ea)/(2A/a-B)
-						A(-b/a)^2+B(-b/a)b+Cb^2+D(-b/a)+Eb=0 -> (-b^2)C+B(-b/a)b+Cb^2+D(-b/a)+Eb=0
-						1: a=sqrt(A/C)
-						
+					Ca^2=A -> a^2=A/C
+					A/a^2=C -> Ca^2=A
+					-Bb+2Cab+Ea=D -> b=(D-Ea)/(2Ca-B)
+					Bb/a-2Ab/a^2+D/a=E -> b=(D-Ea)/(2A/a-B)
+					A(-b/a)^2+B(-b/a)b+Cb^2+D(-b/a)+Eb=0 -> (-b^2)C+B(-b/a)b+Cb^2+D(-b/a)+Eb=0
+					1: a=sqrt(A/C)
+					
 
-						
+					
 
-						1: a=sqrt(A/C)
+					1: a=sqrt(A/C)
 
-						
+					
 
 
 
@@ -429,436 +465,826 @@ void readIGES(Geometry *geom,const char *name)
 
 
 
-				}
+			}
 #endif
-				break;
-			case 106: /*Linear Path*/
-				{
-					pnt+=igs.readDelimString(pnt,param);
-					int IP=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					int N=atoi(param);
-					if (IP==1) {
-						pnt+=igs.readDelimString(pnt,param);
-						float Z=myatof(param);
-						float X,Y;
-						int j;
-						for (j=0; j<N; j++) {
-							pnt+=igs.readDelimString(pnt,param);
-							X=myatof(param);
-							pnt+=igs.readDelimString(pnt,param);
-							Y=myatof(param);
-
-							int gid=geom->addGrid(X,Y,Z);
-							if (igesd->transMatrix!=0) {
-								gridCoordMap.insert(gid,igesd->transMatrix);
-							}
-							if (j>0) {
-								geom->addLine(gid-1,gid);
-							}
-						}
-					} else if (IP==2) {
-						float X,Y,Z;
-						int j;
-						for (j=0; j<N; j++) {
-							pnt+=igs.readDelimString(pnt,param);
-							X=myatof(param);
-							pnt+=igs.readDelimString(pnt,param);
-							Y=myatof(param);
-							pnt+=igs.readDelimString(pnt,param);
-							Z=myatof(param);
-
-							int gid=geom->addGrid(X,Y,Z);
-							if (igesd->transMatrix!=0) {
-								gridCoordMap.insert(gid,igesd->transMatrix);
-							}
-							if (j>0) {
-								geom->addLine(gid-1,gid);
-							}
-						}
+			break;
+		case 106: /*Copious data: points, a path, with vectors at the points for IP=3*/
+			{
+				int IP=par.integer();
+				int N=par.integer();
+				if (N<=0 || IP<1 || IP>3) break;
+				int first=geom->grids.length();
+				float Z=0;
+				if (IP==1) Z=par.real();
+				int j;
+				for (j=0; j<N; j++) {
+					float X=par.real();
+					float Y=par.real();
+					if (IP!=1) Z=par.real();
+					if (IP==3) {
+						par.skip();
+						par.skip();
+						par.skip();
 					}
+					geom->addGrid(X,Y,Z);
 				}
-				break;
-
-			case 110: /*Line Entity*/
-				{
-					float x,y,z;
-					int g1,g2;
-					pnt+=igs.readDelimString(pnt,param);
-					x=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					y=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					z=myatof(param);
-					g1=geom->addGrid(x,y,z);
-					if (igesd->transMatrix!=0) {
-						gridCoordMap.insert(g1,igesd->transMatrix);
-					}
-					pnt+=igs.readDelimString(pnt,param);
-					x=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					y=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					z=myatof(param);
-					g2=geom->addGrid(x,y,z);
-					if (igesd->transMatrix!=0) {
-						gridCoordMap.insert(g2,igesd->transMatrix);
-					}
-					int lid=geom->addLine(g1,g2);
-					lineMap.insert(DE,lid);
+				if (N>1) geom->addPolyline(first,N);
+			}
+			break;
+
+		case 102: /*Composite curve, joined once all entities are read*/
+		case 308: /*Subfigure definition, its entities are read into its block*/
+			break;
+
+		case 408: /*Singular subfigure instance: scaled and moved definition*/
+			{
+				int DE=par.integer();
+				int e=(DE-1)/2;
+				if (DE<1 || !(DE&1) || e>=(int)dirlist.length() || part.subfigureBlock[e]==-1) break;
+				float mat[4][4];
+				memset(mat,0,sizeof(mat));
+				mat[3][0]=par.real();
+				mat[3][1]=par.real();
+				mat[3][2]=par.real();
+				/*The scale is optional (defaulted, 1)*/
+				const char *b,*end;
+				par.token(&b,&end);
+				float S=1;
+				if (b<end) {
+					double v=1;
+					parseDouble(b,end,&v,1);
+					S=v;
 				}
-				break;
-			case 112: /*Spline*/
-				{
-					int N;
-					float Px[4],Py[4],Pz[4];
-					float *T;
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					N=atoi(param);
-
-					int j;
-
-					T=new float[N+1];
-					for (j=0; j<=N; j++) {
-						pnt+=igs.readDelimString(pnt,param);
-						T[j]=myatof(param);
-					}
-					for (j=0; j<N; j++) {
-						pnt+=igs.readDelimString(pnt,param); Px[0]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Px[1]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Px[2]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Px[3]=myatof(param);
-
-						pnt+=igs.readDelimString(pnt,param); Py[0]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Py[1]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Py[2]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Py[3]=myatof(param);
-
-						pnt+=igs.readDelimString(pnt,param); Pz[0]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Pz[1]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Pz[2]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param); Pz[3]=myatof(param);
-
-						float s,s2,s3;
-						s=T[j+1]-T[j];
-						s2=s*s;
-						s3=s*s*s;
-						Px[1]/=s; Px[2]/=s2; Px[3]/=s3;
-						Py[1]/=s; Py[2]/=s2; Py[3]/=s3;
-						Pz[1]/=s; Pz[2]/=s2; Pz[3]/=s3;
-					}
-					delete []T;
+				mat[0][0]=mat[1][1]=mat[2][2]=S;
+				mat[3][3]=1;
+				geom->addInstance(part.subfigureBlock[e],mat);
+			}
+			break;
 
+		case 110: /*Line Entity*/
+			{
+				float x,y,z;
+				int g1,g2;
+				x=par.real();
+				y=par.real();
+				z=par.real();
+				g1=geom->addGrid(x,y,z);
+				x=par.real();
+				y=par.real();
+				z=par.real();
+				g2=geom->addGrid(x,y,z);
+				geom->addLine(g1,g2);
+			}
+			break;
+		case 112: /*Spline*/
+			{
+				int N;
+				float Px[4],Py[4],Pz[4];
+				float *T;
+				par.skip();
+				par.skip();
+				par.skip();
+				N=par.integer();
+
+				int j;
+
+				T=new float[N+1];
+				for (j=0; j<=N; j++) {
+					T[j]=par.real();
+				}
+				for (j=0; j<N; j++) {
+					Px[0]=par.real();
+					Px[1]=par.real();
+					Px[2]=par.real();
+					Px[3]=par.real();
+
+					Py[0]=par.real();
+					Py[1]=par.real();
+					Py[2]=par.real();
+					Py[3]=par.real();
+
+					Pz[0]=par.real();
+					Pz[1]=par.real();
+					Pz[2]=par.real();
+					Pz[3]=par.real();
+
+					float s,s2,s3;
+					s=T[j+1]-T[j];
+					s2=s*s;
+					s3=s*s*s;
+					Px[1]/=s; Px[2]/=s2; Px[3]/=s3;
+					Py[1]/=s; Py[2]/=s2; Py[3]/=s3;
+					Pz[1]/=s; Pz[2]/=s2; Pz[3]/=s3;
 				}
-				break;
-			case 120:
-				/*Surface of Revolution*/
-				{
-					int axis_id;
-					int gen_id;
-					float f1;
-					float f2;
+				delete []T;
 
-					pnt+=igs.readDelimString(pnt,param); axis_id=atoi(param);
-					pnt+=igs.readDelimString(pnt,param); gen_id=atoi(param);
-					pnt+=igs.readDelimString(pnt,param); f1=myatof(param);
-                                        pnt+=igs.readDelimString(pnt,param); f2=myatof(param);
+			}
+			break;
+		case 120:
+			/*Surface of Revolution*/
+			{
+				int axis_id;
+				int gen_id;
+				float f1;
+				float f2;
 
+				axis_id=par.integer();
+				gen_id=par.integer();
+				f1=par.real();
+                                        f2=par.real();
 
 
-					IGES_directory *gend;
-                                        gend=&dirlist.at((gen_id-1)/2);
-					if (gend->entityType==110) {
-						RevolveLine RL;
-						RL.line_axis_pos=axis_id;
-						RL.line_gen_pos=gen_id;
-						RL.fmin=f1;
-						RL.fmax=f2;
-
-						geom->revolvelines.append(RL);
-					} else {
-						qDebug("Revolving of %d not supported yet",gend->entityType);
-					}
-					
 
+				IGES_directory *gend;
+                                        gend=&dirlist.at((gen_id-1)/2);
+				if (gend->entityType==110) {
+					RevolveLine RL;
+					RL.line_axis_pos=axis_id;
+					RL.line_gen_pos=gen_id;
+					RL.fmin=f1;
+					RL.fmax=f2;
+
+					geom->revolvelines.append(RL);
+				} else {
+					qDebug("Revolving of %d not supported yet",gend->entityType);
 				}
-				break;
-			case 124:
-				/*Coordinate system*/
-				{
-					CoordinateSystem<float> Crd;
-					float x[3],y[3],z[3],c[3];
-					pnt+=igs.readDelimString(pnt,param); x[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); y[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); z[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); c[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); x[1]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); y[1]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); z[1]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); c[1]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); x[2]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); y[2]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); z[2]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param); c[2]=myatof(param);
-					Crd.setAxis(x,y,z);
-					Crd.setCenter(c);
-					crdMap.insert(DE,Crd);
-					if (igesd->transMatrix!=0) {
-						depcrdMap.insert(DE,igesd->transMatrix);
-					}
+				
 
+			}
+			break;
+		case 124:
+			/*Coordinate system*/
+			{
+				CoordinateSystem<float> Crd;
+				float x[3],y[3],z[3],c[3];
+				x[0]=par.real();
+				y[0]=par.real();
+				z[0]=par.real();
+				c[0]=par.real();
+				x[1]=par.real();
+				y[1]=par.real();
+				z[1]=par.real();
+				c[1]=par.real();
+				x[2]=par.real();
+				y[2]=par.real();
+				z[2]=par.real();
+				c[2]=par.real();
+				Crd.setAxis(x,y,z);
+				Crd.setCenter(c);
+				part.transforms[igesCount].crd=Crd;
+				part.transforms[igesCount].state=IGES_TRANSFORM_LOCAL;
+
+			}
+			break;
+		case 126:
+			{ 
+				/*B-Spline curves*/
+				BSpline BS;
+
+				BS.K=par.integer();
+				BS.M=par.integer();
+				par.skip();
+				par.skip();
+				par.skip();
+				par.skip();
+				BS.T=(float*)calloc(BS.K+BS.M+2,sizeof(float));
+				BS.W=(float*)calloc(BS.K+1,sizeof(float));
+				BS.P=(float(*)[3])calloc(BS.K+1,sizeof(float[3]));
+
+				int j;
+				for (j=0; j<BS.K+BS.M+2; j++) {
+					BS.T[j]=par.real();
 				}
-				break;
-			case 126:
-				{ 
-					/*B-Spline curves*/
-					BSpline BS;
-
-					pnt+=igs.readDelimString(pnt,param);
-					BS.K=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BS.M=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					BS.T=(float*)calloc(BS.K+BS.M+2,sizeof(float));
-					BS.W=(float*)calloc(BS.K+1,sizeof(float));
-					BS.P=(float(*)[3])calloc(BS.K+1,sizeof(float[3]));
-
-					int j;
-					for (j=0; j<BS.K+BS.M+2; j++) {
-						pnt+=igs.readDelimString(pnt,param);
-						BS.T[j]=myatof(param);
-					}
-					for (j=0; j<BS.K+1; j++) {
-						pnt+=igs.readDelimString(pnt,param);
-						BS.W[j]=myatof(param);
-					}
-					for (j=0; j<BS.K+1; j++) {
-						pnt+=igs.readDelimString(pnt,param);
-						BS.P[j][0]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param);
-						BS.P[j][1]=myatof(param);
-						pnt+=igs.readDelimString(pnt,param);
-						BS.P[j][2]=myatof(param);
-					}
-					pnt+=igs.readDelimString(pnt,param);
-					BS.V[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BS.V[1]=myatof(param);
-
-					int bsid=geom->addBSpline(BS);
-					if (igesd->transMatrix!=0) {
-						bsplineCoordMap.insert(bsid,igesd->transMatrix);
-					}
+				for (j=0; j<BS.K+1; j++) {
+					BS.W[j]=par.real();
+				}
+				for (j=0; j<BS.K+1; j++) {
+					BS.P[j][0]=par.real();
+					BS.P[j][1]=par.real();
+					BS.P[j][2]=par.real();
+				}
+				BS.V[0]=par.real();
+				BS.V[1]=par.real();
+
+				geom->addBSpline(BS);
 
+			}
+			break;
+
+		case 128:
+			{
+				/*B-Spline surfaces*/
+				BSplineSurf BSS;
+
+				BSS.K1=par.integer();
+				BSS.K2=par.integer();
+				BSS.M1=par.integer();
+				BSS.M2=par.integer();
+
+				par.skip();
+				par.skip();
+				par.skip();
+				par.skip();
+				par.skip();
+
+				BSS.S=(float*)calloc(BSS.K1+BSS.M1+2,sizeof(float));
+				BSS.T=(float*)calloc(BSS.K2+BSS.M2+2,sizeof(float));
+				BSS.W=(float*)calloc((BSS.K1+1)*(BSS.K2+1),sizeof(float));
+				BSS.P=(float(*)[3])calloc((BSS.K1+1)*(BSS.K2+1),sizeof(float[3]));
+
+				int i,j,ij;
+				for (j=0; j<BSS.K1+BSS.M1+2; j++) {
+					BSS.S[j]=par.real();
 				}
-				break;
-
-			case 128:
-				{
-					/*B-Spline surfaces*/
-					BSplineSurf BSS;
-
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.K1=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.K2=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.M1=atoi(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.M2=atoi(param);
-
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-					pnt+=igs.readDelimString(pnt,param);
-
-					BSS.S=(float*)calloc(BSS.K1+BSS.M1+2,sizeof(float));
-					BSS.T=(float*)calloc(BSS.K2+BSS.M2+2,sizeof(float));
-					BSS.W=(float*)calloc((BSS.K1+1)*(BSS.K2+1),sizeof(float));
-					BSS.P=(float(*)[3])calloc((BSS.K1+1)*(BSS.K2+1),sizeof(float[3]));
-
-					int i,j,ij;
-					for (j=0; j<BSS.K1+BSS.M1+2; j++) {
-						pnt+=igs.readDelimString(pnt,param); BSS.S[j]=myatof(param);
-					}
-					for (j=0; j<BSS.K2+BSS.M2+2; j++) {
-						pnt+=igs.readDelimString(pnt,param); BSS.T[j]=myatof(param);
-					}
-					for (j=0; j<BSS.K2+1; j++) {
-						for (i=0; i<BSS.K1+1; i++) {
-							ij=i+j*(BSS.K1+1);
-							pnt+=igs.readDelimString(pnt,param); BSS.W[ij]=myatof(param);
-						}
-					}
-					for (j=0; j<BSS.K2+1; j++) {
-						for (i=0; i<BSS.K1+1; i++) {
-							ij=i+j*(BSS.K1+1);
-							pnt+=igs.readDelimString(pnt,param); 
-							BSS.P[ij][0]=myatof(param);
-							pnt+=igs.readDelimString(pnt,param);
-							BSS.P[ij][1]=myatof(param);
-							pnt+=igs.readDelimString(pnt,param);
-							BSS.P[ij][2]=myatof(param);
-						}
+				for (j=0; j<BSS.K2+BSS.M2+2; j++) {
+					BSS.T[j]=par.real();
+				}
+				for (j=0; j<BSS.K2+1; j++) {
+					for (i=0; i<BSS.K1+1; i++) {
+						ij=i+j*(BSS.K1+1);
+						BSS.W[ij]=par.real();
 					}
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.U[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.U[1]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.V[0]=myatof(param);
-					pnt+=igs.readDelimString(pnt,param);
-					BSS.V[1]=myatof(param);
-
-					int bssid=geom->addBSplineSurf(BSS);
-					if (igesd->transMatrix!=0) {
-						bsplineSurfCoordMap.insert(bssid,igesd->transMatrix);
+				}
+				for (j=0; j<BSS.K2+1; j++) {
+					for (i=0; i<BSS.K1+1; i++) {
+						ij=i+j*(BSS.K1+1);
+						BSS.P[ij][0]=par.real();
+						BSS.P[ij][1]=par.real();
+						BSS.P[ij][2]=par.real();
 					}
 				}
-				break;
+				BSS.U[0]=par.real();
+				BSS.U[1]=par.real();
+				BSS.V[0]=par.real();
+				BSS.V[1]=par.real();
 
-			default:
-				if (!usedParamSet.contains(igesd->entityType)) {
-					qDebug("Parameter %d not implemented yet",igesd->entityType);
-				}
-				break;
-		}
+				geom->addBSplineSurf(BSS);
+			}
+			break;
 
-		usedParamSet.insert(igesd->entityType);
+		default:
+			if (!usedParamSet.contains(igesd->entityType)) {
+				qDebug("Parameter %d not implemented yet",igesd->entityType);
+			}
+			break;
+	}
 
-		igesCount++;
+	usedParamSet.insert(igesd->entityType);
 
+	I.gridCount=geom->grids.length()-I.firstGrid;
+	if (I.firstLine==(int)geom->lines.length()) I.firstLine=-1;
+	if (polylines<geom->polylines.length()) I.polyline=polylines;
+	if (instances<geom->instances.length()) I.instance=instances;
+	if (arcs<geom->arcs.length()) I.arc=arcs;
+	if (bsplines<geom->bsplines.length()) I.bspline=bsplines;
+	if (bsplinesurfs<geom->bsplinesurfs.length()) I.bsplineSurf=bsplinesurfs;
+}
 
-		free(cpnt);
 
-		ok=igs.readLine(fp);
+static void decodeIGESParts(void *ctx,int first,int last,int thread)
+{
+	IGESPart *parts=(IGESPart *)ctx;
+	int k,e;
+	for (k=first; k<last; k++) {
+		IGESPart &part=parts[k];
+		for (e=part.first; e<part.last; e++) decodeIGESEntity(part,&part.geom,e);
 	}
+}
 
-        /*Coord fixing*/
-	
-	QMap<int,int>::iterator it;
-	for (it=depcrdMap.begin(); it!=depcrdMap.end(); ++it) {
-		int c1_id,c2_id;
-		c1_id=it.key();
-		c2_id=it.value();
-		if (c1_id!=0) {
-			if (crdMap.find(c1_id)!=crdMap.end()) {
-				CoordinateSystem<float> c1=crdMap.find(c1_id).value();
 
-				QSet<int> sett;
-				sett.insert(c1_id);
-				sett.insert(c2_id);
-				for (;;) {
-					if (crdMap.find(c2_id)==crdMap.end()) break;
-					CoordinateSystem<float> c2=crdMap.find(c2_id).value();
+/*
+ Coordinate system of the 124 entity DE composed with all its parents, NULL
+ if DE is not a transform. Each one is composed once: the chain is walked up
+ to a composed (or parentless) transform and composed back down. A cycle
+ stops the chain
+*/
+static const CoordinateSystem<float> *composedTransform(IGESTransform *transforms,myVector<IGES_directory> &dirlist,int DE)
+{
+	int e=(DE-1)/2;
+	if (DE<1 || !(DE&1) || e>=(int)dirlist.length()) return NULL;
+	if (transforms[e].state==IGES_NO_TRANSFORM) return NULL;
+	if (transforms[e].state!=IGES_TRANSFORM_LOCAL) return &transforms[e].crd;
+
+	myVector<int> chain;
+	int k=e;
+	while (k!=-1 && transforms[k].state==IGES_TRANSFORM_LOCAL) {
+		transforms[k].state=IGES_TRANSFORM_COMPOSING;
+		chain.append(k);
+		int parent=dirlist.at(k).transMatrix;
+		k=(parent-1)/2;
+		if (parent<1 || !(parent&1) || k>=(int)dirlist.length() || transforms[k].state==IGES_NO_TRANSFORM) k=-1;
+	}
 
-					c2.fromLocalToGlobal(&c1);
+	const CoordinateSystem<float> *parent=NULL;
+	if (k!=-1 && transforms[k].state==IGES_TRANSFORM_GLOBAL) parent=&transforms[k].crd;
+	int j;
+	for (j=chain.length()-1; j>=0; j--) {
+		IGESTransform &T=transforms[chain.at(j)];
+		if (parent) parent->fromLocalToGlobal(&T.crd);
+		T.state=IGES_TRANSFORM_GLOBAL;
+		parent=&T.crd;
+	}
+	return &transforms[e].crd;
+}
 
-					if (depcrdMap.find(c2_id)==depcrdMap.end()) break;
-					c2_id=depcrdMap.find(c2_id).value();
 
-					if (sett.contains(c2_id)) break;
-					sett.insert(c2_id);
-				}
-			}
+/*Maximum nesting of composite curves, deeper (or cyclic) ones are cut*/
+static const int IGES_MAX_COMPOSITE_DEPTH=16;
+
+/*Parameter records of entity e, returns 0 if it has none*/
+static int entityRecords(myVector<IGES_directory> &dirlist,myVector<IGESRecord> &parameterRecords,int e,int *first,int *count)
+{
+	const IGES_directory &D=dirlist.at(e);
+	(*first)=D.parameterData-1;
+	(*count)=D.paramLineCount;
+	if ((*first)<0 || (*count)<=0 || (*first)>=(int)parameterRecords.length()) return 0;
+	if ((*first)+(*count)>(int)parameterRecords.length()) (*count)=parameterRecords.length()-(*first);
+	return 1;
+}
+
+/*Next parameter as an entity index, -1 for a bad DE pointer*/
+static int entityPointer(IGESParams &par,int entities)
+{
+	int DE=par.integer();
+	int e=(DE-1)/2;
+	if (DE<1 || !(DE&1) || e>=entities) return -1;
+	return e;
+}
+
+/*
+ Puts entity e and, for a composite curve, its members into block. An
+ entity already owned stays where it is
+*/
+static void ownIGESEntity(myVector<IGES_directory> &dirlist,myVector<IGESRecord> &parameterRecords,char delim,char recordDelim,
+	int *owner,int e,int block,int depth)
+{
+	if (owner[e]!=-1 || depth>=IGES_MAX_COMPOSITE_DEPTH) return;
+	owner[e]=block;
+	if (dirlist.at(e).entityType!=102) return;
+
+	int first,count;
+	if (!entityRecords(dirlist,parameterRecords,e,&first,&count)) return;
+	IGESParams par(&parameterRecords.at(first),count,64,delim,recordDelim);
+	par.skip();
+	int N=par.integer();
+	int j;
+	for (j=0; j<N; j++) {
+		int m=entityPointer(par,dirlist.length());
+		if (m!=-1) ownIGESEntity(dirlist,parameterRecords,delim,recordDelim,owner,m,block,depth+1);
+	}
+}
+
+/*
+ Subfigure definitions (308) to blocks of geom, their entities to owners.
+ Returns the number of definitions
+*/
+static int findIGESSubfigures(Geometry *geom,myVector<IGES_directory> &dirlist,myVector<IGESRecord> &parameterRecords,
+	char delim,char recordDelim,int *owner,int *subfigureBlock)
+{
+	int n=dirlist.length();
+	int e,j,definitions=0;
+	for (e=0; e<n; e++) {
+		owner[e]=-1;
+		subfigureBlock[e]=-1;
+	}
+	for (e=0; e<n; e++) {
+		int first,count;
+		if (dirlist.at(e).entityType!=308) continue;
+		if (!entityRecords(dirlist,parameterRecords,e,&first,&count)) continue;
+		subfigureBlock[e]=geom->addBlock();
+		definitions++;
+
+		/*Type, depth of nesting, name, entities*/
+		IGESParams par(&parameterRecords.at(first),count,64,delim,recordDelim);
+		par.skip();
+		par.skip();
+		par.skip();
+		int N=par.integer();
+		for (j=0; j<N; j++) {
+			int m=entityPointer(par,n);
+			if (m!=-1 && m!=e) ownIGESEntity(dirlist,parameterRecords,delim,recordDelim,owner,m,subfigureBlock[e],0);
 		}
 	}
-	
-	for (it=arcCoordMap.begin(); it!=arcCoordMap.end(); ++it) {
-		int c1_id,c2_id;
-		c1_id=it.key();
-		c2_id=it.value();
+	return definitions;
+}
 
-		ArcCircle *T=&geom->arcs.at( it.key() );
+/*Composite curves and their members (entity indices, -1 for a bad pointer)*/
+class IGESComposites {
+public:
+	int *firstMember,*memberCount;
+	myVector<int> members;
+	char *joined;
+};
 
-		if (crdMap.find(c2_id)!=crdMap.end()) {
-			CoordinateSystem<float> c=crdMap.find(c2_id).value();
+/*Appends the grids of a piece to the run, skipping a start equal to the run's end*/
+static void appendPieceGrids(Geometry *geom,myVector<int> &run,const int *nodes,int count)
+{
+	if (count<=0) return;
+	if (run.length()) {
+		const float *a=geom->grids.at(run.at(run.length()-1)).coords;
+		const float *b=geom->grids.at(nodes[0]).coords;
+		if (a[0]==b[0] && a[1]==b[1] && a[2]==b[2]) {
+			nodes++;
+			count--;
+		}
+	}
+	int k;
+	for (k=0; k<count; k++) run.append(nodes[k]);
+}
 
-			c.fromLocalToGlobal(&T->XYZ);
+static void endCompositeRun(myVector<int> &run,myVector<int> &grids,myVector<Polyline> &runs)
+{
+	if (run.length()>1) {
+		Polyline P;
+		P.first=grids.length();
+		P.count=run.length();
+		unsigned int k;
+		for (k=0; k<run.length(); k++) grids.append(run.at(k));
+		runs.append(P);
+	}
+	run.clear();
+}
+
+/*
+ Lines and polylines of composite e in order into run. Arcs and freeform
+ members end the run, they are drawn on their own
+*/
+static void joinComposite(Geometry *geom,myVector<IGES_directory> &dirlist,IGESEntityItems *items,IGESComposites &C,int e,int depth,
+	myVector<int> &run,myVector<int> &grids,myVector<Polyline> &runs)
+{
+	if (depth>=IGES_MAX_COMPOSITE_DEPTH) return;
+	int k;
+	for (k=0; k<C.memberCount[e]; k++) {
+		int m=C.members.at(C.firstMember[e]+k);
+		if (m==-1) continue;
+		const IGESEntityItems &I=items[m];
+		if (dirlist.at(m).entityType==102) {
+			joinComposite(geom,dirlist,items,C,m,depth+1,run,grids,runs);
+		} else if (I.polyline!=-1) {
+			const Polyline &P=geom->polylines.at(I.polyline);
+			appendPieceGrids(geom,run,&geom->polylineGrids.at(P.first),P.count);
+		} else if (I.firstLine!=-1) {
+			appendPieceGrids(geom,run,geom->lines.at(I.firstLine).node,2);
+		} else {
+			endCompositeRun(run,grids,runs);
 		}
 	}
+}
 
-	for (it=gridCoordMap.begin(); it!=gridCoordMap.end(); ++it) {
-		int c1_id,c2_id;
-		c1_id=it.key();
-		c2_id=it.value();
 
+/*
+ Composite curves (102): their line and polyline members are joined in
+ order into polylines that replace them, one draw range per curve
+*/
+static void joinIGESComposites(Geometry *geom,myVector<IGES_directory> &dirlist,myVector<IGESRecord> &parameterRecords,
+	IGESEntityItems *items,int *owner,char delim,char recordDelim)
+{
+	unsigned int k;
+	int e,j;
+	for (k=0; k<dirlist.length(); k++) {
+		if (dirlist.at(k).entityType==102) break;
+	}
+	if (k==dirlist.length()) return;
+
+	int n=dirlist.length();
+	IGESComposites C;
+	C.firstMember=new int[n];
+	C.memberCount=new int[n];
+	C.joined=(char *)calloc(n,1);
+	for (e=0; e<n; e++) {
+		C.firstMember[e]=C.members.length();
+		C.memberCount[e]=0;
+
+		/*Only curves of the model, those of subfigures are left as they are*/
+		int firstRecord,recordCount;
+		if (dirlist.at(e).entityType!=102 || owner[e]!=-1) continue;
+		if (!entityRecords(dirlist,parameterRecords,e,&firstRecord,&recordCount)) continue;
+
+		IGESParams par(&parameterRecords.at(firstRecord),recordCount,64,delim,recordDelim);
+		par.skip();
+		int N=par.integer();
+		for (j=0; j<N; j++) {
+			int m=entityPointer(par,n);
+			if (m==e || (m!=-1 && owner[m]!=-1)) m=-1;
+			C.members.append(m);
+			if (m!=-1) C.joined[m]=1;
+		}
+		C.memberCount[e]=N>0 ? N : 0;
+	}
 
-		Grid *G=&geom->grids.at( c1_id );
+	/*Top level composites into new runs*/
+	myVector<int> run,grids;
+	myVector<Polyline> runs;
+	for (e=0; e<n; e++) {
+		if (dirlist.at(e).entityType!=102 || owner[e]!=-1 || C.joined[e]) continue;
+		joinComposite(geom,dirlist,items,C,e,0,run,grids,runs);
+		endCompositeRun(run,grids,runs);
+	}
 
-		if (crdMap.find(c2_id)!=crdMap.end()) {
-			CoordinateSystem<float> c=crdMap.find(c2_id).value();
+	/*Joined polylines and lines are dropped, the entity items follow the lines*/
+	char *dropPolyline=(char *)calloc(geom->polylines.length()+1,1);
+	int *lineMap=new int[geom->lines.length()+1];
+	for (k=0; k<geom->lines.length(); k++) lineMap[k]=k;
+	for (e=0; e<n; e++) {
+		if (!C.joined[e]) continue;
+		IGESEntityItems &I=items[e];
+		if (I.polyline!=-1) dropPolyline[I.polyline]=1;
+		else if (I.firstLine!=-1) lineMap[I.firstLine]=-1;
+	}
 
-			float tmp[3];
-			c.fromLocalToGlobal(tmp,G->coords);
-			vec_copy(G->coords,tmp);
+	unsigned int w=0,wg=0;
+	for (k=0; k<geom->polylines.length(); k++) {
+		if (dropPolyline[k]) continue;
+		Polyline P=geom->polylines.at(k);
+		for (j=0; j<P.count; j++) geom->polylineGrids.at(wg+j)=geom->polylineGrids.at(P.first+j);
+		P.first=wg;
+		wg+=P.count;
+		geom->polylines.at(w++)=P;
+	}
+	geom->polylines.truncateInto(w);
+	geom->polylineGrids.truncateInto(wg);
+
+	w=0;
+	for (k=0; k<geom->lines.length(); k++) {
+		if (lineMap[k]==-1) continue;
+		lineMap[k]=w;
+		geom->lines.at(w++)=geom->lines.at(k);
+	}
+	geom->lines.truncateInto(w);
+	for (e=0; e<n; e++) {
+		/*Items of subfigures index their block's lines*/
+		if (owner[e]!=-1) continue;
+		IGESEntityItems &I=items[e];
+		I.polyline=-1;
+		if (I.firstLine!=-1) I.firstLine=lineMap[I.firstLine];
+	}
+
+	for (k=0; k<runs.length(); k++) {
+		Polyline P=runs.at(k);
+		int first=geom->polylineGrids.length();
+		for (j=0; j<P.count; j++) geom->polylineGrids.append(grids.at(P.first+j));
+		P.first=first;
+		geom->polylines.append(P);
+	}
+
+	qDebug("Composite curves: %u polylines",runs.length());
+
+	free(dropPolyline);
+	delete []lineMap;
+	free(C.joined);
+	delete []C.firstMember;
+	delete []C.memberCount;
+}
+
+
+/*Revolve lines of g (block, -1 for the model) from DE numbers to lines, those without one are dropped*/
+static void resolveIGESRevolveLines(Geometry *g,int block,myVector<IGES_directory> &dirlist,IGESEntityItems *items,int *owner)
+{
+	unsigned int revolves=0;
+	for (int i=0; i<g->revolvelines.length(); i++) {
+		RevolveLine RL=g->revolvelines.at(i);
+		int axis=(RL.line_axis_pos-1)/2;
+		int gen=(RL.line_gen_pos-1)/2;
+		if (RL.line_axis_pos<1 || axis>=(int)dirlist.length() || owner[axis]!=block) continue;
+		if (RL.line_gen_pos<1 || gen>=(int)dirlist.length() || owner[gen]!=block) continue;
+		RL.line_axis_pos=items[axis].firstLine;
+		RL.line_gen_pos=items[gen].firstLine;
+		if (RL.line_axis_pos==-1 || RL.line_gen_pos==-1) continue;
+		g->revolvelines.at(revolves++)=RL;
+	}
+	g->revolvelines.truncateInto(revolves);
+}
+
+
+void readIGES(Geometry *geom,const char *name)
+{
+
+	MappedFile file;
+	if (!file.open(name)) return;
+
+	QElapsedTimer t;
+	t.start();
+
+	myVector<IGESRecord> globalRecords;
+	myVector<IGESRecord> directoryRecords;
+	myVector<IGESRecord> parameterRecords;
+	indexIGESRecords(file,globalRecords,directoryRecords,parameterRecords);
+
+	/*
+	 Global section: parameters 1 and 2 may change the delimiters, the rest
+	 are only logged
+	*/
+	char delim=',';
+	char recordDelim=';';
+	unsigned int k;
+
+	if (globalRecords.length()) {
+		IGESParams global(&globalRecords.at(0),globalRecords.length(),72,delim,recordDelim);
+		char value[256];
+		int globalParamCount=0;
+		int n;
+		while ((n=global.string(value,sizeof(value)))>=0) {
+			if (globalParamCount==0 && n==1) delim=value[0];
+			if (globalParamCount==1 && n==1) recordDelim=value[0];
+			global.setDelimiters(delim,recordDelim);
+			qDebug("Parameter %d is '%s'",globalParamCount,value);
+			globalParamCount++;
+		}
+	}
+
+	myVector<IGES_directory> dirlist;
+	for (k=0; k+1<directoryRecords.length(); k+=2) {
+		char Directory[18][9];
+		const char *pnt=directoryRecords.at(k).data;
+		int j;
+		for (j=0; j<9; j++) {
+			memcpy(Directory[j],pnt,8);
+			Directory[j][8]=0;
+			pnt+=8;
+		}
+
+		pnt=directoryRecords.at(k+1).data;
+
+		for (j=9; j<18; j++) {
+			memcpy(Directory[j],pnt,8);
+			Directory[j][8]=0;
+			pnt+=8;
 		}
+		IGES_directory IGESD;
+		IGESD.fill(Directory);
+
+		dirlist.append(IGESD);
 	}
 
-	for (it=bsplineCoordMap.begin(); it!=bsplineCoordMap.end(); ++it) {
-		int c1_id,c2_id;
-		c1_id=it.key();
-		c2_id=it.value();
 
-		BSpline *BS=&geom->bsplines.at( c1_id );
+	/*
+	 Entities are decoded in parallel, in parts of about the same number of
+	 parameter records. The parts are merged in directory order, so the
+	 geometry is the same for any thread count; transforms are then applied
+	 in one pass
+	*/
+	int threads=parallelThreadCount(geom->loadThreads);
+	int n=threads;
+	if ((int)parameterRecords.length()/n<IGES_MIN_RECORDS_PER_THREAD) n=parameterRecords.length()/IGES_MIN_RECORDS_PER_THREAD;
+	if (n<1) n=1;
+
+	IGESEntityItems *items=new IGESEntityItems[dirlist.length()];
+	IGESTransform *transforms=new IGESTransform[dirlist.length()];
+	for (k=0; k<dirlist.length(); k++) {
+		IGESEntityItems &I=items[k];
+		I.firstGrid=-1;
+		I.gridCount=0;
+		I.firstLine=-1;
+		I.polyline=-1;
+		I.instance=-1;
+		I.arc=-1;
+		I.bspline=-1;
+		I.bsplineSurf=-1;
+		transforms[k].state=IGES_NO_TRANSFORM;
+	}
 
-		if (crdMap.find(c2_id)!=crdMap.end()) {
-			CoordinateSystem<float> c=crdMap.find(c2_id).value();
+	int *owner=new int[dirlist.length()+1];
+	int *subfigureBlock=new int[dirlist.length()+1];
+	int subfigures=findIGESSubfigures(geom,dirlist,parameterRecords,delim,recordDelim,owner,subfigureBlock);
+
+	IGESPart *parts=new IGESPart[n];
+	int from=0;
+	for (k=0; k<(unsigned int)n; k++) {
+		int to=dirlist.length();
+		if ((int)k<n-1) {
+			int record=(qint64)parameterRecords.length()*(k+1)/n;
+			to=from;
+			while (to<(int)dirlist.length() && dirlist.at(to).parameterData-1<record) to++;
+		}
+		parts[k].dirlist=&dirlist;
+		parts[k].parameterRecords=&parameterRecords;
+		parts[k].items=items;
+		parts[k].transforms=transforms;
+		parts[k].owner=owner;
+		parts[k].subfigureBlock=subfigureBlock;
+		parts[k].block=-1;
+		parts[k].delim=delim;
+		parts[k].recordDelim=recordDelim;
+		parts[k].first=from;
+		parts[k].last=to;
+		from=to;
+	}
 
-			int j;
-			float tmp[3];
-			for (j=0; j<=BS->K; j++) {
-				c.fromLocalToGlobal(tmp,BS->P[j]);
-				vec_copy(BS->P[j],tmp);
-			}
+	parallelFor(n,threads,decodeIGESParts,parts);
+
+	for (k=0; k<(unsigned int)n; k++) {
+		IGESPart &part=parts[k];
+		Geometry &pg=part.geom;
+
+		/*Entity items to the indices of the whole geometry*/
+		int e;
+		for (e=part.first; e<part.last; e++) {
+			IGESEntityItems &I=items[e];
+			if (I.gridCount) I.firstGrid+=geom->grids.length();
+			if (I.firstLine!=-1) I.firstLine+=geom->lines.length();
+			if (I.polyline!=-1) I.polyline+=geom->polylines.length();
+			if (I.instance!=-1) I.instance+=geom->instances.length();
+			if (I.arc!=-1) I.arc+=geom->arcs.length();
+			if (I.bspline!=-1) I.bspline+=geom->bsplines.length();
+			if (I.bsplineSurf!=-1) I.bsplineSurf+=geom->bsplinesurfs.length();
 		}
+
+		/*Revolve lines still hold DE numbers, curves and surfaces are moved
+		 rather than copied: appendGeometry takes the rest*/
+		unsigned int j;
+		for (j=0; j<pg.revolvelines.length(); j++) geom->revolvelines.append(pg.revolvelines.at(j));
+		pg.revolvelines.clear();
+
+		unsigned int m=geom->bsplines.length();
+		geom->bsplines.resize(m+pg.bsplines.length());
+		if (pg.bsplines.length()) memcpy(&geom->bsplines.at(m),&pg.bsplines.at(0),pg.bsplines.length()*sizeof(BSpline));
+		pg.bsplines.clear();
+
+		m=geom->bsplinesurfs.length();
+		geom->bsplinesurfs.resize(m+pg.bsplinesurfs.length());
+		if (pg.bsplinesurfs.length()) memcpy(&geom->bsplinesurfs.at(m),&pg.bsplinesurfs.at(0),pg.bsplinesurfs.length()*sizeof(BSplineSurf));
+		pg.bsplinesurfs.clear();
+
+		geom->appendGeometry(pg);
 	}
 
-	for (it=bsplineSurfCoordMap.begin(); it!=bsplineSurfCoordMap.end(); ++it) {
-		int c1_id,c2_id;
-		c1_id=it.key();
-		c2_id=it.value();
+	/*
+	 Entities of subfigure definitions into their blocks, once however many
+	 instances place them. Their items index the block geometry
+	*/
+	if (subfigures) {
+		IGESPart &sub=parts[0];
+		for (k=0; k<dirlist.length(); k++) {
+			if (owner[k]==-1) continue;
+			sub.block=owner[k];
+			decodeIGESEntity(sub,geom->blocks.at(owner[k]),k);
+		}
+		qDebug("Subfigures: %d definitions, %u instances",subfigures,geom->instances.length());
+	}
+	delete []parts;
+
+	qDebug("Time to read IGES parameters: %lld msec (%u entities, %u parameter records)",t.elapsed(),dirlist.length(),parameterRecords.length());
+
+	/*Items to the composed coordinate system of their entity*/
+	for (k=0; k<dirlist.length(); k++) {
+		const IGESEntityItems &I=items[k];
+		const CoordinateSystem<float> *c=NULL;
+		if (dirlist.at(k).transMatrix!=0) c=composedTransform(transforms,dirlist,dirlist.at(k).transMatrix);
+		if (!c) continue;
+
+		Geometry *target=owner[k]==-1 ? geom : geom->blocks.at(owner[k]);
+		int i,j,ij;
+		float tmp[3];
+
+		/*Instance placement: axes as directions, origin as a point*/
+		if (I.instance!=-1) {
+			BlockInstance &BI=target->instances.at(I.instance);
+			float origin[3],zero[3]={0,0,0};
+			c->fromLocalToGlobal(origin,zero);
+			for (j=0; j<4; j++) {
+				c->fromLocalToGlobal(tmp,BI.mat[j]);
+				if (j<3) vec_diff(tmp,tmp,origin);
+				vec_copy(BI.mat[j],tmp);
+			}
+		}
 
-		BSplineSurf *BSS=&geom->bsplinesurfs.at( c1_id );
+		for (i=0; i<I.gridCount; i++) {
+			Grid *G=&target->grids.at(I.firstGrid+i);
+			c->fromLocalToGlobal(tmp,G->coords);
+			vec_copy(G->coords,tmp);
+		}
 
-		if (crdMap.find(c2_id)!=crdMap.end()) {
-			CoordinateSystem<float> c=crdMap.find(c2_id).value();
+		if (I.arc!=-1) c->fromLocalToGlobal(&target->arcs.at(I.arc).XYZ);
 
-			int i,j,ij;
-			float tmp[3];
+		if (I.bspline!=-1) {
+			BSpline *BS=&target->bsplines.at(I.bspline);
+			for (j=0; j<=BS->K; j++) {
+				c->fromLocalToGlobal(tmp,BS->P[j]);
+				vec_copy(BS->P[j],tmp);
+			}
+		}
+
+		if (I.bsplineSurf!=-1) {
+			BSplineSurf *BSS=&target->bsplinesurfs.at(I.bsplineSurf);
 			for (j=0; j<=BSS->K2; j++) {
 				for (i=0; i<=BSS->K1; i++) {
 					ij=i+j*(BSS->K1+1);
-					c.fromLocalToGlobal(tmp,BSS->P[j]);
-					vec_copy(BSS->P[j],tmp);
+					c->fromLocalToGlobal(tmp,BSS->P[ij]);
+					vec_copy(BSS->P[ij],tmp);
 				}
 			}
 		}
 	}
 
-	for (int i=0; i<geom->bsplines.length(); i++) {
-		BSpline & BS=geom->bsplines.at(i);
-		BS.recalcCoords(0.05);
-	}
+	/*Curves and surfaces are tessellated when first drawn (Geometry::tessellated)*/
 
-	for (int i=0; i<geom->bsplinesurfs.length(); i++) {
-		BSplineSurf &BSS=geom->bsplinesurfs.at(i);
-		BSS.recalcCoords(0.2,0.2);
-	}
-
-	for (int i=0; i<geom->revolvelines.length(); i++) {
-		RevolveLine &RL=geom->revolvelines.at(i);
-		RL.line_axis_pos=lineMap.find(RL.line_axis_pos).value();
-		RL.line_gen_pos=lineMap.find(RL.line_gen_pos).value();
+	joinIGESComposites(geom,dirlist,parameterRecords,items,owner,delim,recordDelim);
 
-	}
+	resolveIGESRevolveLines(geom,-1,dirlist,items,owner);
+	for (k=0; k<geom->blocks.length(); k++) resolveIGESRevolveLines(geom->blocks.at(k),k,dirlist,items,owner);
 
-	fclose(fp);
+	delete []items;
+	delete []transforms;
+	delete []owner;
+	delete []subfigureBlock;
 }
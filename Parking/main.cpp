@@ -1,11 +1,17 @@
 #define WIN32_LEAN_AND_MEAN
 #include <QtGui/QApplication>
 #include "parking.h"
+#include "benchmark.h"
+
+#include <string.h>
 
 
 
 int main(int argc, char *argv[])
 {
+	if (argc>1 && !strcmp(argv[1],"-bench")) {
+		return runBenchmark(argc-2,argv+2);
+	}
 
 	QApplication a(argc, argv);
 	parking w;
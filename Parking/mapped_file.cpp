@@ -0,0 +1,59 @@
+#include "mapped_file.h"
+
+#include <stdlib.h>
+#include <QString>
+
+
+MappedFile::MappedFile()
+{
+	mem=0;
+	data=0;
+	size=0;
+}
+
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+
+/*Returns 0 if the file can not be opened or is empty*/
+int MappedFile::open(const char *name)
+{
+	close();
+
+	file.setFileName(QString::fromLocal8Bit(name));
+	if (!file.open(QIODevice::ReadOnly)) return 0;
+
+	qint64 fileSize=file.size();
+	if (fileSize<=0) {
+		file.close();
+		return 0;
+	}
+
+	data=file.map(0,fileSize);
+	if (!data) {
+		mem=(unsigned char *)malloc(fileSize);
+		if (!mem || file.read((char *)mem,fileSize)!=fileSize) {
+			free(mem);
+			mem=0;
+			file.close();
+			return 0;
+		}
+		data=mem;
+	}
+	size=fileSize;
+	return 1;
+}
+
+
+void MappedFile::close()
+{
+	if (mem) free(mem);
+	else if (data) file.unmap((uchar *)data);
+	if (file.isOpen()) file.close();
+	mem=0;
+	data=0;
+	size=0;
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <QFile>
+
+/*
+ Read only view of a whole file. The file is memory mapped when possible,
+ otherwise (e.g. special files) it is read into memory in one go.
+*/
+class MappedFile {
+	MappedFile(MappedFile &x); //deactivated copy-constructor
+
+	QFile file;
+	unsigned char *mem;
+
+public:
+	const unsigned char *data;
+	qint64 size;
+
+	MappedFile();
+	~MappedFile();
+
+	int open(const char *name);
+	void close();
+
+	const char *begin() const {return (const char *)data;}
+	const char *end() const {return (const char *)data+size;}
+};
+
+#endif /* MAPPED_FILE_H */
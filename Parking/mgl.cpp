@@ -14,7 +14,6 @@
 
 
 float viewF=10;
-const float pi=3.141593;
 
 
 GLWidget::GLWidget(QWidget *parent)
@@ -226,7 +225,7 @@ void GLWidget::fixView()
 	glMatrixMode (GL_MODELVIEW);	
 	glGetFloatv(GL_MODELVIEW_MATRIX,pmat);
 
-	if (geom->grids.length()) {
+	if (geom->grids.length() || geom->instances.length() || geom->bsplines.length() || geom->bsplinesurfs.length()) {
                 unsigned int i,j;
 		float xmin,xmax,ymin,ymax;
 		xmin=FLT_MAX;
@@ -251,11 +250,13 @@ void GLWidget::fixView()
 
 		}
 
+		/*Freeform shapes by their control points, which hold them whether
+		 tessellated yet or not*/
 		for (i=0; i<geom->bsplines.length(); i++) {
 			float *pvec,vec[3];
 			const BSpline &BS=geom->bsplines.at(i);
-			for (j=0; j<BS.total_coords; j++) {
-				pvec=BS.coords[j];
+			for (j=0; j<=BS.K; j++) {
+				pvec=BS.P[j];
 				vec[0]=pvec[0]*pmat[0]+pvec[1]*pmat[4]+pvec[2]*pmat[8]+pmat[12];
 				vec[1]=pvec[0]*pmat[1]+pvec[1]*pmat[5]+pvec[2]*pmat[9]+pmat[13];
 				vec[2]=pvec[0]*pmat[2]+pvec[1]*pmat[6]+pvec[2]*pmat[10]+pmat[14];
@@ -270,8 +271,8 @@ void GLWidget::fixView()
 		for (i=0; i<geom->bsplinesurfs.length(); i++) {
 			float *pvec,vec[3];
 			const BSplineSurf &BSS=geom->bsplinesurfs.at(i);
-			for (j=0; j<BSS.total_coords; j++) {
-				pvec=BSS.coords[j];
+			for (j=0; j<(BSS.K1+1)*(BSS.K2+1); j++) {
+				pvec=BSS.P[j];
 				vec[0]=pvec[0]*pmat[0]+pvec[1]*pmat[4]+pvec[2]*pmat[8]+pmat[12];
 				vec[1]=pvec[0]*pmat[1]+pvec[1]*pmat[5]+pvec[2]*pmat[9]+pmat[13];
 				vec[2]=pvec[0]*pmat[2]+pvec[1]*pmat[6]+pvec[2]*pmat[10]+pmat[14];
@@ -282,6 +283,21 @@ void GLWidget::fixView()
 				ymax = vec[1]>ymax ? vec[1] : ymax;
 			}
 		}
+		for (i=0; i<geom->instances.length(); i++) {
+			float corners[8][3],*pvec,vec[3];
+			if (!geom->instanceCorners(i,corners)) continue;
+			for (j=0; j<8; j++) {
+				pvec=corners[j];
+				vec[0]=pvec[0]*pmat[0]+pvec[1]*pmat[4]+pvec[2]*pmat[8]+pmat[12];
+				vec[1]=pvec[0]*pmat[1]+pvec[1]*pmat[5]+pvec[2]*pmat[9]+pmat[13];
+
+				xmin = vec[0]<xmin ? vec[0] : xmin;
+				xmax = vec[0]>xmax ? vec[0] : xmax;
+				ymin = vec[1]<ymin ? vec[1] : ymin;
+				ymax = vec[1]>ymax ? vec[1] : ymax;
+			}
+		}
+
 		if (xmin>xmax) xmin=xmax=0;
 		if (ymin>ymax) ymin=ymax=0;
 
@@ -362,8 +378,27 @@ void GLWidget::orthoView(GLWidget::Ortho o)
 
 void GLWidget::keyPressEvent(QKeyEvent *event)
 {
+	if (!geom) return;
+
+	unsigned int k;
 	switch (event->key()) {
-		
+		case Qt::Key_H:
+			/*Hide the object of the picked grid*/
+			if (geom->pickedGrid!=-1) {
+				int o=geom->objectOfGrid(geom->pickedGrid);
+				if (o!=-1) {
+					geom->objects.at(o).visible=0;
+					qDebug("Hiding object %s",geom->objects.at(o).name);
+					geom->pickedGrid=-1;
+					updateGL();
+				}
+			}
+			break;
+		case Qt::Key_U:
+			/*Show all objects again*/
+			for (k=0; k<geom->objects.length(); k++) geom->objects.at(k).visible=1;
+			updateGL();
+			break;
 	}
 }
 
@@ -519,7 +554,7 @@ void GLWidget::paintGL()
 {
 	
 
-	float ww=3.14159/180.;
+	float ww=pi/180.;
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	
 	glEnable(GL_LIGHTING);
@@ -592,47 +627,18 @@ void GLWidget::paintGL()
 	glEnd();
 
 	if (geom) {
-                unsigned int k,k1;
+                unsigned int k;
 		
 		glEnable(GL_LIGHTING);
 
-		if (geom->hasSmoothNormals) {
-			glShadeModel(GL_SMOOTH);
-		}
-		glColor3f(.7,.6,.4);
-		glBegin(GL_TRIANGLES);
-		float *norm,*norm1;
-
-		float cosf;
-		
-		
-		for (k=0; k<geom->triangles.length(); k++) {
-			norm1=geom->triangles.at(k).normal.data;
-			if (!geom->hasSmoothNormals) {
-				glNormal3fv(norm1);
-				for (k1=0; k1<3; k1++) {
-					glVertex3fv(geom->grids.at(geom->triangles.at(k).node[k1]).coords);
-				}
-			} else {
-				for (k1=0; k1<3; k1++) {
-					norm=geom->triangles.at(k).cnormal[k1].data;
-					cosf=norm[0]*norm1[0]+norm[1]*norm1[1]+norm[2]*norm1[2];
-					if (1 || (cosf>-.94 && cosf<.94)) {
-						glNormal3fv(norm1);
-					} else {
-						glNormal3fv(norm);
-					}
-					glVertex3fv(geom->grids.at(geom->triangles.at(k).node[k1]).coords);
-				}
-			}
-		}
-		
-		glEnd();
-
-		glShadeModel(GL_FLAT);
+		/*3DS objects are decoded once in view, a few per frame*/
+		int loading=geom->loadObjectsInView();
+		geom->cullObjects();
+		geom->drawTriangles();
 
 		geom->drawRevolveLines();
 		geom->drawBSplineSurfs();
+		geom->drawInstances(0);
 
 		glDisable(GL_LIGHTING);
 
@@ -649,6 +655,7 @@ void GLWidget::paintGL()
 		geom->drawArcs();
 		geom->drawSplines();
 		geom->drawBSplines();
+		geom->drawInstances(1);
 
 
 		glPointSize(4);
@@ -668,6 +675,9 @@ void GLWidget::paintGL()
 
 		glPopMatrix();
 
+		/*Redrawn while curves and surfaces are tessellated in the background*/
+		if (geom->tessellationPending()) QTimer::singleShot(100,this,SLOT(updateGL()));
+		if (loading) QTimer::singleShot(0,this,SLOT(updateGL()));
 	}
 	
 }
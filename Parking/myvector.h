@@ -35,6 +35,18 @@ public:
                 len=0;
         }
 
+        void reserve(unsigned int n) {
+                if (n>mem) {
+                        mem=n;
+                        data=(T*)realloc(data,mem*sizeof(T));
+                }
+        }
+
+        void resize(unsigned int n) {
+                reserve(n);
+                len=n;
+        }
+
         void truncate() {
                 free(data); data=0; len=0; mem=0;
         }
@@ -0,0 +1,119 @@
+#ifndef NUMPARSE_H
+#define NUMPARSE_H
+
+/*
+ Locale independent number parsing straight from a character range [p,end).
+ Nothing is copied or allocated; each function returns the position just
+ after the number, or p itself when no number starts there.
+*/
+
+#include <cmath>
+
+inline int isDigitChar(char c) {return (unsigned char)(c-'0')<10;}
+
+inline int isBlankChar(char c) {return (unsigned char)c<=' ';}
+
+inline const char *skipBlanks(const char *p,const char *end)
+{
+	while (p<end && isBlankChar(*p)) p++;
+	return p;
+}
+
+inline const char *skipWord(const char *p,const char *end)
+{
+	while (p<end && !isBlankChar(*p)) p++;
+	return p;
+}
+
+inline double scaleByPow10(double v,int e)
+{
+	static const double pow10[]={
+		1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+		1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+	};
+	if (e==0) return v;
+	if (e>0 && e<=22) return v*pow10[e];
+	if (e<0 && e>=-22) return v/pow10[-e];
+	return v*pow(10.,e);
+}
+
+inline const char *parseInt(const char *p,const char *end,int *out)
+{
+	const char *start=p;
+	int neg=0;
+	if (p<end && (*p=='-' || *p=='+')) {
+		neg=(*p=='-');
+		p++;
+	}
+	if (p==end || !isDigitChar(*p)) {
+		(*out)=0;
+		return start;
+	}
+	int v=0;
+	while (p<end && isDigitChar(*p)) {
+		v=v*10+(*p-'0');
+		p++;
+	}
+	(*out)=neg ? -v : v;
+	return p;
+}
+
+/*
+ exponentD also takes D or d as the exponent letter, as Fortran written
+ reals (IGES) use it
+*/
+inline const char *parseDouble(const char *p,const char *end,double *out,int exponentD=0)
+{
+	const char *start=p;
+	int neg=0;
+	if (p<end && (*p=='-' || *p=='+')) {
+		neg=(*p=='-');
+		p++;
+	}
+
+	/*Up to 19 significant digits are kept exactly in the mantissa*/
+	unsigned long long mant=0;
+	int digits=0;
+	int exp10=0;
+	int any=0;
+
+	while (p<end && isDigitChar(*p)) {
+		if (digits<19) {
+			mant=mant*10+(*p-'0');
+			if (mant) digits++;
+		} else {
+			exp10++;
+		}
+		p++; any=1;
+	}
+	if (p<end && *p=='.') {
+		p++;
+		while (p<end && isDigitChar(*p)) {
+			if (digits<19) {
+				mant=mant*10+(*p-'0');
+				if (mant) digits++;
+				exp10--;
+			}
+			p++; any=1;
+		}
+	}
+	if (!any) {
+		(*out)=0;
+		return start;
+	}
+
+	if (p<end && (*p=='e' || *p=='E' || (exponentD && (*p=='d' || *p=='D')))) {
+		int e;
+		const char *q=parseInt(p+1,end,&e);
+		if (q!=p+1) {
+			exp10+=e;
+			p=q;
+		}
+	}
+
+	double v=scaleByPow10((double)mant,exp10);
+	(*out)=neg ? -v : v;
+	return p;
+}
+
+#endif /* NUMPARSE_H */
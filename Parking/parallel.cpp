@@ -0,0 +1,57 @@
+#include "parallel.h"
+
+#include <QThread>
+
+class ParallelWorker : public QThread {
+public:
+	ParallelFunc func;
+	void *ctx;
+	int first;
+	int last;
+	int thread;
+protected:
+	void run() {
+		func(ctx,first,last,thread);
+	}
+};
+
+
+int parallelThreadCount(int requested)
+{
+	if (requested>0) return requested;
+	int n=QThread::idealThreadCount();
+	return n>0 ? n : 1;
+}
+
+
+void parallelFor(int count,int threads,ParallelFunc func,void *ctx)
+{
+	if (count<=0) return;
+
+	threads=parallelThreadCount(threads);
+	if (threads>count) threads=count;
+
+	if (threads==1) {
+		func(ctx,0,count,0);
+		return;
+	}
+
+	ParallelWorker *workers=new ParallelWorker[threads-1];
+	int k;
+	for (k=1; k<threads; k++) {
+		ParallelWorker &W=workers[k-1];
+		W.func=func;
+		W.ctx=ctx;
+		W.first=(int)((long long)count*k/threads);
+		W.last=(int)((long long)count*(k+1)/threads);
+		W.thread=k;
+		W.start();
+	}
+
+	func(ctx,0,(int)((long long)count/threads),0);
+
+	for (k=1; k<threads; k++) {
+		workers[k-1].wait();
+	}
+	delete []workers;
+}
@@ -0,0 +1,16 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ Minimal fork/join helper for the loaders. [0,count) is split in
+ contiguous ranges [first,last), one per thread; thread 0 runs on the
+ calling thread and parallelFor returns when every range is done.
+*/
+typedef void (*ParallelFunc)(void *ctx,int first,int last,int thread);
+
+/*Number of threads to use: requested if positive, otherwise all cores*/
+int parallelThreadCount(int requested);
+
+void parallelFor(int count,int threads,ParallelFunc func,void *ctx);
+
+#endif /* PARALLEL_H */
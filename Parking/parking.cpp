@@ -48,10 +48,11 @@ void parking::loadSTL()
 	QString file=QFileDialog::getOpenFileName(this,QString::fromLocal8Bit("Open File..."),
 		QString::fromLocal8Bit(""),QString::fromLocal8Bit("STL Files (*.stl)"));
 	if (!file.isEmpty()) {
-		if (!Widget->geom) {
+		if (Widget->geom) {
 			delete Widget->geom;
 		}
 		Widget->geom=new Geometry;
+		Widget->geom->trustFileNormals=ui.action_TrustSTLNormals->isChecked();
 
 		Widget->geom->loadSTL(file.toLocal8Bit().data());
 	}
@@ -63,7 +64,7 @@ void parking::loadDXF()
 	QString file=QFileDialog::getOpenFileName(this,QString::fromLocal8Bit("Open File..."),
 		QString::fromLocal8Bit(""),QString::fromLocal8Bit("DXF Files (*.dxf)"));
 	if (!file.isEmpty()) {
-		if (!Widget->geom) {
+		if (Widget->geom) {
 			delete Widget->geom;
 		}
 		Widget->geom=new Geometry;
@@ -77,7 +78,7 @@ void parking::load3DS()
 	QString file=QFileDialog::getOpenFileName(this,QString::fromLocal8Bit("Open File..."),
 		QString::fromLocal8Bit(""),QString::fromLocal8Bit("3DS Files (*.3ds)"));
 	if (!file.isEmpty()) {
-		if (!Widget->geom) {
+		if (Widget->geom) {
 			delete Widget->geom;
 		}
 		Widget->geom=new Geometry;
@@ -92,7 +93,7 @@ void parking::loadIGES()
         QString file=QFileDialog::getOpenFileName(this,QString::fromLocal8Bit("Open File..."),
                 QString::fromLocal8Bit(""),QString::fromLocal8Bit("IGES Files (*.igs ; *.iges)"));
         if (!file.isEmpty()) {
-                if (!Widget->geom) {
+                if (Widget->geom) {
                         delete Widget->geom;
                 }
                 Widget->geom=new Geometry;
@@ -1,11 +1,541 @@
 #include "stl_reader.h"
 
 #include "geometry.h"
+#include "numparse.h"
+#include "parallel.h"
+#include "weld.h"
+#include "mapped_file.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
 #include <qdebug.h>
+#include <QElapsedTimer>
+
+/*Binary STL: 80 bytes header, triangle count, then fixed 50 bytes records*/
+static const int STL_HEADER_SIZE=84;
+static const int STL_RECORD_SIZE=50;
+
+/*VisCAM/SolidView: the attribute word holds a color when bit 15 is set*/
+static const unsigned short STL_COLOR_VALID=0x8000;
+
+
+static void reportThroughput(const char *what,qint64 bytes,unsigned int count,qint64 msec)
+{
+	double sec=msec/1000.;
+	if (sec<=0) sec=1e-3;
+	qDebug("Time to %s: %lld msec (%.1f MB/s, %.0f triangles/s)",what,msec,bytes/(1024.*1024.)/sec,count/sec);
+}
+
+
+/*
+ Keeps the file normal when it is unit length and within 60 degrees of the
+ winding normal, otherwise the winding normal is used
+*/
+static inline void setFileNormal(Triangle *T,const float n[3],const float crd[3][3])
+{
+	float e1[3],e2[3],c[3];
+	float l,d,cc;
+	vec_diff(e1,crd[1],crd[0]);
+	vec_diff(e2,crd[2],crd[0]);
+	vec_cross_product(c,e1,e2);
+	vec_dot_product(&l,n,n);
+	vec_dot_product(&d,n,c);
+	vec_dot_product(&cc,c,c);
+	if (l>0.98f && l<1.02f && (cc==0 || (d>0 && d*d>=0.25f*cc*l))) {
+		vec_copy(T->normal.data,n);
+	} else {
+		vec_normalize(c);
+		vec_copy(T->normal.data,c);
+	}
+}
+
+
+/*Attribute words are kept for all new triangles, dropped again if none has a color*/
+static unsigned short *prepareColors(Geometry *geom,unsigned int firstTria,unsigned int count)
+{
+	unsigned int k=geom->triangleColors.length();
+	geom->triangleColors.resize(firstTria+count);
+	for (; k<firstTria; k++) geom->triangleColors.at(k)=0;
+	return count ? &geom->triangleColors.at(firstTria) : 0;
+}
+
+static void finishColors(Geometry *geom,int colored)
+{
+	unsigned int k;
+	for (k=0; !colored && k<geom->triangleColors.length(); k++) {
+		if (geom->triangleColors.at(k)&STL_COLOR_VALID) colored=1;
+	}
+	if (!colored) geom->triangleColors.truncate();
+}
+
+
+/*Below this many records per thread the decode stays sequential*/
+static const int STL_MIN_RECORDS_PER_THREAD=65536;
+
+static int decodeThreads(Geometry *geom,unsigned int count)
+{
+	int threads=parallelThreadCount(geom->loadThreads);
+	int maxThreads=count/STL_MIN_RECORDS_PER_THREAD+1;
+	return threads>maxThreads ? maxThreads : threads;
+}
+
+class STLDecodeJob {
+public:
+	const unsigned char *rec;
+	Grid *grids;
+	Triangle *triangles;
+	unsigned short *colors;
+	int firstGrid;
+	int trustNormals;
+	float (*mn)[3];
+	float (*mx)[3];
+	int *colored;
+};
+
+/*Decodes records [first,last) into their pre-sized grid and triangle slices*/
+static void decodeBinarySTLRange(void *ctx,int first,int last,int thread)
+{
+	STLDecodeJob *job=(STLDecodeJob *)ctx;
+
+	const unsigned char *rec=job->rec+(qint64)first*STL_RECORD_SIZE;
+	Grid *G=&job->grids[3*first];
+	Triangle *T=&job->triangles[first];
+	unsigned short *C=&job->colors[first];
+	unsigned short colored=0;
+	float *mn=job->mn[thread];
+	float *mx=job->mx[thread];
+
+	int k,k1,k2;
+	int id=job->firstGrid+3*first;
+	for (k=first; k<last; k++) {
+		float data[4][3];
+		memcpy(data,rec,12*sizeof(float));
+		memcpy(C,rec+48,sizeof(unsigned short));
+		colored|=*C;
+		C++;
+		rec+=STL_RECORD_SIZE;
+
+		for (k1=0; k1<3; k1++) {
+			const float *crd=data[k1+1];
+			G->pos=id;
+			G->coords[0]=crd[0];
+			G->coords[1]=crd[1];
+			G->coords[2]=crd[2];
+			for (k2=0; k2<3; k2++) {
+				if (mn[k2]>crd[k2]) mn[k2]=crd[k2];
+				if (mx[k2]<crd[k2]) mx[k2]=crd[k2];
+			}
+			T->node[k1]=id;
+			G++; id++;
+		}
+		if (job->trustNormals) setFileNormal(T,data[0],&data[1]);
+		else T->normal.zero();
+		T++;
+	}
+	job->colored[thread]=(colored&STL_COLOR_VALID)!=0;
+}
+
+
+/*Decodes count records starting at rec, split over the loader threads*/
+static void decodeBinarySTL(Geometry *geom,const unsigned char *rec,unsigned int count)
+{
+	if (!count) return;
+
+	unsigned int firstGrid=geom->grids.length();
+	unsigned int firstTria=geom->triangles.length();
+	geom->grids.resize(firstGrid+3*count);
+	geom->triangles.resize(firstTria+count);
+
+	int threads=decodeThreads(geom,count);
+
+	STLDecodeJob job;
+	job.rec=rec;
+	job.grids=&geom->grids.at(firstGrid);
+	job.triangles=&geom->triangles.at(firstTria);
+	job.colors=prepareColors(geom,firstTria,count);
+	job.firstGrid=firstGrid;
+	job.trustNormals=geom->trustFileNormals;
+	job.mn=new float[threads][3];
+	job.mx=new float[threads][3];
+	job.colored=new int[threads];
+
+	int k,k1;
+	for (k=0; k<threads; k++) {
+		for (k1=0; k1<3; k1++) {
+			job.mn[k][k1]=FLT_MAX;
+			job.mx[k][k1]=-FLT_MAX;
+		}
+		job.colored[k]=0;
+	}
+
+	parallelFor(count,threads,decodeBinarySTLRange,&job);
+
+	for (k=1; k<threads; k++) {
+		for (k1=0; k1<3; k1++) {
+			if (job.mn[0][k1]>job.mn[k][k1]) job.mn[0][k1]=job.mn[k][k1];
+			if (job.mx[0][k1]<job.mx[k][k1]) job.mx[0][k1]=job.mx[k][k1];
+		}
+	}
+	geom->mergeBoundingBox(firstGrid,job.mn[0],job.mx[0]);
+
+	int colored=0;
+	for (k=0; k<threads; k++) colored|=job.colored[k];
+	finishColors(geom,colored);
+
+	delete []job.mn;
+	delete []job.mx;
+	delete []job.colored;
+}
+
+
+/*Appends one triangle at a time, through the welder when one is given*/
+class STLSink {
+public:
+	Geometry *geom;
+	GridWelder *welder;
+	int firstGrid;
+	float mn[3],mx[3];
+
+	STLSink(Geometry *g,GridWelder *w) {
+		geom=g;
+		welder=w;
+		firstGrid=geom->grids.length();
+	}
+
+	/*normal is the file normal, or 0 when it is not trusted*/
+	void addTriangle(const float crd[3][3],const float *normal) {
+		int k1,k2;
+		int id[3];
+		if (welder) {
+			for (k1=0; k1<3; k1++) {
+				id[k1]=welder->addGrid(crd[k1]);
+			}
+			addTriangle(id,crd,normal);
+			return;
+		}
+
+		Grid G;
+		for (k1=0; k1<3; k1++) {
+			G.pos=geom->grids.length();
+			for (k2=0; k2<3; k2++) {
+				G.coords[k2]=crd[k1][k2];
+				if (G.pos==firstGrid) {
+					mn[k2]=mx[k2]=crd[k1][k2];
+				} else {
+					if (mn[k2]>crd[k1][k2]) mn[k2]=crd[k1][k2];
+					if (mx[k2]<crd[k1][k2]) mx[k2]=crd[k1][k2];
+				}
+			}
+			geom->grids.append(G);
+			id[k1]=G.pos;
+		}
+		addTriangle(id,crd,normal);
+	}
+
+	void addTriangle(const int id[3],const float crd[3][3],const float *normal) {
+		int t=geom->addTriangle(id[0],id[1],id[2],0);
+		if (normal) setFileNormal(&geom->triangles.at(t),normal,crd);
+	}
+
+	void finish() {
+		if (welder) welder->finish();
+		else if (geom->grids.length()>firstGrid) geom->mergeBoundingBox(firstGrid,mn,mx);
+	}
+};
+
+
+/*
+ Welded decode over the loader threads: each thread welds its records into
+ grids of its own, thread 0 straight into geom. The grids of the later
+ threads then go through the welder of thread 0 in thread order, which
+ leaves them in order of first use, as the sequential decode does
+*/
+class STLWeldJob {
+public:
+	const unsigned char *rec;
+	Triangle *triangles;
+	unsigned short *colors;
+	int trustNormals;
+	GridWelder **welders;
+	myVector<Grid> *grids;
+	int **remap;
+	int *colored;
+};
+
+static void weldBinarySTLRange(void *ctx,int first,int last,int thread)
+{
+	STLWeldJob *job=(STLWeldJob *)ctx;
+
+	/*A closed mesh has about half as many vertices as triangles*/
+	if (thread) job->welders[thread]=new GridWelder(&job->grids[thread],(last-first)/2+1);
+	GridWelder *welder=job->welders[thread];
+
+	const unsigned char *rec=job->rec+(qint64)first*STL_RECORD_SIZE;
+	Triangle *T=&job->triangles[first];
+	unsigned short *C=&job->colors[first];
+	unsigned short colored=0;
+
+	int k,k1;
+	for (k=first; k<last; k++) {
+		float data[4][3];
+		memcpy(data,rec,12*sizeof(float));
+		memcpy(C,rec+48,sizeof(unsigned short));
+		colored|=*C;
+		C++;
+		rec+=STL_RECORD_SIZE;
+
+		for (k1=0; k1<3; k1++) T->node[k1]=welder->addGrid(data[k1+1]);
+		if (job->trustNormals) setFileNormal(T,data[0],&data[1]);
+		else T->normal.zero();
+		T++;
+	}
+	job->colored[thread]=(colored&STL_COLOR_VALID)!=0;
+}
+
+/*Triangles of the later threads, from their own grids to geom's*/
+static void remapBinarySTLRange(void *ctx,int first,int last,int thread)
+{
+	STLWeldJob *job=(STLWeldJob *)ctx;
+	if (!thread) return;
+
+	const int *remap=job->remap[thread];
+	Triangle *T=&job->triangles[first];
+	int k,k1;
+	for (k=first; k<last; k++) {
+		for (k1=0; k1<3; k1++) T->node[k1]=remap[T->node[k1]];
+		T++;
+	}
+}
+
+static void decodeBinarySTLWeldedParallel(Geometry *geom,const unsigned char *rec,unsigned int count,int threads)
+{
+	GridWelder welder(geom,count/2+1);
+
+	unsigned int firstTria=geom->triangles.length();
+	geom->triangles.resize(firstTria+count);
+
+	STLWeldJob job;
+	job.rec=rec;
+	job.triangles=&geom->triangles.at(firstTria);
+	job.colors=prepareColors(geom,firstTria,count);
+	job.trustNormals=geom->trustFileNormals;
+	job.welders=new GridWelder *[threads];
+	job.grids=new myVector<Grid>[threads];
+	job.remap=new int *[threads];
+	job.colored=new int[threads];
+	job.welders[0]=&welder;
+
+	parallelFor(count,threads,weldBinarySTLRange,&job);
+
+	int k;
+	unsigned int i;
+	for (k=1; k<threads; k++) {
+		myVector<Grid> &G=job.grids[k];
+		delete job.welders[k];
+		job.remap[k]=new int[G.length()];
+		for (i=0; i<G.length(); i++) job.remap[k][i]=welder.addGrid(G.at(i).coords);
+		G.truncate();
+	}
+
+	parallelFor(count,threads,remapBinarySTLRange,&job);
+	welder.finish();
+
+	int colored=0;
+	for (k=0; k<threads; k++) colored|=job.colored[k];
+	finishColors(geom,colored);
+
+	for (k=1; k<threads; k++) delete []job.remap[k];
+	delete []job.welders;
+	delete []job.grids;
+	delete []job.remap;
+	delete []job.colored;
+}
+
+
+/*Decode that welds equal vertices as the records come in*/
+static void decodeBinarySTLWelded(Geometry *geom,const unsigned char *rec,unsigned int count)
+{
+	int threads=decodeThreads(geom,count);
+	if (threads>1) {
+		decodeBinarySTLWeldedParallel(geom,rec,count,threads);
+		return;
+	}
+
+	/*A closed mesh has about half as many vertices as triangles*/
+	GridWelder welder(geom,count/2+1);
+	STLSink sink(geom,&welder);
+
+	unsigned int firstTria=geom->triangles.length();
+	geom->triangles.reserve(firstTria+count);
+	unsigned short *C=prepareColors(geom,firstTria,count);
+	unsigned short colored=0;
+
+	int trustNormals=geom->trustFileNormals;
+	unsigned int k;
+	for (k=0; k<count; k++) {
+		float data[4][3];
+		memcpy(data,rec,12*sizeof(float));
+		memcpy(&C[k],rec+48,sizeof(unsigned short));
+		colored|=C[k];
+		rec+=STL_RECORD_SIZE;
+		sink.addTriangle(&data[1],trustNormals ? data[0] : 0);
+	}
+
+	sink.finish();
+	finishColors(geom,(colored&STL_COLOR_VALID)!=0);
+}
+
+
+/*
+ ASCII STL: "solid name / facet normal n n n / outer loop / vertex x y z ... /
+ endloop / endfacet / endsolid name". The buffer is tokenized in place;
+ loops with more than three vertices are split as a fan.
+*/
+static unsigned int decodeAsciiSTL(Geometry *geom,const char *p,const char *end)
+{
+	/*Rough guess of 250 bytes per facet saves most of the regrowing*/
+	unsigned int expected=(end-p)/250;
+
+	GridWelder *welder=0;
+	if (geom->weldOnLoad) {
+		welder=new GridWelder(geom,expected/2+1);
+	} else {
+		geom->grids.reserve(geom->grids.length()+3*expected);
+	}
+	geom->triangles.reserve(geom->triangles.length()+expected);
+
+	STLSink sink(geom,welder);
+	unsigned int count=0;
+
+	int trustNormals=geom->trustFileNormals;
+	float normal[3]={0,0,0};
+	float crd[3][3];
+	int nv=0;
+	int k;
+
+	while (p<end) {
+		p=skipBlanks(p,end);
+		if (p==end) break;
+
+		const char *w=p;
+		p=skipWord(p,end);
+		int len=p-w;
+
+		if (w[0]=='v' && len==6 && !memcmp(w,"vertex",6)) {
+			float v[3];
+			for (k=0; k<3; k++) {
+				double d;
+				const char *q=skipBlanks(p,end);
+				p=parseDouble(q,end,&d);
+				if (p==q) break;
+				v[k]=d;
+			}
+			if (k<3) {
+				p=skipWord(p,end);
+				continue;
+			}
+			if (nv<3) {
+				memcpy(crd[nv],v,sizeof(v));
+			} else {
+				memcpy(crd[1],crd[2],sizeof(v));
+				memcpy(crd[2],v,sizeof(v));
+			}
+			nv++;
+			if (nv>=3) {
+				sink.addTriangle(crd,trustNormals ? normal : 0);
+				count++;
+			}
+		} else if (w[0]=='f' && len==5 && !memcmp(w,"facet",5)) {
+			/*facet normal nx ny nz*/
+			nv=0;
+			normal[0]=normal[1]=normal[2]=0;
+			const char *q=skipBlanks(p,end);
+			if (end-q>=6 && !memcmp(q,"normal",6)) {
+				p=q+6;
+				for (k=0; k<3; k++) {
+					double d;
+					q=skipBlanks(p,end);
+					p=parseDouble(q,end,&d);
+					if (p==q) break;
+					normal[k]=d;
+				}
+			}
+		} else if (w[0]=='e' && len==7 && !memcmp(w,"endloop",7)) {
+			nv=0;
+		} else if ((w[0]=='s' && len==5 && !memcmp(w,"solid",5)) ||
+			(w[0]=='e' && len==8 && !memcmp(w,"endsolid",8))) {
+			/*The solid name runs to the end of the line*/
+			while (p<end && *p!='\n') p++;
+			nv=0;
+		}
+	}
+
+	sink.finish();
+	delete welder;
+	return count;
+}
+
+
+/*Binary files have an exact size; otherwise an ASCII file starts with "solid"*/
+static int isAsciiSTL(const unsigned char *buf,qint64 size)
+{
+	if (size>=STL_HEADER_SIZE) {
+		unsigned int count;
+		memcpy(&count,buf+80,sizeof(unsigned int));
+		if (STL_HEADER_SIZE+(qint64)count*STL_RECORD_SIZE==size) return 0;
+	}
+	/*Binary headers may start with "solid" too, but text has no NUL bytes*/
+	qint64 k;
+	for (k=0; k<size && k<512; k++) {
+		if (buf[k]==0) return 0;
+	}
+	const char *p=skipBlanks((const char *)buf,(const char *)buf+size);
+	const char *end=(const char *)buf+size;
+	return end-p>=5 && !memcmp(p,"solid",5);
+}
+
 
 void readSTL(Geometry *geom,const char *name)
+{
+	MappedFile file;
+	if (!file.open(name)) return;
+
+	QElapsedTimer t;
+	t.start();
+
+	const unsigned char *buf=file.data;
+	qint64 fileSize=file.size;
+
+	unsigned int size;
+	if (isAsciiSTL(buf,fileSize)) {
+		size=decodeAsciiSTL(geom,file.begin(),file.end());
+		reportThroughput("read ASCII STL",fileSize,size,t.elapsed());
+		/*ASCII has no colors: triangles read before keep theirs, the new ones get none*/
+		if (geom->triangleColors.length()) prepareColors(geom,geom->triangles.length(),0);
+	} else if (fileSize>=STL_HEADER_SIZE) {
+		memcpy(&size,buf+80,sizeof(unsigned int));
+
+		qint64 available=(fileSize-STL_HEADER_SIZE)/STL_RECORD_SIZE;
+		if (size>available) {
+			qDebug("STL file declares %u triangles, only %lld present",size,available);
+			size=available;
+		}
+
+		if (geom->weldOnLoad) {
+			decodeBinarySTLWelded(geom,buf+STL_HEADER_SIZE,size);
+		} else {
+			decodeBinarySTL(geom,buf+STL_HEADER_SIZE,size);
+		}
+		reportThroughput("read STL",fileSize,size,t.elapsed());
+	}
+
+	geom->gridsWelded=geom->weldOnLoad;
+}
+
+
+void readSTLStream(Geometry *geom,const char *name)
 {
 	FILE *fp=fopen(name,"rb");
 	if (!fp) return;
@@ -17,10 +547,8 @@ void readSTL(Geometry *geom,const char *name)
 
 	int k,k1;
 	for (k=0; k<size; k++) {
-		if ((k&0xff)==0) qDebug("Reading triangle %d of %d",k,size);
-		
 		float data[4][3];
-		
+
 		float crd[3][3];
 		float norm[3];
 
@@ -42,5 +570,5 @@ void readSTL(Geometry *geom,const char *name)
 
 	fclose(fp);
 
-	
-}
\ No newline at end of file
+
+}
@@ -3,6 +3,10 @@
 
 class Geometry;
 
+/*Memory-mapped STL reader, binary or ASCII layout is detected*/
 void readSTL(Geometry *geom,const char *name);
 
+/*Record by record fread reader for binary files, kept as benchmark baseline*/
+void readSTLStream(Geometry *geom,const char *name);
+
 #endif
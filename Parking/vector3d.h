@@ -3,6 +3,8 @@
 
 #include <cmath>
 
+const float pi=3.141593;
+
 template <typename T> 
 class vector3d {
 	vector3d(const vector3d &r);
@@ -0,0 +1,399 @@
+#include "weld.h"
+
+#include "geometry.h"
+#include "parallel.h"
+
+#include <string.h>
+#include <math.h>
+#include <cfloat>
+
+
+GridWelder::GridWelder(Geometry *g,unsigned int expected)
+{
+	geom=g;
+	grids=&g->grids;
+	init(expected);
+}
+
+GridWelder::GridWelder(myVector<Grid> *g,unsigned int expected)
+{
+	geom=0;
+	grids=g;
+	init(expected);
+}
+
+void GridWelder::init(unsigned int expected)
+{
+	firstGrid=grids->length();
+	used=0;
+
+	/*Keep the table at most half full*/
+	unsigned int size=1024;
+	while (size<2*expected) size*=2;
+	mask=size-1;
+	table=(int *)malloc(size*sizeof(int));
+	memset(table,0xff,size*sizeof(int));
+
+	grids->reserve(firstGrid+expected);
+}
+
+GridWelder::~GridWelder()
+{
+	free(table);
+}
+
+unsigned int GridWelder::hashCoords(const float crd[3])
+{
+	unsigned int b[3];
+	int k;
+	for (k=0; k<3; k++) {
+		/*+0.0 and -0.0 are the same position*/
+		float c=crd[k]+0.0f;
+		memcpy(&b[k],&c,sizeof(unsigned int));
+	}
+	unsigned int h=b[0]*73856093u ^ b[1]*19349663u ^ b[2]*83492791u;
+	h^=h>>15;
+	h*=0x2c1b3c6du;
+	h^=h>>12;
+	return h;
+}
+
+void GridWelder::grow()
+{
+	unsigned int size=2*(mask+1);
+	free(table);
+	mask=size-1;
+	table=(int *)malloc(size*sizeof(int));
+	memset(table,0xff,size*sizeof(int));
+
+	unsigned int k;
+	for (k=firstGrid; k<grids->length(); k++) {
+		unsigned int h=hashCoords(grids->at(k).coords)&mask;
+		while (table[h]!=-1) h=(h+1)&mask;
+		table[h]=k;
+	}
+}
+
+int GridWelder::addGrid(const float crd[3])
+{
+	unsigned int h=hashCoords(crd)&mask;
+	int id;
+	while ((id=table[h])!=-1) {
+		const float *c=grids->at(id).coords;
+		if (c[0]==crd[0] && c[1]==crd[1] && c[2]==crd[2]) return id;
+		h=(h+1)&mask;
+	}
+
+	Grid G;
+	G.pos=grids->length();
+	G.coords[0]=crd[0];
+	G.coords[1]=crd[1];
+	G.coords[2]=crd[2];
+	grids->append(G);
+
+	int k;
+	if (G.pos==firstGrid) {
+		for (k=0; k<3; k++) mn[k]=mx[k]=crd[k];
+	} else {
+		for (k=0; k<3; k++) {
+			if (mn[k]>crd[k]) mn[k]=crd[k];
+			if (mx[k]<crd[k]) mx[k]=crd[k];
+		}
+	}
+
+	table[h]=G.pos;
+	used++;
+	if (2*used>mask) grow();
+
+	return G.pos;
+}
+
+void GridWelder::finish()
+{
+	if (geom && grids->length()>firstGrid) geom->mergeBoundingBox(firstGrid,mn,mx);
+}
+
+
+/*
+ Grid welding: grids are bucketed by a hash of their cell, cells being 64
+ tolerances wide. A grid within tolerance of another is then in its own
+ cell or in one of the cells next to the near faces, at most 8 buckets.
+ Buckets are built by a counting sort in two levels: grids with their
+ coordinates go to partitions (runs of buckets) per thread, then each
+ partition is sorted into its buckets and searched on its own, mostly
+ within its own cache sized slice
+*/
+static const int WELD_PARTITION_BITS=8;
+static const int WELD_PARTITIONS=1<<WELD_PARTITION_BITS;
+
+class WeldEntry {
+public:
+	float coords[3];
+	int grid;
+};
+
+class WeldTable {
+public:
+	Geometry *geom;
+	unsigned int n;
+	int threads;
+	double origin[3];
+	double cell,invCell;
+	double tol,tol2;
+	unsigned int bucketMask;
+	int shift;
+
+	float (*bounds)[6];
+	unsigned int *bucket;
+	int *partitionStart;
+	WeldEntry *entries;
+	int *bucketStart;
+	int *rep;
+
+	void cellOf(const float p[3],int c[3],double frac[3]) const {
+		int k;
+		for (k=0; k<3; k++) {
+			double x=(p[k]-origin[k])*invCell;
+			c[k]=(int)x;
+			frac[k]=x-c[k];
+		}
+	}
+};
+
+static inline unsigned int hashCell(int x,int y,int z)
+{
+	unsigned int h=(unsigned int)x*73856093u ^ (unsigned int)y*19349663u ^ (unsigned int)z*83492791u;
+	h^=h>>15;
+	h*=0x2c1b3c6du;
+	h^=h>>12;
+	return h;
+}
+
+static void weldBounds(void *ctx,int first,int last,int thread)
+{
+	WeldTable &W=*(WeldTable *)ctx;
+	float *b=W.bounds[thread];
+	int i,k;
+	for (k=0; k<3; k++) {
+		b[k]=FLT_MAX;
+		b[3+k]=-FLT_MAX;
+	}
+	for (i=first; i<last; i++) {
+		const float *p=W.geom->grids.at(i).coords;
+		for (k=0; k<3; k++) {
+			if (b[k]>p[k]) b[k]=p[k];
+			if (b[3+k]<p[k]) b[3+k]=p[k];
+		}
+	}
+}
+
+static void weldBuckets(void *ctx,int first,int last,int thread)
+{
+	WeldTable &W=*(WeldTable *)ctx;
+	int *count=W.partitionStart+thread*WELD_PARTITIONS;
+	int i,c[3];
+	double frac[3];
+	for (i=first; i<last; i++) {
+		W.cellOf(W.geom->grids.at(i).coords,c,frac);
+		unsigned int b=hashCell(c[0],c[1],c[2])&W.bucketMask;
+		W.bucket[i]=b;
+		count[b>>W.shift]++;
+	}
+}
+
+static void weldScatter(void *ctx,int first,int last,int thread)
+{
+	WeldTable &W=*(WeldTable *)ctx;
+	int *next=W.partitionStart+thread*WELD_PARTITIONS;
+	int i;
+	for (i=first; i<last; i++) {
+		WeldEntry &E=W.entries[next[W.bucket[i]>>W.shift]++];
+		const float *p=W.geom->grids.at(i).coords;
+		E.coords[0]=p[0];
+		E.coords[1]=p[1];
+		E.coords[2]=p[2];
+		E.grid=i;
+	}
+}
+
+/*First entry of bucket b within tolerance of p and below best, best if none*/
+static inline int weldSearch(const WeldTable &W,unsigned int b,const float p[3],int best)
+{
+	int j,e=W.bucketStart[b+1];
+	for (j=W.bucketStart[b]; j<e; j++) {
+		const WeldEntry &E=W.entries[j];
+		if (E.grid>=best) break;
+		double dx=E.coords[0]-p[0],dy=E.coords[1]-p[1],dz=E.coords[2]-p[2];
+		if (dx*dx+dy*dy+dz*dz<=W.tol2) return E.grid;
+	}
+	return best;
+}
+
+/*
+ Partitions [first,last) into their buckets, grids stay in index order. All
+ partitions are sorted before any is searched
+*/
+static void weldSortPartitions(void *ctx,int first,int last,int thread)
+{
+	WeldTable &W=*(WeldTable *)ctx;
+	int p;
+	for (p=first; p<last; p++) {
+		int from=W.partitionStart[p];
+		int to=W.partitionStart[p+1];
+		int n=to-from;
+		if (!n) {
+			unsigned int b;
+			for (b=(unsigned int)p<<W.shift; b<(unsigned int)(p+1)<<W.shift; b++) W.bucketStart[b]=from;
+			continue;
+		}
+		WeldEntry *copy=(WeldEntry *)malloc(n*sizeof(WeldEntry));
+		unsigned int *bucket=(unsigned int *)malloc(n*sizeof(unsigned int));
+		memcpy(copy,W.entries+from,n*sizeof(WeldEntry));
+
+		unsigned int b0=(unsigned int)p<<W.shift;
+		unsigned int b1=(unsigned int)(p+1)<<W.shift;
+		unsigned int b;
+		int i,c[3];
+		double frac[3];
+		for (b=b0; b<b1; b++) W.bucketStart[b]=0;
+		for (i=0; i<n; i++) {
+			W.cellOf(copy[i].coords,c,frac);
+			bucket[i]=hashCell(c[0],c[1],c[2])&W.bucketMask;
+			W.bucketStart[bucket[i]]++;
+		}
+		int start=from;
+		for (b=b0; b<b1; b++) {
+			int k=W.bucketStart[b];
+			W.bucketStart[b]=start;
+			start+=k;
+		}
+		for (i=0; i<n; i++) W.entries[W.bucketStart[bucket[i]]++]=copy[i];
+		/*Back from ends to starts*/
+		for (b=b1-1; b>b0; b--) W.bucketStart[b]=W.bucketStart[b-1];
+		W.bucketStart[b0]=from;
+
+		free(bucket);
+		free(copy);
+	}
+}
+
+/*Lowest grid within tolerance of each grid, itself if none is lower*/
+static void weldRepresentatives(void *ctx,int first,int last,int thread)
+{
+	WeldTable &W=*(WeldTable *)ctx;
+	int j,k,c[3],side[3];
+	double frac[3];
+	for (j=W.partitionStart[first]; j<W.partitionStart[last]; j++) {
+		const WeldEntry &E=W.entries[j];
+		W.cellOf(E.coords,c,frac);
+		unsigned int own=hashCell(c[0],c[1],c[2])&W.bucketMask;
+
+		/*Lower grids of the own bucket come first*/
+		int best=weldSearch(W,own,E.coords,E.grid);
+
+		for (k=0; k<3; k++) {
+			side[k]=0;
+			if (frac[k]*W.cell<W.tol) side[k]=-1;
+			else if ((1-frac[k])*W.cell<W.tol) side[k]=1;
+		}
+		int m;
+		for (m=1; m<8; m++) {
+			if (((m&1) && !side[0]) || ((m&2) && !side[1]) || ((m&4) && !side[2])) continue;
+			unsigned int b=hashCell(c[0]+((m&1) ? side[0] : 0),c[1]+((m&2) ? side[1] : 0),c[2]+((m&4) ? side[2] : 0))&W.bucketMask;
+			if (b!=own) best=weldSearch(W,b,E.coords,best);
+		}
+		W.rep[E.grid]=best;
+	}
+}
+
+
+int weldGrids(Geometry *geom,float tolerance,int threads,int *realPos)
+{
+	WeldTable W;
+	W.geom=geom;
+	W.n=geom->grids.length();
+	if (!W.n) return 0;
+	W.threads=parallelThreadCount(threads);
+	if (W.threads>(int)W.n) W.threads=W.n;
+
+	/*Box of the grids, the tolerance and cells follow its diagonal*/
+	W.bounds=new float[W.threads][6];
+	parallelFor(W.n,W.threads,weldBounds,&W);
+	float mn[3],mx[3];
+	int k,t;
+	for (k=0; k<3; k++) {
+		mn[k]=W.bounds[0][k];
+		mx[k]=W.bounds[0][3+k];
+		for (t=1; t<W.threads; t++) {
+			if (mn[k]>W.bounds[t][k]) mn[k]=W.bounds[t][k];
+			if (mx[k]<W.bounds[t][3+k]) mx[k]=W.bounds[t][3+k];
+		}
+		W.origin[k]=mn[k];
+	}
+	delete []W.bounds;
+	double diag=sqrt((double)(mx[0]-mn[0])*(mx[0]-mn[0])+(double)(mx[1]-mn[1])*(mx[1]-mn[1])+(double)(mx[2]-mn[2])*(mx[2]-mn[2]));
+	W.tol=tolerance>0 ? tolerance*diag : 0;
+	W.tol2=W.tol*W.tol;
+	W.cell=W.tol>0 ? 64*W.tol : 64e-6*diag;
+	if (W.cell<=0) W.cell=1;
+	W.invCell=1/W.cell;
+
+	/*About one bucket per grid*/
+	int bits=WELD_PARTITION_BITS;
+	while (bits<31 && (1u<<bits)<W.n) bits++;
+	W.bucketMask=(1u<<bits)-1;
+	W.shift=bits-WELD_PARTITION_BITS;
+
+	W.bucket=(unsigned int *)malloc(W.n*sizeof(unsigned int));
+	W.entries=(WeldEntry *)malloc(W.n*sizeof(WeldEntry));
+	W.bucketStart=(int *)malloc(((size_t)W.bucketMask+2)*sizeof(int));
+	W.partitionStart=(int *)calloc(W.threads*WELD_PARTITIONS,sizeof(int));
+
+	parallelFor(W.n,W.threads,weldBuckets,&W);
+
+	/*Counts per thread and partition to scatter positions, partition major*/
+	int p,start=0;
+	for (p=0; p<WELD_PARTITIONS; p++) {
+		for (t=0; t<W.threads; t++) {
+			int &c=W.partitionStart[t*WELD_PARTITIONS+p];
+			int n=c;
+			c=start;
+			start+=n;
+		}
+	}
+	int *partitionBegin=new int[WELD_PARTITIONS+1];
+	for (p=0; p<WELD_PARTITIONS; p++) partitionBegin[p]=W.partitionStart[p];
+	partitionBegin[WELD_PARTITIONS]=W.n;
+
+	parallelFor(W.n,W.threads,weldScatter,&W);
+
+	free(W.partitionStart);
+	W.partitionStart=partitionBegin;
+	parallelFor(WELD_PARTITIONS,W.threads,weldSortPartitions,&W);
+	W.bucketStart[W.bucketMask+1]=W.n;
+
+	/*The bucket of each grid is no longer needed, its room holds the representatives*/
+	W.rep=(int *)W.bucket;
+	parallelFor(WELD_PARTITIONS,W.threads,weldRepresentatives,&W);
+
+	/*Representatives are lower than their grids, so they are placed first*/
+	unsigned int i;
+	int count=0;
+	for (i=0; i<W.n; i++) {
+		int r=W.rep[i];
+		if (r==(int)i) {
+			if (count!=(int)i) geom->grids.at(count)=geom->grids.at(i);
+			geom->grids.at(count).pos=count;
+			realPos[i]=count++;
+		} else {
+			realPos[i]=realPos[r];
+		}
+	}
+	geom->grids.truncateInto(count);
+
+	delete []W.partitionStart;
+	free(W.bucket);
+	free(W.entries);
+	free(W.bucketStart);
+	return count;
+}
@@ -0,0 +1,47 @@
+#ifndef WELD_H
+#define WELD_H
+
+class Geometry;
+class Grid;
+template <typename T> class myVector;
+
+/*
+ Hash table of vertex positions used while reading: addGrid returns the
+ grid already holding the same position, or appends a new one. Only the
+ distinct vertices ever reach geom->grids, or the grids array it is given.
+*/
+class GridWelder {
+	GridWelder(GridWelder &x); //deactivated copy-constructor
+
+	Geometry *geom;
+	myVector<Grid> *grids;
+	int firstGrid;
+	int *table;
+	unsigned int mask;
+	unsigned int used;
+	float mn[3],mx[3];
+
+	static unsigned int hashCoords(const float crd[3]);
+	void init(unsigned int expected);
+	void grow();
+public:
+	GridWelder(Geometry *g,unsigned int expected);
+	/*Welds into a scratch array, e.g. one per loader thread*/
+	GridWelder(myVector<Grid> *g,unsigned int expected);
+	~GridWelder();
+
+	int addGrid(const float crd[3]);
+
+	/*Merges the bounding box of the added grids into geom, if it has one*/
+	void finish();
+};
+
+
+/*
+ Merges the grids of geom closer than tolerance times the diagonal of their
+ bounding box. Grids keep their order, each group is kept as its first grid.
+ realPos receives the new index of every grid. Returns the grids left
+*/
+int weldGrids(Geometry *geom,float tolerance,int threads,int *realPos);
+
+#endif /* WELD_H */